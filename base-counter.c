@@ -8,12 +8,15 @@
 #include <stdint.h>
 #include <errno.h>
 #include <pthread.h>
+#include "index-format.h"
+#include "inflate-backend.h"
+#include "thread-pool.h"
 
 #define WINSIZE 32768U          /* sliding window size */
 #define CHUNKSIZE 16384         /* file input buffer size */
+#define MAXFEED (1U << 30)      /* most input handed to inflate at once */
 #define MAXLINE 2 * WINSIZE
 #define MSGSIZE 256
-#define MAXTHREADS 16
 
 enum log_level_t {
     LOG_NOTHING,
@@ -27,7 +30,8 @@ enum log_level_t {
 
 enum log_level_t GLOBAL_LEVEL = LOG_INFO;
 int idx_chunk_size = 10000;
-int num_threads = 4;
+int num_threads = 0;            /* -n, or one per CPU if 0 */
+char *read_range = NULL;        /* READ[:COUNT] to count, with -r */
 
 
 /* level_to_string is a utility to toggle log levels */
@@ -57,10 +61,26 @@ void logger(enum log_level_t level, const char* message) {
     }
 }
 
+/* keeps stats per thread, and per sequence index chunk when index-builder
+ * -t stored them */
+struct stats{
+    off_t A;
+    off_t C;
+    off_t G;
+    off_t T;
+    off_t N;
+    off_t reads;
+    off_t bases;        /* total length of the reads */
+    off_t min_len;      /* shortest and longest read */
+    off_t max_len;
+    off_t qual;         /* sum of the Phred+33 quality scores */
+};
+
 struct seq_entry {
     int seq_num;       /* Sequence number */
     off_t start;       /* Offset from the start of block */
     int block;         /* Block number this sequence starts in */
+    struct stats stats;     /* its chunk's reads, if the index has them */
 };
 
 struct seq_list {
@@ -69,14 +89,60 @@ struct seq_list {
     void *seq_entry;    /* List of seq_entries */
 };
 
+/* work_queue hands the sequence chunks out to the threads a few at a time,
+ * so that a thread that gets slow ones (long reads, data that compresses
+ * badly, or a part of the file that isn't cached yet) doesn't hold up the
+ * others. A thread takes the next range with one atomic add */
+#define WORK_WASTE 8            /* a range is this much more than is skipped */
+
+struct work_queue {
+    int next;                   /* the first chunk not taken yet */
+    int nchunks;
+    int grain;                  /* chunks in a range */
+};
+
+/* take_chunks() sets *start and *stop to the next range of chunks, with stop
+ * -1 for the last one, which goes to the end of the file
+ * @returns: 1 if there was a range left, 0 if not
+ */
+static int take_chunks(struct work_queue *q, int *start, int *stop) {
+    int k = __atomic_fetch_add(&q->next, q->grain, __ATOMIC_RELAXED);
+
+    if (k >= q->nchunks)
+        return 0;
+    *start = k;
+    *stop = k + q->grain < q->nchunks ? k + q->grain : -1;
+    return 1;
+}
+
+/* range_grain() picks how many chunks a range holds: enough that what is
+ * inflated only to be thrown away, from the access point of its first chunk
+ * to where the chunk starts, is small next to the range. With a point at the
+ * block each chunk starts in, as index-builder makes them, single chunks do */
+static int range_grain(struct idx_file *index, struct seq_list *list) {
+    struct seq_entry *entries = list->seq_entry;
+    off_t skipped = 0, length = entries[list->have - 1].start + 1;
+
+    for (int i = 0; i < list->have; i++) {
+        const struct idx_point *point = idx_get_point(index, entries[i].block);
+        if (point != NULL)
+            skipped += entries[i].start - point->out;
+    }
+    if ((off_t) index->hdr->length > length)
+        length = index->hdr->length;
+    off_t grain = WORK_WASTE * skipped / length + 1;
+    return grain < list->have ? (int) grain : list->have;
+}
+
 /* task_args contains a pointer to the index struct and the seq chunk struct */
 struct task_args {
     int tid;                                    /* Thread id */
     int start;                                  /* start seq chunk */
     int stop;                                   /* end seq chunk */
-    char * filename;                            /* gz filename to read */
-    struct access * index;                      /* Index point list */
+    const struct idx_input * gz;                /* Mapped gz file to read */
+    struct idx_file * index;                    /* Mapped access point index */
     struct seq_list * list;                     /* Sequence point list */
+    struct work_queue * queue;                  /* Chunks left to count */
 };
 
 
@@ -85,96 +151,12 @@ struct task_args {
  * do */
 struct extract_info{
     char * filename;
-    struct access * index;
-    struct point * this_block;
+    struct idx_file * index;
+    const struct idx_point * this_block;
     off_t seq_offset;
     int nchunks;
 };
 
-/* keeps stats per thread */
-struct stats{
-    off_t A;
-    off_t C;
-    off_t G;
-    off_t T;
-    off_t N;
-};
-
-
-int base64_decode(char* input, size_t input_len, char* output, size_t output_len) {
-    int i, j;
-    unsigned char c;
-    unsigned char buffer[4];
-    unsigned char temp[3];
-
-    for (i = 0, j = 0; i < input_len; i += 4, j += 3) {
-        // Extract 4 base64-encoded characters from input
-        buffer[0] = input[i];
-        buffer[1] = input[i+1];
-        buffer[2] = input[i+2];
-        buffer[3] = input[i+3];
-
-        // Convert base64-encoded characters to their 6-bit values
-        for (int k = 0; k < 4; k++) {
-            if (buffer[k] >= 'A' && buffer[k] <= 'Z') {
-                buffer[k] -= 'A';
-            } else if (buffer[k] >= 'a' && buffer[k] <= 'z') {
-                buffer[k] -= 'a' - 26;
-            } else if (buffer[k] >= '0' && buffer[k] <= '9') {
-                buffer[k] -= '0' - 52;
-            } else if (buffer[k] == '+') {
-                buffer[k] = 62;
-            } else if (buffer[k] == '/') {
-                buffer[k] = 63;
-            }
-        }
-
-        // Combine 4 6-bit values into 3 bytes
-        temp[0] = (buffer[0] << 2) | (buffer[1] >> 4);
-        temp[1] = (buffer[1] << 4) | (buffer[2] >> 2);
-        temp[2] = (buffer[2] << 6) | buffer[3];
-
-        // Copy the decoded bytes to output
-        if (j + 2 < output_len) {
-            output[j] = temp[0];
-            output[j+1] = temp[1];
-            output[j+2] = temp[2];
-        } else {
-            return -1; // Output buffer too small
-        }
-    }
-
-    // Add null terminator to output string
-    output[j] = '\0';
-
-    return j; // Return the number of bytes written to output
-}
-
-/* access point entry  FROM ZRAN */
-struct point {
-    off_t out;          /* corresponding offset in uncompressed data */
-    off_t in;           /* offset in input file of first full byte */
-    int bits;           /* number of bits (1-7) from byte at in - 1, or 0 */
-    unsigned char window[WINSIZE];  /* preceding 32K of uncompressed data */
-};
-
-/* access point list */
-struct access {
-    int have;           /* number of list entries filled in */
-    int size;           /* number of list entries allocated */
-    struct point *list; /* allocated list */
-};
-
-/* Deallocate an index built by build_index() */
-static void free_index(struct access *index)
-{
-    if (index != NULL) {
-        free(index->list);
-        free(index);
-    }
-}
-/* From ZRAN */
-
 static struct seq_list * add_seq(struct seq_list * list, int seqNum,
                                  off_t start, int blockNum) {
 
@@ -209,191 +191,198 @@ static struct seq_list * add_seq(struct seq_list * list, int seqNum,
     next->seq_num = seqNum;
     next->start = start;
     next->block = blockNum;
+    memset(&next->stats, 0, sizeof(struct stats));
     list->have++;
 
     /* return list, possibly reallocated */
     return list;
 }
 
-static struct access *add_read_point(struct access *index, int bits,
-                              off_t in, off_t out, unsigned char *window)
-{
-    struct point *next;
-
-    /* if list is empty, create it (start with eight points) */
-    if (index == NULL) {
-        index = malloc(sizeof(struct access));
-        if (index == NULL) return NULL;
-        index->list = malloc(sizeof(struct point) << 3);
-        if (index->list == NULL) {
-            free(index);
-            return NULL;
-        }
-        index->size = 8;
-        index->have = 0;
+/* add_stats() adds the reads tallied in b to a */
+static void add_stats(struct stats *a, const struct stats *b) {
+    if (b->reads == 0)
+        return;
+    if (a->reads == 0 || b->min_len < a->min_len)
+        a->min_len = b->min_len;
+    if (b->max_len > a->max_len)
+        a->max_len = b->max_len;
+    a->A += b->A;
+    a->C += b->C;
+    a->G += b->G;
+    a->T += b->T;
+    a->N += b->N;
+    a->reads += b->reads;
+    a->bases += b->bases;
+    a->qual += b->qual;
+}
+
+/* cursor is where count_reads() is in the FASTQ it is given */
+struct cursor {
+    off_t line_num;     /* the line, counting from 1 */
+    off_t seq_num;      /* the read, counting from 0 */
+    off_t len;          /* the length of its sequence */
+    int partial;        /* 1 if the last line seen has no newline yet */
+};
+
+/* end_read() tallies the read that has just ended into st if it is read skip
+ * or later, and returns 1 if it is the one before read stop */
+static int end_read(struct cursor *cur, off_t skip, off_t stop, struct stats *st) {
+    if (cur->seq_num >= skip) {
+        if (st->reads == 0 || cur->len < st->min_len)
+            st->min_len = cur->len;
+        if (cur->len > st->max_len)
+            st->max_len = cur->len;
+        st->reads++;
+        st->bases += cur->len;
     }
+    cur->len = 0;
+    cur->seq_num++;
+    /* If we've seen the total number of sequences we need to, stop */
+    return cur->seq_num == stop;
+}
 
-        /* if list is full, make it bigger */
-    else if (index->have == index->size) {
-        index->size <<= 1;
-        next = realloc(index->list, sizeof(struct point) * index->size);
-        if (next == NULL) {
-            free_index(index);
-            return NULL;
+/* count_reads() tallies the reads in the len bytes at buf into st, from read
+ * skip on, and returns 1 once read stop has been reached (never if stop is
+ * < 0). cur carries the position from one call to the next */
+static int count_reads(const unsigned char *buf, unsigned len, struct cursor *cur,
+                       off_t skip, off_t stop, struct stats *st) {
+    for (unsigned i = 0; i < len; i++) {
+        //Check if it's a new line
+        if (buf[i] == '\n') {
+            // This is a new sequence
+            if ((cur->line_num % 4) == 0 && end_read(cur, skip, stop, st))
+                return 1;
+            cur->line_num++;
+        } else if (cur->seq_num < skip) {
+            continue;
+        } else if (cur->line_num % 4 == 2) { //the sequence
+            cur->len++;
+            if (buf[i] == 'A')
+                st->A++;
+            else if (buf[i] == 'C')
+                st->C++;
+            else if (buf[i] == 'G')
+                st->G++;
+            else if (buf[i] == 'T')
+                st->T++;
+            else if (buf[i] == 'N')
+                st->N++;
+            else{
+                printf("Fatal. Encountered unknown nucleotide: %c\n", buf[i]);
+                exit(1);
+            }
+        } else if (cur->line_num % 4 == 0 && buf[i] > 33) { //the quality
+            st->qual += buf[i] - 33;
         }
-        index->list = next;
     }
+    if (len)
+        cur->partial = buf[len - 1] != '\n';
+    return 0;
+}
 
-    /* fill in entry and increment how many we have */
-    next = index->list + index->have;
-    next->bits = bits;
-    next->in = in;
-    next->out = out;
-    strcpy(next->window, window);
-    index->have++;
-
-    /* return list, possibly reallocated */
-    return index;
+/* finish_reads() ends the last read if the data stops in its quality line
+ * without a newline after it, which count_reads() would otherwise wait for */
+static void finish_reads(struct cursor *cur, off_t skip, off_t stop, struct stats *st) {
+    if (cur->partial && cur->line_num % 4 == 0)
+        (void) end_read(cur, skip, stop, st);
 }
 
-struct stats * extract(char * filename, struct access *index, struct point * this,
-        off_t seq_offset, int nchunks)
+/* extract() counts the bases of the reads starting at uncompressed offset
+ * seq_offset, decompressing from access point this: skip reads are passed
+ * over, and then nreads are counted, or all the rest if nreads is < 0 */
+struct stats * extract(const struct idx_input *gz, struct idx_file *index, struct ib_stream *strm,
+        const struct idx_point * this,
+        off_t seq_offset, off_t skip, off_t nreads)
 {
-    int ret, skip, seq_num;
-    z_stream strm;
-    unsigned char input[CHUNKSIZE];
+    int ret, skip_out;
     unsigned char discard[WINSIZE];
     unsigned char buf[WINSIZE];
-    off_t line_num = 1;
-    off_t totout = seq_num = 0;
-    skip = 1;
-    off_t buffsize = 2 * WINSIZE;
-    FILE *in;
+    unsigned char window[WINSIZE];
+    struct cursor cur = {1, 0, 0, 0};
+    off_t stop = nreads < 0 ? -1 : skip + nreads;
+    off_t totout = 0;
+    skip_out = 1;
+    uint64_t pos;                       /* the next input byte */
     struct stats * st = calloc(1, sizeof(struct stats));
 
-    /* initialize file and inflate state to start there */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit2(&strm, -15);         /* raw inflate */
+    /* set the thread's inflate state up to start there */
+    ret = ib_reset(strm);                   /* raw inflate */
     if (ret != Z_OK)
         return NULL;
 
     off_t seek_offset = this->in - (off_t) (this->bits ? 1 : 0);
 
-    //Open the gz file
-    in = fopen(filename, "rb");
-    if (NULL == in) {
-        fprintf(stderr, "Error opening %s for reading\n", filename);
-        exit(-1);
-    }
-
-    ret = fseeko(in, seek_offset, SEEK_SET);
-    if (ret == -1) {
-        perror("failed");
-        printf("Error seeking to offset: %s\n", strerror(errno));
-        exit(-1);
-    }
+    /* The input is inflated straight out of the mapped gz file */
+    pos = seek_offset;
     if (this->bits) {
-        ret = getc(in);
-        if (ret == -1) {
-            ret = ferror(in) ? Z_ERRNO : Z_DATA_ERROR;
+        if (pos >= gz->size) {
+            ret = Z_DATA_ERROR;
             goto deflate_index_extract_ret;
         }
-        (void)inflatePrime(&strm, this->bits, ret >> (8 - this->bits));
+        ret = gz->data[pos++];
+        (void)ib_prime(strm, this->bits, ret >> (8 - this->bits));
+    }
+    /* The window is only materialized here, in the worker that needs this
+     * point, and not at all if the data after the point doesn't use it */
+    int window_len = idx_load_window(index, this, window);
+    if (window_len < 0) {
+        logger(LOG_ERROR, "Corrupt window in the gzip index");
+        ret = Z_DATA_ERROR;
+        goto deflate_index_extract_ret;
     }
-    (void)inflateSetDictionary(&strm, this->window, WINSIZE);
+    if (window_len)
+        (void)ib_set_dictionary(strm, window, window_len);
 
 
     /* skip uncompressed bytes until offset reached, then satisfy request */
     seq_offset -= this->out;
-    strm.avail_in = 0;
+    strm->avail_in = 0;
     do {
         /* define where to put uncompressed data, and how much */
         if (seq_offset > WINSIZE) {             /* skip WINSIZE bytes */
-            strm.avail_out = WINSIZE;
-            strm.next_out = discard;
+            strm->avail_out = WINSIZE;
+            strm->next_out = discard;
             seq_offset -= WINSIZE;
 
         }
         else if (seq_offset > 0) {              /* last skip */
-            strm.avail_out = (unsigned)seq_offset;
-            strm.next_out = discard;
+            strm->avail_out = (unsigned)seq_offset;
+            strm->next_out = discard;
             seq_offset = 0;
         }
-        else if (skip) {                    /* at offset now */
-            strm.avail_out = WINSIZE;
-            strm.next_out = buf;
-            skip = 0;                       /* only do this once */
-        } else if (skip == 0) {
-            strm.avail_out = WINSIZE;
-            strm.next_out = buf;
-            if (totout) {
-                for (int i = 0; i < strm.avail_out; i++) {
-                    //Copy the character into the output buffer
-
-                    //Check if it's a new line
-                    if (strm.next_out[i] == '\n') {
-                        // This is a new sequence
-                        if ((line_num % 4) == 0) {
-                            seq_num++;
-                            /* If we've seen the total number of sequences we need to,
-                             * return the buffer we've been building */
-                            if ((nchunks > 0) && (seq_num % nchunks) == 0) {
-                                /* This position is (totout - strm.avail_out) + i */
-                                goto deflate_index_extract_ret;
-                            }
-                        }
-                    line_num++;
-                    } else if (line_num % 4 == 2) { //the sequence 
-                        if (strm.next_out[i] == 'A')
-                            st->A++;
-                        else if (strm.next_out[i] == 'C')
-                            st->C++;
-                        else if (strm.next_out[i] == 'G')
-                            st->G++;
-                        else if (strm.next_out[i] == 'T')
-                            st->T++;
-                        else if (strm.next_out[i] == 'N')
-                            st->N++;
-                        else{
-                            printf("Fatal. Encountered unknown nucleotide: %c\n", strm.next_out[i]);
-                            exit(1);
-                        }
-
-                    }
-
-                }
-            }
+        else if (skip_out) {                /* at offset now */
+            strm->avail_out = WINSIZE;
+            strm->next_out = buf;
+            skip_out = 0;                   /* only do this once */
+        } else if (skip_out == 0) {
+            strm->avail_out = WINSIZE;
+            strm->next_out = buf;
+            if (totout && count_reads(buf, WINSIZE, &cur, skip, stop, st))
+                goto deflate_index_extract_ret;
         }
 
         //skip = 0;                       /* only do this once */
         /* uncompress until avail_out filled, or end of stream */
         do {
-            if (strm.avail_in == 0) {
-                strm.avail_in = fread(input, 1, CHUNKSIZE, in);
-                if (ferror(in)) {
-                    ret = Z_ERRNO;
-                    goto deflate_index_extract_ret;
-                }
-                if (strm.avail_in == 0) {
+            if (strm->avail_in == 0) {
+                if (pos >= gz->size) {
                     ret = Z_DATA_ERROR;
                     goto deflate_index_extract_ret;
                 }
-                strm.next_in = input;
+                strm->next_in = (unsigned char *) gz->data + pos;
+                strm->avail_in = gz->size - pos < MAXFEED ? gz->size - pos : MAXFEED;
+                pos += strm->avail_in;
             }
-            totout += strm.avail_out;
-            ret = inflate(&strm, Z_SYNC_FLUSH);       /* normal inflate */
-            totout -= strm.avail_out;
+            totout += strm->avail_out;
+            ret = ib_inflate(strm);                  /* normal inflate */
+            totout -= strm->avail_out;
             if (ret == Z_NEED_DICT)
                 ret = Z_DATA_ERROR;
             if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
                 goto deflate_index_extract_ret;
             if (ret == Z_STREAM_END) {
                 /* the raw deflate stream has ended */
-                if (index->have == 0) {
+                if (!(index->hdr->flags & IDX_FLAG_GZIP)) {
                     /* this is a zlib stream that has ended -- done */
                     break;
                 }
@@ -401,94 +390,51 @@ struct stats * extract(char * filename, struct access *index, struct point * thi
                 /* near the end of a gzip member, which might be followed by
                    another gzip member -- skip the gzip trailer and see if
                    there is more input after it */
-                if (strm.avail_in < 8) {
-                    fseeko(in, 8 - strm.avail_in, SEEK_CUR);
-                    strm.avail_in = 0;
+                if (strm->avail_in < 8) {
+                    pos += 8 - strm->avail_in;
+                    strm->avail_in = 0;
                 }
                 else {
-                    strm.avail_in -= 8;
-                    strm.next_in += 8;
+                    strm->avail_in -= 8;
+                    strm->next_in += 8;
                 }
-                if (strm.avail_in == 0 && ungetc(getc(in), in) == EOF) {
+                if (strm->avail_in == 0 && pos >= gz->size) {
                     /* the input ended after the gzip trailer -- done */
                     break;
                 }
 
                 /* there is more input, so another gzip member should follow --
                    validate and skip the gzip header */
-                ret = inflateReset2(&strm, 31);
-                if (ret != Z_OK)
-                    goto deflate_index_extract_ret;
                 do {
-                    if (strm.avail_in == 0) {
-                        strm.avail_in = fread(input, 1, CHUNKSIZE, in);
-                        if (ferror(in)) {
-                            ret = Z_ERRNO;
-                            goto deflate_index_extract_ret;
-                        }
-                        if (strm.avail_in == 0) {
+                    if (strm->avail_in == 0) {
+                        if (pos >= gz->size) {
                             ret = Z_DATA_ERROR;
                             goto deflate_index_extract_ret;
                         }
-                        strm.next_in = input;
+                        strm->next_in = (unsigned char *) gz->data + pos;
+                        strm->avail_in = gz->size - pos < MAXFEED ? gz->size - pos : MAXFEED;
+                        pos += strm->avail_in;
                     }
-
-                    totout += strm.avail_out;
-                    ret = inflate(&strm, Z_BLOCK);
-                    totout -= strm.avail_out;
-                    if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+                    ret = ib_header(strm);
+                    if (ret < 0)
                         goto deflate_index_extract_ret;
-                } while ((strm.data_type & 128) == 0);
+                } while (ret == 0);
 
-                /* set up to continue decompression of the raw deflate stream
-                   that follows the gzip header */
-                ret = inflateReset2(&strm, -15);
-                if (ret != Z_OK)
-                    goto deflate_index_extract_ret;
+                /* ib_header() has set up to continue decompression of the
+                   raw deflate stream that follows the gzip header */
+                ret = Z_OK;
             }
 
             /* continue to process the available input before reading more */
-        } while (strm.avail_out != 0);
+        } while (strm->avail_out != 0);
 
         if (ret == Z_STREAM_END) {
             /* reached the end of the compressed data -- return the data that
                was available, possibly less than requested */
-            //strm.avail_out = WINSIZE;
-            strm.next_out = buf;
+            //strm->avail_out = WINSIZE;
             //skip = 0;                       /* only do this once */
-            if (totout) {
-                for (int i = 0; i < WINSIZE - strm.avail_out; i++) {
-                    //Check if it's a new line
-                    if (strm.next_out[i] == '\n') {
-                        // This is a new sequence
-                        if ((line_num % 4) == 0) {
-                            seq_num++;
-                            /* If we've seen the total number of sequences we need to,
-                             * return the buffer we've been building */
-                            if ((nchunks > 0) && (seq_num % nchunks) == 0) {
-                                goto deflate_index_extract_ret;
-                            }
-                        }
-                        line_num++;
-                    } else if (line_num % 4 == 2) { //the sequence 
-                        if (strm.next_out[i] == 'A')
-                            st->A++;
-                        else if (strm.next_out[i] == 'C')
-                            st->C++;
-                        else if (strm.next_out[i] == 'G')
-                            st->G++;
-                        else if (strm.next_out[i] == 'T')
-                            st->T++;
-                        else if (strm.next_out[i] == 'N')
-                            st->N++;
-                        else{
-                            printf("Fatal. Encountered unknown nucleotide: %c\n", strm.next_out[i]);
-                            exit(1);
-                        }
-
-                    }
-                }
-            }
+            if (totout && !count_reads(buf, WINSIZE - strm->avail_out, &cur, skip, stop, st))
+                finish_reads(&cur, skip, stop, st);
             break;
         }
 
@@ -497,18 +443,16 @@ struct stats * extract(char * filename, struct access *index, struct point * thi
 
     /* clean up and return the bytes read, or the negative error */
     deflate_index_extract_ret:
-
-    fclose(in);
-    (void)inflateEnd(&strm);
-
     return st;
 
 }
 
-void * task(void *arg) {
+/* chunk_counts() counts the bases of the sequence chunks of ta, inflating
+ * with strm */
+static struct stats *chunk_counts(struct task_args *arg, struct ib_stream *strm) {
 
     off_t seq_offset, block_num;
-    struct task_args ta = *(struct task_args *) arg;
+    struct task_args ta = *arg;
     off_t out_size = WINSIZE;
     off_t total_bytes = 0;
 
@@ -517,7 +461,10 @@ void * task(void *arg) {
     struct seq_entry * this_chunk = ta.list->seq_entry + (ta.start * sizeof(struct seq_entry));
     int nchunks;
     if (ta.stop > 0) {
-        nchunks = (ta.stop - ta.start) * idx_chunk_size;
+        /* Chunks hold idx_chunk_size reads, unless the points were spaced by
+         * the data */
+        struct seq_entry * stop_chunk = ta.list->seq_entry + (ta.stop * sizeof(struct seq_entry));
+        nchunks = stop_chunk->seq_num - this_chunk->seq_num;
     } else {
         nchunks = -1;
     }
@@ -530,26 +477,154 @@ void * task(void *arg) {
     block_num = this_chunk->block;
 
     /* Get the block structure */
-    struct point * this_block = ta.index->list + block_num;
-    struct stats * ret = extract(ta.filename, ta.index, this_block, seq_offset, nchunks);
+    const struct idx_point * this_block = idx_get_point(ta.index, block_num);
+    if (NULL == this_block) {
+        logger(LOG_ERROR, "Sequence index refers to a block missing from the gzip index");
+        exit(1);
+    }
+
+    /* Have the compressed data up to the access point after the last chunk
+     * read ahead */
+    const struct idx_point * end_block = ta.stop > 0 ?
+        idx_get_point(ta.index, ((struct seq_entry *) ta.list->seq_entry)[ta.stop].block + 1) : NULL;
+    idx_input_advise(ta.gz, this_block->in, end_block != NULL ? end_block->in : ta.gz->size);
+    struct stats * ret = extract(ta.gz, ta.index, strm, this_block, seq_offset, 0, nchunks);
+    if (NULL == ret) {
+        logger(LOG_ERROR, "Thread returned no counts");
+        exit(1);
+    }
+    return ret;
+}
+
+void * task(void *arg) {
+    struct task_args *ta = arg, range = *ta;
+    struct stats *total = calloc(1, sizeof(struct stats));
+    struct ib_stream strm;
+
+    if (NULL == total || ib_init(&strm) != Z_OK) {
+        logger(LOG_ERROR, "Couldn't set up inflating");
+        exit(1);
+    }
+    while (take_chunks(ta->queue, &range.start, &range.stop)) {
+        struct stats *st = chunk_counts(&range, &strm);
+        add_stats(total, st);
+        free(st);
+    }
+    ib_end(&strm);
+    pthread_exit((void *) total);
+}
+
+/* check_source() makes sure the gzip file at path is the one the index was
+ * built from. This reads the same small, fixed amount of the file whatever
+ * its size, so it is cheap enough to do on every run
+ * @returns: 0 on success, < 0 on failure
+ */
+static int check_source(const struct idx_file *index, char *path) {
+    char msg[MSGSIZE];
+    int ret = idx_check_source(&index->hdr->source, path, msg, MSGSIZE);
+
+    if (ret < 0) {
+        logger(LOG_ERROR, msg);
+        return -1;
+    }
+    if (ret > 0)
+        logger(LOG_WARNING, msg);
+    return 0;
+}
+
+/* seq_source_matches() checks a sequence index "#source:" line against the
+ * fingerprint in the gzip index, so that the two index files can't be mixed
+ * up between builds */
+static int seq_source_matches(const char *line, const struct idx_source *src) {
+    unsigned long size;
+    long mtime;
+    unsigned head_crc, tail_crc;
+
+    if (sscanf(line, "#source: %lu,%ld,%x,%x", &size, &mtime, &head_crc, &tail_crc) != 4)
+        return 0;
+    return size == src->size && mtime == src->mtime &&
+           head_crc == src->head_crc && tail_crc == src->tail_crc;
+}
+
+/* count_range() adds up the stats of reads first up to last (or to the end
+ * if last is < 0) into total. Chunks wholly in the range are taken from
+ * their stats if have_stats, and the rest is decompressed
+ * @returns: 0 on success, < 0 on failure
+ */
+static int count_range(const struct idx_input *gz, struct idx_file *index, struct seq_list *list,
+                       int have_stats, off_t first, off_t last, struct stats *total) {
+    struct seq_entry *entries = list->seq_entry;
+    struct ib_stream strm;
+    int ret = 0;
+
+    if (ib_init(&strm) != Z_OK)
+        return -1;
+    for (int i = 0; i < list->have; i++) {
+        off_t begin = entries[i].seq_num;
+        off_t end = i + 1 < list->have ? entries[i + 1].seq_num :
+                    have_stats ? begin + entries[i].stats.reads : -1;
+
+        /* chunks wholly before or after the range */
+        if ((end >= 0 && end <= first) || (last >= 0 && begin >= last))
+            continue;
+        if (have_stats && begin >= first && (last < 0 || end <= last)) {
+            add_stats(total, &entries[i].stats);
+            continue;
+        }
+
+        /* only part of the chunk is in the range, or the stats aren't there:
+         * decompress from the start of the chunk to where the range ends in
+         * it, or past the end of the chunk if there is no telling */
+        const struct idx_point *point = idx_get_point(index, entries[i].block);
+        if (NULL == point) {
+            logger(LOG_ERROR, "Sequence index refers to a block missing from the gzip index");
+            ret = -1;
+            break;
+        }
+        off_t skip = first > begin ? first - begin : 0;
+        off_t stop = have_stats && end >= 0 && (last < 0 || end < last) ? end : last;
+        struct stats *st = extract(gz, index, &strm, point, entries[i].start, skip,
+                                   stop < 0 ? -1 : stop - begin - skip);
+        if (NULL == st) {
+            ret = -1;
+            break;
+        }
+        add_stats(total, st);
+        free(st);
+        if (!have_stats)
+            break;
+    }
+    ib_end(&strm);
+    return ret;
+}
 
-    pthread_exit((void *) ret);
+/* print_stats() writes the totals out */
+static void print_stats(const struct stats *st) {
+    printf("A: %ld C: %ld G: %ld T: %ld N: %ld Total: %ld\n", st->A, st->C, st->G, st->T, st->N, st->A + st->C + st->G + st->T + st->N);
+    printf("Reads: %ld Length: %ld-%ld Mean quality: %.2f\n", st->reads,
+           st->min_len, st->max_len, st->bases ? (double) st->qual / st->bases : 0.0);
 }
 
 //Prints the usage information on error
 void print_usage(char *argv[]) {
-    fprintf(stderr, "Usage: %s [-n N_THREADS] GZIP-INDEX.IDX SEQUENCE-INDEX.SEQ-IDX GZIP_FILE \n", argv[0]);
+    fprintf(stderr, "Usage: %s [-n N_THREADS] [-r READ[:COUNT]] GZIP-INDEX.IDX SEQUENCE-INDEX.SEQ-IDX GZIP_FILE \n", argv[0]);
+    fprintf(stderr, "       %s [-n N_THREADS] [-r READ[:COUNT]] GZIP_FILE_WITH_EMBEDDED_INDEX \n", argv[0]);
 }
 
 void print_help(char *argv[]) {
     fprintf(stderr, "index-reader reads prebuilt index files for a gzipped FASTQ ");
     fprintf(stderr, "file to allow for parallel processing\n\n");
-    fprintf(stderr, "Usage: %s [-n N_THREADS] GZIP-INDEX.IDX SEQUENCE-INDEX.SEQ-IDX GZIP_FILE \n", argv[0]);
-    fprintf(stderr, "-n N_THREADS\tthe number of thread (<=16) to use (default 4)");
+    fprintf(stderr, "Usage: %s [-n N_THREADS] [-r READ[:COUNT]] GZIP-INDEX.IDX SEQUENCE-INDEX.SEQ-IDX GZIP_FILE \n", argv[0]);
+    fprintf(stderr, "       %s [-n N_THREADS] [-r READ[:COUNT]] GZIP_FILE_WITH_EMBEDDED_INDEX \n", argv[0]);
+    fprintf(stderr, "-n N_THREADS\tthe number of threads to use (default one per CPU)\n");
+    fprintf(stderr, "-r READ[:COUNT]\tonly count COUNT reads (default all the rest) ");
+    fprintf(stderr, "starting at READ (counting from 0)\n");
     fprintf(stderr, "-v\t\tenable verbose logging\n");
-    fprintf(stderr, "GZIP-INDEX.IDX\t<index file> is a CSV index file for the GZIP FASTQ file's blocks\n");
+    fprintf(stderr, "GZIP-INDEX.IDX\t<index file> is a binary index file for the GZIP FASTQ file's blocks\n");
     fprintf(stderr, "SEQUENCE-INDEX.IDX\t<index file> is a CSV index file for the GZIP FASTQ file's sequences\n");
     fprintf(stderr, "GZIP_FILE\t<gzip file> is a gzipped FASTQ file to index\n");
+    fprintf(stderr, "Given just GZIP_FILE, the index files embedded in it by ");
+    fprintf(stderr, "index-builder -e are used\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -557,17 +632,17 @@ int main(int argc, char *argv[]) {
     FILE* fp;
     char line[MAXLINE];
     char* token;
-    struct access * index = NULL;
-    struct seq_list * list;
-    struct point pt = {0};
+    struct idx_file index;
+    struct seq_list * list = NULL;
     struct seq_entry se;
     unsigned char buf[CHUNKSIZE];
     char msg[MSGSIZE];
-    pthread_t threads[MAXTHREADS];
+    struct thread_pool pool;
+    int have_stats = 1;             /* every chunk has its stats */
 
 
     int opt;
-    while ((opt = getopt(argc, argv, "c:ho:vn:")) != -1) {
+    while ((opt = getopt(argc, argv, "c:ho:r:vn:")) != -1) {
         switch (opt) {
             case 'c': //chunk size
                 idx_chunk_size = atoi(optarg);
@@ -579,117 +654,75 @@ int main(int argc, char *argv[]) {
             case 'n':
                 num_threads = atoi(optarg);
                 break;
+            case 'r': //reads to count
+                read_range = optarg;
+                break;
             default:
                 print_usage(argv);
                 return 1;
         }
     }
 
-    if (optind >= argc) {
+    /* With just the gzip file, use the index files embedded in it */
+    int embedded = (argc - optind == 1);
+    unsigned char *sect[EMB_NSECT] = {0};
+    uint64_t sect_len[EMB_NSECT] = {0};
+    char *gzip_file = argv[argc - 1];
+
+    if (argc - optind != (embedded ? 1 : 3)) {
         print_usage(argv);
         return -1;
     }
+    if (num_threads < 1)
+        num_threads = tp_cpus();
 
     snprintf(msg, MSGSIZE, "Running with %d threads", num_threads);
     logger(LOG_INFO, msg);
 
-    /* Open and read the GZIP index CSV file.
-   * Add each struct point to the index access point list as we read it
-   */
-    fp = fopen(argv[optind], "r");
-    if (fp == NULL) {
-        printf("Error opening the file.\n");
+    /* Map the binary GZIP index file, or read the embedded one, which only
+     * takes reading the tail of the gzip file. The header, access point table
+     * and windows are all used in place, so there is nothing to parse */
+    if (embedded) {
+        if (emb_read(gzip_file, sect, sect_len, msg, MSGSIZE) != 0 ||
+            idx_open_mem(&index, sect[EMB_IDX], sect_len[EMB_IDX], gzip_file, msg, MSGSIZE) < 0) {
+            logger(LOG_ERROR, msg);
+            exit(1);
+        }
+    } else if (idx_open(&index, argv[optind], msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
         exit(1);
     }
+    idx_chunk_size = index.hdr->sequence_skip;
+    snprintf(msg, MSGSIZE, "Read sequence number %d", idx_chunk_size);
+    logger(LOG_DEBUG, msg);
 
-    // Read each line of the file
-    while (fgets(line, MAXLINE, fp) != NULL) {
-
-        int decoded_len;
-        char * decoded_string = NULL;
-
-        /* Ignore comments, except the one with the sequence number hint */
-        if (line[0] == '#') {
-
-            char * substr = strstr(line, "#sequence_skip:");
-
-            /* Didn't find the sequence */
-            if (substr == NULL) {
-                continue;
-            }
-
-            // Extract the number using strtok()
-            char * token = strtok(substr, " ");
-
-            if (token == NULL) {
-                logger(LOG_ERROR, "Error: no token found after #sequence:");
-                return 1;
-            }
-
-            token = strtok(NULL, " ");
-
-            if (token == NULL) {
-                logger(LOG_ERROR, "Error: no number found after #sequence:");
-                return 1;
-            }
-            // Convert the number to an integer
-            idx_chunk_size = atoi(token);
-
-            snprintf(msg, MSGSIZE, "Read sequence number %d", idx_chunk_size);
-            logger(LOG_DEBUG, msg);
-            continue;
-        }
-
-        /* Block number */
-        token = strtok(line, ",");
-
-        /* out_offset */
-        token = strtok(NULL, ",");
-        pt.out = atol(token);
-
-        /* in_offset */
-        token = strtok(NULL, ",");
-        pt.in = atol(token);
-
-        /* bits offset */
-        token = strtok(NULL, ",");
-        pt.bits = atoi(token);
-
-        /* window */
-        token = strtok(NULL, ",");
-
-        size_t encoded_len = strlen(token); //remove the \n
-
-        // Calculate the maximum length of the decoded string
-        size_t max_decoded_len = (encoded_len * 3);
-        decoded_string = (char*)malloc(max_decoded_len + 1);
-
-        if (decoded_string == NULL) {
-            logger(LOG_ERROR, "Error: Memory allocation failed");
-            return 1;
-        }
-
-        decoded_len = base64_decode(token, encoded_len, decoded_string, max_decoded_len);
-        if ((decoded_len) < 0) {
-            logger(LOG_ERROR, "Error: Decoded length < 0");
-            exit(129);
-        }
+    snprintf(msg, MSGSIZE, "Read %lu points from %s", index.have, argv[optind]);
+    logger(LOG_DEBUG, msg);
+    optind++;
 
-        decoded_string[WINSIZE] = '\0';
-        strcpy(pt.window, decoded_string);
+    if (check_source(&index, gzip_file) < 0)
+        exit(1);
 
-        index = add_read_point(index, pt.bits, pt.in, pt.out, decoded_string);
+    /* All the threads read the gzip file through one mapping of it */
+    struct idx_input gz;
+    if (idx_input_open(&gz, gzip_file, msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
+        exit(1);
     }
-    // Close the file
-    fclose(fp);
-
-    snprintf(msg, MSGSIZE, "Read %d points from %s", index->have, argv[optind]);
+    if (ib_use(getenv("INFLATE_ENGINE")) < 0) {
+        snprintf(msg, MSGSIZE, "Inflate engine %s isn't built in", getenv("INFLATE_ENGINE"));
+        logger(LOG_ERROR, msg);
+        exit(1);
+    }
+    snprintf(msg, MSGSIZE, "Inflating with %s", ib_name());
     logger(LOG_DEBUG, msg);
-    optind++;
 
     /* Open and read the sequence index CSV file.
  * Add each sequence to the sequence list as we read it */
-    fp = fopen(argv[optind], "r");
+    if (embedded)
+        fp = sect_len[EMB_SEQ] ? fmemopen(sect[EMB_SEQ], sect_len[EMB_SEQ], "r") : NULL;
+    else
+        fp = fopen(argv[optind], "r");
     if (fp == NULL) {
         logger(LOG_ERROR, "Error opening the sequence-index file");
         exit(1);
@@ -697,11 +730,35 @@ int main(int argc, char *argv[]) {
 
     // Read each line of the file
     while (fgets(line, MAXLINE, fp) != NULL) {
-        /* Ignore comments */
+        /* Ignore comments, but not a sequence index of another build */
         if (line[0] == '#') {
+            if (strncmp(line, "#source:", 8) == 0 &&
+                !seq_source_matches(line, &index.hdr->source)) {
+                logger(LOG_ERROR, "The sequence index wasn't built with the gzip index; rebuild both");
+                exit(1);
+            }
             continue;
         }
 
+        /* index-builder -t adds the stats of the chunk */
+        struct stats cs;
+        long long f[10];
+        int tallied = sscanf(line, "%*d,%*d,%*d,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld",
+                             f, f + 1, f + 2, f + 3, f + 4, f + 5, f + 6, f + 7, f + 8, f + 9) == 10;
+        if (tallied) {
+            cs.reads = f[0];
+            cs.bases = f[1];
+            cs.A = f[2];
+            cs.C = f[3];
+            cs.G = f[4];
+            cs.T = f[5];
+            cs.N = f[6];
+            cs.min_len = f[7];
+            cs.max_len = f[8];
+            cs.qual = f[9];
+        }
+        have_stats &= tallied;
+
         /* Start sequence number */
         token = strtok(line, ",");
         se.seq_num = atol(token);
@@ -713,74 +770,71 @@ int main(int argc, char *argv[]) {
         se.start = atol(token);
 
         list = add_seq(list, se.seq_num, se.start, se.block);
+        if (list != NULL && tallied)
+            ((struct seq_entry *) list->seq_entry)[list->have - 1].stats = cs;
     }
     // Close the file
     fclose(fp);
-    snprintf(msg, MSGSIZE, "Read %d points from %s", list->have, argv[optind]);
+    free(sect[EMB_SEQ]);
+    free(sect[EMB_RIDX]);
+    snprintf(msg, MSGSIZE, "Read %d points from %s", list->have,
+             embedded ? gzip_file : argv[optind]);
     logger(LOG_DEBUG, msg);
-    optind++;
+
+    /* With the stats of every chunk only the chunks a range of reads cuts
+     * through need decompressing, and the whole file none */
+    if (read_range != NULL || have_stats) {
+        struct stats total_stats = {0};
+        char *count = read_range != NULL ? strchr(read_range, ':') : NULL;
+        off_t first = read_range != NULL ? strtoll(read_range, NULL, 10) : 0;
+        off_t last = count != NULL ? first + strtoll(count + 1, NULL, 10) : -1;
+
+        if (count_range(&gz, &index, list, have_stats, first, last,
+                        &total_stats) < 0)
+            return 1;
+        print_stats(&total_stats);
+        return 0;
+    }
 
     /* If we have more threads than sequence chunks, reduce the number of threads */
     if (num_threads > list->have) {
         snprintf(msg, MSGSIZE, "Setting num_threads to %d from %d", list->have, num_threads);
         logger(LOG_INFO, msg);
         num_threads = list->have;
-    } else if (num_threads > MAXTHREADS) {
-        snprintf(msg, MSGSIZE, "Max number of threads is %d", MAXTHREADS);
-        logger(LOG_INFO, msg);
-        num_threads = MAXTHREADS;
     }
 
 
-    struct task_args args[MAXTHREADS] = {0};
-    // create threads
-    for (int i = 0; i < num_threads; i++) {
-        snprintf(msg, MSGSIZE, "Starting thread %d", i);
-        logger(LOG_DEBUG, msg);
-
-        double float_stride = (double)  list->have / num_threads;
-        int stride = (int) floor(float_stride);
-        int thread_start = stride * i;
-        int thread_end;
-
-        if ((stride * (i + 1)) < list->have) {
-            thread_end = stride * (i + 1);
-        } else {
-            thread_end = list->have;
-        }
+    struct work_queue queue = {0, list->have, range_grain(&index, list)};
+    snprintf(msg, MSGSIZE, "Taking %d chunks at a time", queue.grain);
+    logger(LOG_DEBUG, msg);
 
+    struct task_args *args = calloc(num_threads, sizeof(struct task_args));
+    struct stats **thread_results = calloc(num_threads, sizeof(struct stats *));
+    if (NULL == args || NULL == thread_results) {
+        logger(LOG_ERROR, "Out of memory for the threads");
+        return 1;
+    }
+    for (int i = 0; i < num_threads; i++) {
         /* Set up the args struct for this thread */
         args[i].tid = i;
-        args[i].filename = strndup(argv[optind], strlen(argv[optind]));
-        args[i].index = index;
+        args[i].gz = &gz;
+        args[i].index = &index;
         args[i].list = list;
-        args[i].start = thread_start;
-
-        //last thread, read until end
-        if (i == (num_threads - 1))
-            args[i].stop = -1;
-        else
-            args[i].stop = thread_end;
-
-        pthread_create(&threads[i], NULL, task, &args[i]);
+        args[i].queue = &queue;
     }
-
-    struct stats * thread_results[MAXTHREADS];
-    // wait for threads to finish
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], (void **) &thread_results[i]);
+    if (tp_start(&pool, num_threads, task, args, sizeof(struct task_args)) < 0) {
+        logger(LOG_ERROR, "Couldn't start the threads");
+        exit(1);
     }
+    // wait for threads to finish
+    tp_join(&pool, (void **) thread_results);
 
     struct stats total_stats = {0};
     for (int i = 0; i < num_threads; i++) {
-        total_stats.A += thread_results[i]->A;
-        total_stats.C += thread_results[i]->C;
-        total_stats.G += thread_results[i]->G;
-        total_stats.T += thread_results[i]->T;
-        total_stats.N += thread_results[i]->N;
+        add_stats(&total_stats, thread_results[i]);
     }
 
-    printf("A: %ld C: %ld G: %ld T: %ld N: %ld Total: %ld\n", total_stats.A, total_stats.C, total_stats.G, total_stats.T, total_stats.N, total_stats.A + total_stats.C + total_stats.G + total_stats.T + total_stats.N);
+    print_stats(&total_stats);
 
     return 0;
 }
@@ -0,0 +1,583 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bit-inflate.h"
+
+/* Decoding table entries. The low 8 bits are the code length (or, with
+ * ENTRY_SUB, the number of index bits of a second level table) and the high
+ * 16 bits are the symbol (or the second level table's offset). An entry
+ * with a length of 0 is an invalid code */
+#define ENTRY_SUB 0x100
+#define ENTRY(sym, len) (((uint32_t) (sym) << 16) | (len))
+
+/* which kind of code build_table() is building, for the completeness rules */
+#define CODES 0
+#define LENS 1
+#define DISTS 2
+
+static const uint16_t len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t clen_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+/* refill() tops the bit buffer up to at least 56 bits. Past the end of the
+ * buffer it loads zeros and counts them in phantom, so decoding never reads
+ * out of bounds and callers find out with bi_tell() */
+static inline void refill(struct bi_reader *r) {
+    if (r->bitcnt > 56)
+        return;
+    if (r->len - r->next >= 8) {
+        const unsigned char *p = r->buf + r->next;
+        uint64_t v = (uint64_t) p[0] | (uint64_t) p[1] << 8 |
+                     (uint64_t) p[2] << 16 | (uint64_t) p[3] << 24 |
+                     (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+                     (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+        unsigned n = (63 - r->bitcnt) >> 3;
+        r->bitbuf |= v << r->bitcnt;
+        r->next += n;
+        r->bitcnt += n << 3;
+        r->bitbuf &= ((uint64_t) 1 << r->bitcnt) - 1;
+        return;
+    }
+    while (r->bitcnt <= 56) {
+        uint64_t byte = 0;
+        if (r->next < r->len)
+            byte = r->buf[r->next++];
+        else
+            r->phantom += 8;
+        r->bitbuf |= byte << r->bitcnt;
+        r->bitcnt += 8;
+    }
+}
+
+/* getbits() takes n (<= 32) bits; the caller has refilled enough */
+static inline uint32_t getbits(struct bi_reader *r, unsigned n) {
+    uint32_t v = (uint32_t) (r->bitbuf & (((uint64_t) 1 << n) - 1));
+    r->bitbuf >>= n;
+    r->bitcnt -= n;
+    return v;
+}
+
+/* decode() decodes one symbol with table t, or returns -1 for an invalid
+ * code. The caller has refilled at least 15 bits */
+static inline int decode(struct bi_reader *r, const uint32_t *t,
+                         unsigned primary) {
+    uint32_t e = t[r->bitbuf & ((1U << primary) - 1)];
+    unsigned len;
+
+    if (e & ENTRY_SUB)
+        e = t[(e >> 16) + ((r->bitbuf >> primary) & ((1U << (e & 0xff)) - 1))];
+    len = e & 0xff;
+    if (len == 0)
+        return -1;
+    r->bitbuf >>= len;
+    r->bitcnt -= len;
+    return e >> 16;
+}
+
+static unsigned reverse(unsigned code, unsigned len) {
+    unsigned rev = 0;
+
+    while (len--) {
+        rev = (rev << 1) | (code & 1);
+        code >>= 1;
+    }
+    return rev;
+}
+
+/* build_table() builds the decoding table for the n code lengths in lens.
+ * Over-subscribed codes are always rejected and incomplete ones unless they
+ * are a single one bit code for literals/lengths or distances, the same rules
+ * zlib applies. Returns 0 on success, -1 for an invalid code */
+static int build_table(uint32_t *table, unsigned primary, const uint8_t *lens,
+                       unsigned n, int type) {
+    unsigned count[16] = {0};
+    unsigned next_code[16];
+    uint8_t submax[1 << BI_LIT_PRIMARY];
+    uint16_t rev[288];
+    unsigned size = 1U << primary;
+    unsigned max = 0, off, code, len, s;
+    int left = 1;
+
+    for (s = 0; s < n; s++)
+        count[lens[s]]++;
+    count[0] = 0;
+    for (len = 1; len < 16; len++) {
+        left <<= 1;
+        left -= count[len];
+        if (left < 0)
+            return -1;          /* over-subscribed */
+        if (count[len])
+            max = len;
+    }
+
+    memset(table, 0, size * sizeof(uint32_t));
+    if (max == 0)
+        return 0;               /* no codes at all, every lookup is invalid */
+    if (left > 0 && (type == CODES || max != 1))
+        return -1;              /* incomplete */
+
+    code = 0;
+    next_code[0] = 0;
+    for (len = 1; len < 16; len++) {
+        code = (code + count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+
+    /* Assign the canonical codes, bit reversed since deflate sends Huffman
+     * codes MSB first into an LSB first stream, and find out how big each
+     * second level table has to be */
+    memset(submax, 0, size);
+    for (s = 0; s < n; s++) {
+        len = lens[s];
+        if (len == 0)
+            continue;
+        rev[s] = reverse(next_code[len]++, len);
+        if (len > primary && len > submax[rev[s] & (size - 1)])
+            submax[rev[s] & (size - 1)] = len;
+    }
+
+    off = size;
+    for (code = 0; code < size; code++) {
+        if (submax[code] == 0)
+            continue;
+        unsigned bits = submax[code] - primary;
+        table[code] = ((uint32_t) off << 16) | ENTRY_SUB | bits;
+        memset(table + off, 0, (1U << bits) * sizeof(uint32_t));
+        off += 1U << bits;
+    }
+
+    for (s = 0; s < n; s++) {
+        len = lens[s];
+        if (len == 0)
+            continue;
+        if (len <= primary) {
+            for (code = rev[s]; code < size; code += 1U << len)
+                table[code] = ENTRY(s, len);
+        } else {
+            uint32_t e = table[rev[s] & (size - 1)];
+            uint32_t *sub = table + (e >> 16);
+            for (code = rev[s] >> primary; code < (1U << (e & 0xff));
+                 code += 1U << (len - primary))
+                sub[code] = ENTRY(s, len);
+        }
+    }
+    return 0;
+}
+
+void bi_init(struct bi_reader *r, const unsigned char *buf, size_t len,
+             uint64_t bitpos) {
+    r->buf = buf;
+    r->len = len;
+    r->bitbuf = 0;
+    r->bitcnt = 0;
+    r->phantom = 0;
+    if ((bitpos >> 3) > len) {
+        r->next = len;
+        r->phantom = ((bitpos >> 3) - len) << 3;
+    } else {
+        r->next = bitpos >> 3;
+    }
+    if (bitpos & 7) {
+        refill(r);
+        (void) getbits(r, bitpos & 7);
+    }
+}
+
+uint64_t bi_tell(const struct bi_reader *r) {
+    return ((uint64_t) r->next << 3) + r->phantom - r->bitcnt;
+}
+
+/* exhausted() is true once decoding has consumed bits past the end of input */
+static inline int exhausted(const struct bi_reader *r) {
+    return bi_tell(r) > ((uint64_t) r->len << 3);
+}
+
+static int fixed_tables(struct bi_block *b) {
+    uint8_t lens[288 + 32];
+    unsigned s;
+
+    for (s = 0; s < 144; s++)
+        lens[s] = 8;
+    for (; s < 256; s++)
+        lens[s] = 9;
+    for (; s < 280; s++)
+        lens[s] = 7;
+    for (; s < 288; s++)
+        lens[s] = 8;
+    /* all 32 distance codes exist, 30 and 31 are rejected when decoded */
+    for (s = 0; s < 32; s++)
+        lens[288 + s] = 5;
+    if (build_table(b->lit, BI_LIT_PRIMARY, lens, 288, LENS) < 0 ||
+        build_table(b->dist, BI_DIST_PRIMARY, lens + 288, 32, DISTS) < 0)
+        return BI_EDATA;
+    return BI_OK;
+}
+
+static int dynamic_tables(struct bi_reader *r, struct bi_block *b) {
+    uint32_t clen_table[1 << 7];
+    uint8_t clens[19] = {0};
+    uint8_t lens[286 + 30];
+    unsigned nlen, ndist, ncode, n, s;
+
+    refill(r);
+    nlen = getbits(r, 5) + 257;
+    ndist = getbits(r, 5) + 1;
+    ncode = getbits(r, 4) + 4;
+    if (nlen > 286 || ndist > 30)
+        return BI_EDATA;
+    refill(r);
+    for (s = 0; s < ncode; s++)
+        clens[clen_order[s]] = getbits(r, 3);
+    if (build_table(clen_table, 7, clens, 19, CODES) < 0)
+        return BI_EDATA;
+
+    n = 0;
+    while (n < nlen + ndist) {
+        unsigned rep, val;
+        int sym;
+
+        refill(r);
+        sym = decode(r, clen_table, 7);
+        if (sym < 0)
+            return BI_EDATA;
+        if (sym < 16) {
+            lens[n++] = sym;
+            continue;
+        }
+        if (sym == 16) {
+            if (n == 0)
+                return BI_EDATA;    /* nothing to repeat */
+            val = lens[n - 1];
+            rep = 3 + getbits(r, 2);
+        } else if (sym == 17) {
+            val = 0;
+            rep = 3 + getbits(r, 3);
+        } else {
+            val = 0;
+            rep = 11 + getbits(r, 7);
+        }
+        if (n + rep > nlen + ndist)
+            return BI_EDATA;
+        memset(lens + n, val, rep);
+        n += rep;
+    }
+    if (exhausted(r))
+        return BI_EINPUT;
+    if (lens[256] == 0)
+        return BI_EDATA;        /* no end-of-block code */
+
+    if (build_table(b->lit, BI_LIT_PRIMARY, lens, nlen, LENS) < 0 ||
+        build_table(b->dist, BI_DIST_PRIMARY, lens + nlen, ndist, DISTS) < 0)
+        return BI_EDATA;
+    return BI_OK;
+}
+
+int bi_block_header(struct bi_reader *r, struct bi_block *b) {
+    int ret;
+
+    refill(r);
+    b->final = getbits(r, 1);
+    b->type = getbits(r, 2);
+    b->stored_left = 0;
+    switch (b->type) {
+        case 0: {
+            unsigned len, nlen;
+            (void) getbits(r, r->bitcnt & 7);   /* go to a byte boundary */
+            refill(r);
+            len = getbits(r, 16);
+            nlen = getbits(r, 16);
+            if (len != (~nlen & 0xffff))
+                return BI_EDATA;
+            b->stored_left = len;
+            ret = BI_OK;
+            break;
+        }
+        case 1:
+            ret = fixed_tables(b);
+            break;
+        case 2:
+            ret = dynamic_tables(r, b);
+            break;
+        default:
+            return BI_EDATA;
+    }
+    if (ret == BI_OK && exhausted(r))
+        ret = BI_EINPUT;
+    return ret;
+}
+
+void bi_output_init(struct bi_output *o, int spec) {
+    memset(o, 0, sizeof(struct bi_output));
+    o->spec = spec;
+}
+
+void bi_output_free(struct bi_output *o) {
+    free(o->buf);
+    free(o->wide);
+    memset(o, 0, sizeof(struct bi_output));
+}
+
+/* reserve() makes room in o for n more bytes of output */
+static int reserve(struct bi_output *o, size_t n) {
+    if (o->len + n > o->size) {
+        size_t size = o->size ? o->size : (size_t) 4 * BI_WINSIZE;
+        while (size < o->len + n)
+            size <<= 1;
+        unsigned char *buf = realloc(o->buf, size);
+        if (NULL == buf)
+            return BI_EMEM;
+        o->buf = buf;
+        o->size = size;
+    }
+    if (o->spec && o->len + n > o->wide_size) {
+        size_t size = o->wide_size ? o->wide_size : (size_t) 4 * BI_WINSIZE;
+        while (size < o->len + n)
+            size <<= 1;
+        uint16_t *wide = realloc(o->wide, size * sizeof(uint16_t));
+        if (NULL == wide)
+            return BI_EMEM;
+        o->wide = wide;
+        o->wide_size = size;
+    }
+    return BI_OK;
+}
+
+/* put() appends one symbol, a byte or a marker, to o */
+static inline void put(struct bi_output *o, unsigned sym) {
+    if (o->spec) {
+        o->wide[o->len] = sym;
+        if (sym >= BI_MARKER)
+            o->marker_end = o->len + 1;
+        o->wide_len = o->len + 1;
+    }
+    o->buf[o->len++] = sym < BI_MARKER ? sym : 0;
+}
+
+/* settle() stops keeping wide symbols once no back-reference can reach a
+ * marker any more */
+static inline void settle(struct bi_output *o) {
+    if (o->spec && o->len - o->marker_end >= BI_WINSIZE)
+        o->spec = 0;
+}
+
+/* copy() appends the mlen bytes found dist bytes back */
+static int copy(struct bi_output *o, uint32_t mlen, uint32_t dist) {
+    if (o->spec) {
+        /* the part that comes from before the output is all markers */
+        while (mlen && dist > o->len) {
+            if (dist - o->len > BI_WINSIZE)
+                return BI_EDATA;
+            put(o, BI_MARKER + BI_WINSIZE - (dist - o->len));
+            mlen--;
+        }
+
+        /* the rest copies symbols, markers and all */
+        uint16_t *to = o->wide + o->len;
+        const uint16_t *from = to - dist;
+        unsigned char *bytes = o->buf + o->len;
+        for (uint32_t i = 0; i < mlen; i++) {
+            uint16_t sym = from[i];
+            to[i] = sym;
+            bytes[i] = sym < BI_MARKER ? sym : 0;
+            if (sym >= BI_MARKER)
+                o->marker_end = o->len + i + 1;
+        }
+        o->len += mlen;
+        o->wide_len = o->len;
+        return BI_OK;
+    }
+    if (dist > o->len)
+        return BI_EDATA;
+    unsigned char *to = o->buf + o->len;
+    const unsigned char *from = to - dist;
+    if (dist >= mlen) {
+        memcpy(to, from, mlen);
+    } else {
+        for (uint32_t i = 0; i < mlen; i++)
+            to[i] = from[i];
+    }
+    o->len += mlen;
+    return BI_OK;
+}
+
+int bi_inflate_block(struct bi_reader *r, struct bi_block *b,
+                     struct bi_output *o) {
+    int ret = bi_block_header(r, b);
+
+    if (ret != BI_OK)
+        return ret;
+
+    if (b->type == 0) {
+        /* stored data starts at the byte boundary the header ended on */
+        uint64_t pos = bi_tell(r) >> 3;
+        if (pos + b->stored_left > r->len)
+            return BI_EINPUT;
+        if (reserve(o, b->stored_left) != BI_OK)
+            return BI_EMEM;
+        for (uint32_t i = 0; i < b->stored_left; i++) {
+            put(o, r->buf[pos + i]);
+            settle(o);
+        }
+        bi_init(r, r->buf, r->len, (pos + b->stored_left) << 3);
+        return BI_OK;
+    }
+
+    for (;;) {
+        int sym;
+
+        if (reserve(o, 258) != BI_OK)
+            return BI_EMEM;
+        refill(r);
+        sym = decode(r, b->lit, BI_LIT_PRIMARY);
+        if (sym < 0)
+            return BI_EDATA;
+        if (sym < 256) {
+            put(o, sym);
+        } else if (sym == 256) {
+            break;
+        } else {
+            uint32_t mlen, dist;
+
+            sym -= 257;
+            if (sym >= 29)
+                return BI_EDATA;
+            mlen = len_base[sym] + getbits(r, len_extra[sym]);
+            sym = decode(r, b->dist, BI_DIST_PRIMARY);
+            if (sym < 0 || sym >= 30)
+                return BI_EDATA;
+            dist = dist_base[sym] + getbits(r, dist_extra[sym]);
+            if (copy(o, mlen, dist) != BI_OK)
+                return BI_EDATA;
+        }
+        settle(o);
+        if (exhausted(r))
+            return BI_EINPUT;
+    }
+    if (exhausted(r))
+        return BI_EINPUT;
+    return BI_OK;
+}
+
+uint64_t bi_find_block(const unsigned char *in, size_t len, uint64_t from,
+                       uint64_t to) {
+    struct bi_block b;
+    struct bi_reader r;
+
+    if (to > (uint64_t) len << 3)
+        to = (uint64_t) len << 3;
+    for (uint64_t pos = from; pos < to; pos++) {
+        /* Check the first 13 bits before building any tables: not final,
+         * dynamic, and no more than 286 literal/length or 30 distance codes */
+        size_t at = pos >> 3;
+        uint32_t v = 0;
+        for (int i = 0; i < 3 && at + i < len; i++)
+            v |= (uint32_t) in[at + i] << (8 * i);
+        v >>= pos & 7;
+        if ((v & 7) != 4 || ((v >> 3) & 31) > 29 || ((v >> 8) & 31) > 29)
+            continue;
+
+        bi_init(&r, in, len, pos);
+        if (bi_block_header(&r, &b) == BI_OK)
+            return pos;
+    }
+    return UINT64_MAX;
+}
+
+int bi_trace_window(const unsigned char *in, size_t len, uint64_t bitpos,
+                    unsigned char *used) {
+    struct bi_block b;
+    struct bi_reader r;
+    uint64_t out = 0;           /* bytes decoded since bitpos */
+    int ret;
+
+    bi_init(&r, in, len, bitpos);
+    while (out < BI_WINSIZE) {
+        ret = bi_block_header(&r, &b);
+        if (ret != BI_OK)
+            goto trace_ret;
+
+        if (b.type == 0) {
+            /* stored data can't refer back; jump over it */
+            bi_init(&r, in, len, bi_tell(&r) + ((uint64_t) b.stored_left << 3));
+            out += b.stored_left;
+            if (exhausted(&r)) {
+                ret = BI_EINPUT;
+                goto trace_ret;
+            }
+        } else {
+            for (;;) {
+                int sym;
+
+                refill(&r);
+                sym = decode(&r, b.lit, BI_LIT_PRIMARY);
+                if (sym < 0) {
+                    ret = BI_EDATA;
+                    goto trace_ret;
+                }
+                if (sym < 256) {
+                    out++;
+                } else if (sym == 256) {
+                    break;
+                } else {
+                    uint32_t mlen, dist;
+
+                    sym -= 257;
+                    if (sym >= 29) {
+                        ret = BI_EDATA;
+                        goto trace_ret;
+                    }
+                    mlen = len_base[sym] + getbits(&r, len_extra[sym]);
+                    sym = decode(&r, b.dist, BI_DIST_PRIMARY);
+                    if (sym < 0 || sym >= 30) {
+                        ret = BI_EDATA;
+                        goto trace_ret;
+                    }
+                    dist = dist_base[sym] + getbits(&r, dist_extra[sym]);
+
+                    /* the part of the copy that comes from before bitpos */
+                    if (dist > out) {
+                        uint64_t from = out + BI_WINSIZE - dist;
+                        uint64_t n = dist - out < mlen ? dist - out : mlen;
+                        if (dist > out + BI_WINSIZE) {
+                            ret = BI_EDATA;
+                            goto trace_ret;
+                        }
+                        memset(used + from, 1, n);
+                    }
+                    out += mlen;
+                }
+                if (exhausted(&r)) {
+                    ret = BI_EINPUT;
+                    goto trace_ret;
+                }
+                if (out >= BI_WINSIZE)
+                    break;
+            }
+        }
+
+        /* nothing after the last block can refer back past the stream start */
+        if (b.final)
+            break;
+    }
+    return BI_OK;
+
+    trace_ret:
+    if (ret == BI_EINPUT) {
+        /* Anything from here on could still reach back as far as this */
+        if (out < BI_WINSIZE)
+            memset(used + out, 1, BI_WINSIZE - out);
+        return BI_OK;
+    }
+    return ret;
+}
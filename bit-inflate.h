@@ -0,0 +1,112 @@
+#ifndef BIT_INFLATE_H
+#define BIT_INFLATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* bit-inflate is a small raw deflate decoder that, unlike zlib, can be
+ * started at any bit position of an in-memory buffer and reports what it
+ * decodes symbol by symbol. zlib stays the engine for plain decompression;
+ * this is for the things zlib can't tell us, like which bytes of the
+ * preceding window a stretch of deflate data refers back to, or what the
+ * data after a block boundary decodes to when that window isn't known. */
+
+#define BI_WINSIZE 32768U       /* deflate's maximum distance */
+
+/* return codes */
+#define BI_OK 0
+#define BI_EDATA -1             /* invalid deflate data */
+#define BI_EINPUT -2            /* ran out of input */
+#define BI_EMEM -3              /* out of memory */
+
+/* Symbols of bi_output's wide copy from BI_MARKER up stand for byte
+ * (symbol - BI_MARKER) of the unknown BI_WINSIZE window before the output */
+#define BI_MARKER 256
+
+/* Huffman decoding table sizes: a primary table indexed by the low
+ * BI_*_PRIMARY bits of the bit buffer plus second level tables for longer
+ * codes. Every symbol can at most own one second level table */
+#define BI_LIT_PRIMARY 10
+#define BI_DIST_PRIMARY 8
+#define BI_LIT_TABLE ((1 << BI_LIT_PRIMARY) + 288 * (1 << (15 - BI_LIT_PRIMARY)))
+#define BI_DIST_TABLE ((1 << BI_DIST_PRIMARY) + 32 * (1 << (15 - BI_DIST_PRIMARY)))
+
+/* bi_reader reads bits LSB first out of buf[0..len) */
+struct bi_reader {
+    const unsigned char *buf;
+    size_t len;
+    size_t next;                /* next byte of buf to load */
+    uint64_t bitbuf;            /* bits loaded but not consumed */
+    unsigned bitcnt;            /* number of valid bits in bitbuf */
+    uint64_t phantom;           /* zero bits loaded past the end of buf */
+};
+
+/* bi_block is the decoding state for the current deflate block */
+struct bi_block {
+    int final;                  /* 1 if this is the last block of the stream */
+    int type;                   /* 0 stored, 1 fixed, 2 dynamic */
+    uint32_t stored_left;       /* bytes left in a stored block */
+    uint32_t lit[BI_LIT_TABLE];     /* literal/length decoding table */
+    uint32_t dist[BI_DIST_TABLE];   /* distance decoding table */
+};
+
+/* bi_output collects what bi_inflate_block() decodes. When decoding starts
+ * where the preceding window isn't known, the bytes copied out of it can't
+ * be known either, so as long as a back-reference could still reach one the
+ * output is also kept as 16-bit symbols in wide, where such a byte is a
+ * marker saying where in the window it comes from. Once the last BI_WINSIZE
+ * bytes are free of markers no later byte can be one, and only buf grows */
+struct bi_output {
+    unsigned char *buf;         /* decoded bytes, 0 in place of markers */
+    size_t len;                 /* bytes decoded */
+    size_t size;                /* bytes allocated in buf */
+    uint16_t *wide;             /* buf[0..wide_len) as symbols */
+    size_t wide_len;
+    size_t wide_size;           /* symbols allocated in wide */
+    size_t marker_end;          /* one past the last marker in wide */
+    int spec;                   /* 1 while markers can still be copied */
+};
+
+/* bi_init() positions r at bit bitpos of buf */
+void bi_init(struct bi_reader *r, const unsigned char *buf, size_t len,
+             uint64_t bitpos);
+
+/* bi_tell() returns the bit position of the next unread bit */
+uint64_t bi_tell(const struct bi_reader *r);
+
+/* bi_block_header() reads a block header at the current position into b.
+ * Returns BI_OK, BI_EDATA or BI_EINPUT */
+int bi_block_header(struct bi_reader *r, struct bi_block *b);
+
+/* bi_output_init() sets up o to collect output. With spec the window
+ * before the output is unknown and back-references to it make markers;
+ * without it they are invalid */
+void bi_output_init(struct bi_output *o, int spec);
+
+/* bi_output_free() frees o's buffers */
+void bi_output_free(struct bi_output *o);
+
+/* bi_inflate_block() decodes the block at the current position of r,
+ * header and all, appending its data to o. b->final says if it was the last
+ * block of the stream. Returns BI_OK, BI_EDATA, BI_EINPUT or BI_EMEM */
+int bi_inflate_block(struct bi_reader *r, struct bi_block *b,
+                     struct bi_output *o);
+
+/* bi_find_block() returns the first bit position in [from, to) of in[0..len)
+ * where a non-final block with dynamic Huffman codes starts, as far as its
+ * header can tell, or UINT64_MAX if there is none. Such headers are hard to
+ * fake: the code lengths of every code they describe have to add up. The
+ * data after one still has to decode for it to be a real block */
+uint64_t bi_find_block(const unsigned char *in, size_t len, uint64_t from,
+                       uint64_t to);
+
+/* bi_trace_window() decodes the deflate data starting at bit bitpos of
+ * in[0..len) and sets used[i] for every byte i of the preceding BI_WINSIZE
+ * window that is copied by a back-reference. It stops once no back-reference
+ * can reach the window any more or the deflate stream ends. If the input runs
+ * out first, the rest of the window that could still be referenced is marked
+ * as used. Returns BI_OK or BI_EDATA */
+int bi_trace_window(const unsigned char *in, size_t len, uint64_t bitpos,
+                    unsigned char *used);
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "chunk-inflate.h"
+
+#define WINSIZE 32768U          /* sliding window size */
+#define MAXFEED (1U << 30)      /* most bytes handed to zlib at once */
+
+/* gzip header flags */
+#define GZ_FHCRC 2
+#define GZ_FEXTRA 4
+#define GZ_FNAME 8
+#define GZ_FCOMMENT 16
+#define GZ_RESERVED 0xe0
+
+static uint32_t le32(const unsigned char *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+           (uint32_t) p[3] << 24;
+}
+
+int ci_header(const unsigned char *in, size_t len, size_t pos) {
+    size_t p = pos + 10;
+    int flags;
+
+    if (p > len || in[pos] != 0x1f || in[pos + 1] != 0x8b || in[pos + 2] != 8 ||
+        (in[pos + 3] & GZ_RESERVED))
+        return -1;
+    flags = in[pos + 3];
+    if (flags & GZ_FEXTRA) {
+        if (p + 2 > len)
+            return -1;
+        p += 2 + (in[p] | in[p + 1] << 8);
+    }
+    if (flags & GZ_FNAME) {
+        while (p < len && in[p])
+            p++;
+        p++;
+    }
+    if (flags & GZ_FCOMMENT) {
+        while (p < len && in[p])
+            p++;
+        p++;
+    }
+    if (flags & GZ_FHCRC)
+        p += 2;
+    if (p > len)
+        return -1;
+    return p - pos;
+}
+
+/* add_bound() records a boundary at the current end of c's output */
+static int add_bound(struct ci_chunk *c, uint64_t bit, int kind, uint32_t crc,
+                     uint32_t isize) {
+    if (c->nbounds == c->bsize) {
+        size_t size = c->bsize ? c->bsize << 1 : 64;
+        struct ci_boundary *next = realloc(c->bounds, size * sizeof(struct ci_boundary));
+        if (NULL == next)
+            return -1;
+        c->bounds = next;
+        c->bsize = size;
+    }
+    c->bounds[c->nbounds].bit = bit;
+    c->bounds[c->nbounds].out = c->out.len;
+    c->bounds[c->nbounds].kind = kind;
+    c->bounds[c->nbounds].crc = crc;
+    c->bounds[c->nbounds].isize = isize;
+    c->nbounds++;
+    return 0;
+}
+
+/* member_end() deals with the end of a gzip member whose trailer is at
+ * in[byte]. Returns 1 if the gzip data ends there, 0 if another member
+ * follows, with *pos set to the start of its deflate data, or < 0 if the
+ * trailer is cut off */
+static int member_end(const unsigned char *in, size_t len, size_t byte,
+                      struct ci_chunk *c, uint64_t *pos) {
+    int head;
+
+    if (byte + 8 > len)
+        return -1;
+    if (add_bound(c, (uint64_t) byte << 3, CI_TRAILER, le32(in + byte),
+                  le32(in + byte + 4)) < 0)
+        return -1;
+    byte += 8;
+    if (byte == len || (head = ci_header(in, len, byte)) < 0) {
+        c->end = CI_NONE;
+        c->data_end = byte;
+        c->garbage = byte != len;
+        return 1;
+    }
+    *pos = (uint64_t) (byte + head) << 3;
+    if (add_bound(c, *pos, CI_MEMBER, 0, 0) < 0)
+        return -1;
+    return 0;
+}
+
+/* zlib_at() points a raw inflate stream at the deflate block starting at bit
+ * offset pos of in[0..len) */
+static int zlib_at(z_stream *strm, const unsigned char *in, size_t len,
+                   uint64_t pos) {
+    size_t byte = pos >> 3;
+
+    if (inflateReset2(strm, -15) != Z_OK || byte >= len)
+        return -1;
+    if (pos & 7) {
+        (void) inflatePrime(strm, 8 - (pos & 7), in[byte] >> (pos & 7));
+        byte++;
+    }
+    strm->next_in = (unsigned char *) in + byte;
+    strm->avail_in = len - byte < MAXFEED ? len - byte : MAXFEED;
+    return 0;
+}
+
+/* grow() doubles the output buffer of o */
+static int grow(struct bi_output *o) {
+    size_t size = o->size ? o->size << 1 : (size_t) 1 << 20;
+    unsigned char *buf = realloc(o->buf, size);
+
+    if (NULL == buf)
+        return -1;
+    o->buf = buf;
+    o->size = size;
+    return 0;
+}
+
+int ci_decode(const unsigned char *in, size_t len, uint64_t start, uint64_t stop,
+              const unsigned char *dict, unsigned dict_len, struct ci_chunk *c) {
+    struct bi_block b;
+    struct bi_reader r;
+    z_stream strm;
+    uint64_t pos = start;
+    int fresh = 0;              /* 1 at the start of a member, with no window */
+    int ret;
+
+    memset(c, 0, sizeof(struct ci_chunk));
+    c->start = start;
+    c->end = CI_NONE;
+    bi_output_init(&c->out, dict == NULL);
+
+    /* Without a window, decode with markers until they stop mattering */
+    while (c->out.spec) {
+        bi_init(&r, in, len, pos);
+        if (bi_inflate_block(&r, &b, &c->out) != BI_OK)
+            return -1;
+        pos = bi_tell(&r);
+        if (!b.final) {
+            if (add_bound(c, pos, CI_BLOCK, 0, 0) < 0)
+                return -1;
+        } else {
+            ret = member_end(in, len, (pos + 7) >> 3, c, &pos);
+            if (ret != 0)
+                return ret < 0 ? -1 : 0;
+            c->out.spec = 0;    /* a new member can't refer back past its start */
+            fresh = 1;
+        }
+        if (pos >= stop) {
+            c->end = pos;
+            return 0;
+        }
+    }
+
+    /* zlib takes over with the last 32K of output, or the window it was
+     * given, as its dictionary */
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    if (inflateInit2(&strm, -15) != Z_OK)
+        return -1;
+    ret = -1;
+    if (zlib_at(&strm, in, len, pos) < 0)
+        goto ci_decode_ret;
+    if (!fresh && c->out.len) {
+        unsigned n = c->out.len < WINSIZE ? c->out.len : WINSIZE;
+        (void) inflateSetDictionary(&strm, c->out.buf + c->out.len - n, n);
+    } else if (!fresh && dict_len) {
+        (void) inflateSetDictionary(&strm, dict, dict_len);
+    }
+
+    for (;;) {
+        if (strm.avail_in == 0) {
+            size_t at = strm.next_in - in;
+            if (at == len)
+                goto ci_decode_ret;     /* the data is cut off */
+            strm.avail_in = len - at < MAXFEED ? len - at : MAXFEED;
+        }
+        if (c->out.len == c->out.size && grow(&c->out) < 0)
+            goto ci_decode_ret;
+        size_t room = c->out.size - c->out.len;
+        strm.next_out = c->out.buf + c->out.len;
+        strm.avail_out = room < MAXFEED ? room : MAXFEED;
+        room = strm.avail_out;
+
+        int zret = inflate(&strm, Z_BLOCK);     /* return at end of block */
+        c->out.len += room - strm.avail_out;
+        if (zret == Z_STREAM_END) {
+            int end = member_end(in, len, strm.next_in - in, c, &pos);
+            if (end != 0) {
+                ret = end < 0 ? -1 : 0;
+                goto ci_decode_ret;
+            }
+        } else if (zret != Z_OK && zret != Z_BUF_ERROR) {
+            goto ci_decode_ret;
+        } else if ((strm.data_type & 128) && !(strm.data_type & 64)) {
+            pos = (uint64_t) (strm.next_in - in) * 8 - (strm.data_type & 7);
+            if (add_bound(c, pos, CI_BLOCK, 0, 0) < 0)
+                goto ci_decode_ret;
+        } else {
+            continue;
+        }
+
+        if (pos >= stop) {
+            c->end = pos;
+            ret = 0;
+            goto ci_decode_ret;
+        }
+        if (zret == Z_STREAM_END && zlib_at(&strm, in, len, pos) < 0)
+            goto ci_decode_ret;
+    }
+
+    ci_decode_ret:
+    (void) inflateEnd(&strm);
+    return ret;
+}
+
+void ci_free(struct ci_chunk *c) {
+    bi_output_free(&c->out);
+    free(c->bounds);
+    c->bounds = NULL;
+    c->nbounds = c->bsize = 0;
+}
@@ -0,0 +1,71 @@
+#ifndef CHUNK_INFLATE_H
+#define CHUNK_INFLATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "bit-inflate.h"
+
+/* chunk-inflate decompresses a gzip file in pieces that can be worked on at
+ * the same time. The compressed data is cut into chunks at arbitrary byte
+ * offsets; a chunk is decoded from the first deflate block that starts in it
+ * (found with bi_find_block()) up to the first block boundary at or after
+ * the start of the next chunk. Apart from the first chunk, the 32K window
+ * before a chunk isn't known while it is decoded, so bit-inflate decodes it
+ * with markers for the bytes copied out of that window (see bit-inflate.h)
+ * until the output no longer depends on them, and zlib does the rest with
+ * the last 32K as its dictionary. The caller then stitches the chunks
+ * together in order: it checks that each chunk starts where the one before
+ * it stopped, redoing the decoding from there if not, and fills in the
+ * markers from the end of the chunk before. */
+
+#define CI_NONE UINT64_MAX
+
+/* what a ci_boundary is */
+enum ci_kind {
+    CI_BLOCK,       /* the end of a block that isn't the last of its member */
+    CI_MEMBER,      /* the start of a gzip member's deflate data */
+    CI_TRAILER      /* the end of a gzip member */
+};
+
+/* ci_boundary is a place in the output of a chunk where a block or a gzip
+ * member ends or starts */
+struct ci_boundary {
+    uint64_t bit;       /* where the next block starts, as a bit offset into
+                           the file; for CI_TRAILER where the trailer is */
+    uint64_t out;       /* bytes of the chunk's output before it */
+    int kind;           /* enum ci_kind */
+    uint32_t crc;       /* CI_TRAILER: the member's CRC-32 and length mod */
+    uint32_t isize;     /*   2^32 from its trailer */
+};
+
+/* ci_chunk is the decoded data of one chunk */
+struct ci_chunk {
+    uint64_t start;             /* bit offset where decoding started */
+    uint64_t end;               /* bit offset of the boundary it stopped at,
+                                   or CI_NONE if the gzip data ended */
+    uint64_t data_end;          /* if it ended, where the last member did */
+    int garbage;                /* 1 if something other than a gzip member
+                                   followed the last member */
+    struct bi_output out;       /* the output, with markers if speculative */
+    struct ci_boundary *bounds; /* boundaries after start, up to end */
+    size_t nbounds;
+    size_t bsize;               /* bounds allocated */
+};
+
+/* ci_header() returns the length of the gzip member header at in[pos], or
+ * < 0 if there isn't a valid one there */
+int ci_header(const unsigned char *in, size_t len, size_t pos);
+
+/* ci_decode() decodes the gzip data in[0..len) from bit offset start, which
+ * has to be the start of a deflate block, into c, stopping at the first
+ * boundary at or past bit offset stop or at the end of the data. dict is the
+ * dict_len bytes of window before start, or NULL if it isn't known, in which
+ * case the output can have markers. Returns 0 on success, < 0 if the data
+ * doesn't decode from there, leaving c to be freed with ci_free() either way */
+int ci_decode(const unsigned char *in, size_t len, uint64_t start, uint64_t stop,
+              const unsigned char *dict, unsigned dict_len, struct ci_chunk *c);
+
+/* ci_free() frees the buffers of c */
+void ci_free(struct ci_chunk *c);
+
+#endif
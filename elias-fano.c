@@ -0,0 +1,105 @@
+#include <string.h>
+#include "elias-fano.h"
+
+/* low_bits() is the number of low bits per value for n values below universe */
+static unsigned low_bits(uint32_t n, uint64_t universe) {
+    unsigned l = 0;
+
+    while (l < 63 && (universe >> (l + 1)) >= n)
+        l++;
+    return universe > n ? l : 0;
+}
+
+/* sample_words() is how many 64-bit words the select samples of n values take */
+static size_t sample_words(uint32_t n) {
+    size_t samples = (n + EF_SAMPLE - 1) / EF_SAMPLE;
+
+    return (samples * sizeof(uint32_t) + 7) / 8;
+}
+
+size_t ef_max_words(uint32_t n, uint64_t universe) {
+    unsigned l = low_bits(n, universe);
+    uint64_t upper_bits = n + (universe >> l) + 1;
+
+    return ((uint64_t) n * l + 63) / 64 + (upper_bits + 63) / 64 + sample_words(n);
+}
+
+size_t ef_encode(const uint64_t *v, uint32_t n, struct ef_block *b,
+                 uint64_t *words) {
+    uint64_t universe = v[n - 1] - v[0] + 1;
+    unsigned l = low_bits(n, universe);
+    uint64_t *lower, *upper;
+    uint32_t *samples;
+    size_t total;
+
+    b->base = v[0];
+    b->n = n;
+    b->l = l;
+    memset(b->pad, 0, sizeof(b->pad));
+    b->lower_words = ((uint64_t) n * l + 63) / 64;
+    b->upper_words = (n + (universe >> l) + 1 + 63) / 64;
+    total = b->lower_words + b->upper_words + sample_words(n);
+    memset(words, 0, total * sizeof(uint64_t));
+
+    lower = words;
+    upper = words + b->lower_words;
+    samples = (uint32_t *) (upper + b->upper_words);
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t x = v[i] - b->base;
+        uint64_t high = (x >> l) + i;
+
+        if (l) {
+            uint64_t low = x & (((uint64_t) 1 << l) - 1);
+            uint64_t bit = (uint64_t) i * l;
+            lower[bit / 64] |= low << (bit % 64);
+            if (bit % 64 + l > 64)
+                lower[bit / 64 + 1] |= low >> (64 - bit % 64);
+        }
+        upper[high / 64] |= (uint64_t) 1 << (high % 64);
+        if (i % EF_SAMPLE == 0)
+            samples[i / EF_SAMPLE] = (uint32_t) high;
+    }
+    return total;
+}
+
+/* select_in_word() is the position of the k-th (0-based) set bit of w */
+static unsigned select_in_word(uint64_t w, unsigned k) {
+    while (k--)
+        w &= w - 1;
+    return __builtin_ctzll(w);
+}
+
+uint64_t ef_get(const struct ef_block *b, const uint64_t *words, uint32_t i) {
+    const uint64_t *lower = words;
+    const uint64_t *upper = words + b->lower_words;
+    const uint32_t *samples = (const uint32_t *) (upper + b->upper_words);
+    uint64_t low = 0, pos;
+    unsigned k;
+
+    /* Find the i-th set bit of upper, starting from the nearest sample */
+    pos = samples[i / EF_SAMPLE];
+    k = i % EF_SAMPLE;
+    if (k) {
+        uint64_t w = upper[pos / 64] & (~(uint64_t) 0 << (pos % 64));
+        unsigned ones;
+
+        /* the sample bit itself is the 0th one we count */
+        pos -= pos % 64;
+        while ((ones = __builtin_popcountll(w)) <= k) {
+            k -= ones;
+            pos += 64;
+            w = upper[pos / 64];
+        }
+        pos += select_in_word(w, k);
+    }
+
+    if (b->l) {
+        uint64_t bit = (uint64_t) i * b->l;
+        low = lower[bit / 64] >> (bit % 64);
+        if (bit % 64 + b->l > 64)
+            low |= lower[bit / 64 + 1] << (64 - bit % 64);
+        low &= ((uint64_t) 1 << b->l) - 1;
+    }
+    return b->base + (((pos - i) << b->l) | low);
+}
@@ -0,0 +1,44 @@
+#ifndef ELIAS_FANO_H
+#define ELIAS_FANO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Elias-Fano coding of monotone sequences, used for the dense read index.
+ * A sequence is cut into blocks of up to EF_BLOCK values so that a writer
+ * only ever has to buffer one block. Each value v of a block is stored as
+ * v - base split into l low bits, packed in the lower array, and the
+ * remaining high bits, stored in unary in the upper bit array: value i sets
+ * bit (high + i). That is 2 + l bits per value, where l is about
+ * log2(universe / n), plus a select sample every EF_SAMPLE values so that a
+ * lookup scans at most a few words of the upper array. */
+
+#define EF_BLOCK 65536          /* values per block */
+#define EF_SAMPLE 256           /* values per select sample */
+
+/* ef_block describes one encoded block. Its data is lower_words 64-bit words
+ * of low bits, then upper_words 64-bit words of high bits, then one uint32_t
+ * select sample per EF_SAMPLE values, padded to a multiple of 8 bytes */
+struct ef_block {
+    uint64_t base;              /* subtracted from every value of the block */
+    uint64_t data_off;          /* where the block's data is, for the caller */
+    uint32_t n;                 /* number of values */
+    uint32_t lower_words;       /* 64-bit words of low bits */
+    uint32_t upper_words;       /* 64-bit words of high bits */
+    uint8_t l;                  /* low bits per value */
+    uint8_t pad[3];
+};
+
+/* ef_max_words() is the most 64-bit words ef_encode() can need for n values */
+size_t ef_max_words(uint32_t n, uint64_t universe);
+
+/* ef_encode() encodes the n (1..EF_BLOCK) non-decreasing values v into
+ * words, which must hold ef_max_words(n, v[n-1] - v[0] + 1) words, and fills
+ * in all of b but data_off. Returns the number of words used */
+size_t ef_encode(const uint64_t *v, uint32_t n, struct ef_block *b,
+                 uint64_t *words);
+
+/* ef_get() returns value i (< b->n) of a block whose data is at words */
+uint64_t ef_get(const struct ef_block *b, const uint64_t *words, uint32_t i);
+
+#endif
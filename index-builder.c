@@ -5,12 +5,28 @@
 #include <getopt.h>
 #include <time.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <glob.h>
+#include <sys/wait.h>
 #include "deflate.h"
+#include "index-format.h"
+#include "bit-inflate.h"
+#include "elias-fano.h"
+#include "line-scan.h"
+#include "chunk-inflate.h"
+#include "read-ahead.h"
+#include "thread-pool.h"
 
 #define MSGSIZE 256
 #define WINSIZE 32768U          /* sliding window size */
 #define CHUNKSIZE 16384         /* file input buffer size */
 #define MAXLINE 2 * WINSIZE
+#define TRACE_AHEAD (4 * WINSIZE)   /* compressed bytes traced after a point */
+#define PAR_CHUNK (4 << 20)     /* compressed bytes per chunk with -n */
 
 enum log_level_t {
     LOG_NOTHING,
@@ -24,48 +40,30 @@ enum log_level_t {
 
 enum log_level_t GLOBAL_LEVEL = LOG_INFO;
 int idx_chunk_size = 10000;
-int line_num = 1; //Want the mod 4 maths to work out
+off_t line_num = 1; //Want the mod 4 maths to work out
 off_t seq_num = 0;
-int need_idx = 0;
+unsigned char last_out = '\n';     /* the last byte of output scanned */
+int want_point = 0;         /* a chunk starts after the candidate point */
+int need_seq = 0;           /* the next read to start wants a sequence entry */
+int spacing = IDX_SPACING_READS;    /* how access points are spaced, -s */
+off_t spacing_every = 0;    /* and how far apart */
+clock_t spacing_clock;      /* when inflating started, for a latency */
+off_t spacing_out;          /* and how much output there was then */
 int block_num = 0;
+int dense_reads = 0;
+int num_threads = 1;
+int embed = 0;
+int append = 0;             /* carry on from the existing index files */
+int follow = 0;             /* seconds to wait for the file to grow, or 0 */
+int from_stdin = 0;         /* read the gzip file from stdin, saving it */
+int chunk_stats = 0;        /* tally the reads of every chunk, -t */
+int batch_jobs = -1;        /* builds at once with -b, 0 for one per CPU */
+char *mate_file = NULL;     /* the other file of a read pair, with -p */
+FILE *fastq_out = NULL;     /* where the decompressed FASTQ goes, with -u */
+struct idx_source source;   /* fingerprint of the gzip file being indexed */
 char *output_file = "output";
 char err_str[100];
 
-static const char base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-char *base64_encode(const unsigned char *data, size_t input_length, size_t *output_length) {
-    *output_length = 4 * ((input_length + 2) / 3);
-
-    char *encoded_data = malloc(*output_length);
-    if (encoded_data == NULL) return NULL;
-
-    for (size_t i = 0, j = 0; i < input_length;) {
-        uint32_t octet_a = i < input_length ? (unsigned char)data[i++] : 0;
-        uint32_t octet_b = i < input_length ? (unsigned char)data[i++] : 0;
-        uint32_t octet_c = i < input_length ? (unsigned char)data[i++] : 0;
-
-        uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
-
-        encoded_data[j++] = base64_chars[(triple >> 3 * 6) & 0x3F];
-        encoded_data[j++] = base64_chars[(triple >> 2 * 6) & 0x3F];
-        encoded_data[j++] = base64_chars[(triple >> 1 * 6) & 0x3F];
-        encoded_data[j++] = base64_chars[(triple >> 0 * 6) & 0x3F];
-    }
-
-    static const char padding_char = '=';
-    switch (input_length % 3) {
-        case 1:
-            encoded_data[*output_length - 1] = padding_char;
-            encoded_data[*output_length - 2] = padding_char;
-            break;
-        case 2:
-            encoded_data[*output_length - 1] = padding_char;
-            break;
-    }
-
-    return encoded_data;
-}
-
 /* level_to_string is a utility to toggle log levels */
 const char* level_to_string(enum log_level_t level) {
     switch (level) {
@@ -112,14 +110,44 @@ struct seq_list {
     void *seq_entry;    /* List of seq_entries */
 };
 
+/* seq_stats are the aggregates of the reads of a sequence index chunk, from
+ * its entry to the next one, that -t adds to the entry. The same struct
+ * holds the read being tallied, whose bases and qual are complete once its
+ * fourth line ends */
+struct seq_stats {
+    uint64_t reads;
+    uint64_t bases;         /* total length of the reads */
+    uint64_t base[5];       /* A, C, G, T and N in them */
+    uint64_t min_len;       /* shortest and longest read */
+    uint64_t max_len;
+    uint64_t qual;          /* sum of the Phred+33 quality scores */
+};
+
+struct seq_stats *stats = NULL;     /* one per sequence index entry, with -t */
+int stats_size = 0;
+struct seq_stats read_stats;        /* the read being tallied */
+int stats_line = 0;                 /* which of its lines is next */
+uint64_t stats_reads = 0;           /* reads tallied so far */
+
 /* deflate_index is an access point list. This code was taken from
  * zran.c, written by Mark Adler (https://github.com/madler/zlib/blob/master/examples/zran.c) */
 struct deflate_index {
     int have;           /* number of list entries */
+    int size;           /* number of list entries allocated */
     int gzip;           /* 1 if the index is of a gzip file, 0 if it is of a
                            zlib stream */
     off_t length;       /* total length of uncompressed data */
     void *list;         /* allocated list of entries */
+    int traced;         /* points before this have had their windows traced */
+    int written;        /* points already in the .idx file, before list */
+    struct idx_point *table;    /* their table entries */
+    int table_size;     /* table entries allocated */
+    off_t windows_end;  /* where their windows end in the .idx file */
+    off_t window_bytes; /* compressed size of the windows written */
+    int published;      /* the .idx file holds a complete index, which
+                           writing more windows over its table would break */
+    FILE *fp;           /* the .idx file, once points are written to it */
+    z_stream zs;        /* compresses their windows */
 };
 
 static struct seq_list * add_seq(struct seq_list * list, off_t seqNum,
@@ -168,7 +196,11 @@ struct point {
     off_t out;          /* corresponding offset in uncompressed data */
     off_t in;           /* offset in input file of first full byte */
     int bits;           /* number of bits (1-7) from byte at in-1, or 0 */
+    off_t lines;        /* newlines before out */
     unsigned char window[WINSIZE];  /* preceding 32K of uncompressed data */
+    unsigned char *dict;    /* the part of window used after the point */
+    uint32_t dict_len;      /* bytes in dict */
+    uint8_t dict_flags;     /* IDX_PT_SPARSE/IDX_PT_NODICT, 0 for all of window */
 };
 
 
@@ -176,40 +208,53 @@ struct point {
  * was taken from zran.c, written by Mark Adler (https://github.com/madler/zlib/blob/master/examples/zran.c) */
 void deflate_index_free(struct deflate_index *index) {
     if (index != NULL) {
+        for (int i = 0; i < index->have; i++)
+            free(((struct point *) index->list + i)->dict);
         free(index->list);
+        free(index->table);
+        if (index->fp != NULL) {
+            (void)deflateEnd(&index->zs);
+            fclose(index->fp);
+        }
+        free(index);
+    }
+}
+
+/* deflate_index_new() allocates an empty deflate_index with room for eight
+ * points */
+static struct deflate_index *deflate_index_new(void) {
+    struct deflate_index *index = calloc(1, sizeof(struct deflate_index));
+
+    if (index == NULL) return NULL;
+    index->list = malloc(sizeof(struct point) << 3);
+    if (index->list == NULL) {
         free(index);
+        return NULL;
     }
+    index->size = 8;
+    return index;
 }
 
 /*  addpoint() adds a point to a deflate_index. This code was taken from
  * was taken from zran.c, written by Mark Adler (https://github.com/madler/zlib/blob/master/examples/zran.c)
  * Add an entry to the access point list. If out of memory, deallocate the
-   existing list and return NULL. index->gzip is the allocated size of the
-   index in point entries, until it is time for deflate_index_build() to
-   return, at which point gzip is set to indicate a gzip file or not.
+   existing list and return NULL.
  */
 static struct deflate_index *addpoint(struct deflate_index *index, int bits,
-                                      off_t in, off_t out, unsigned left,
-                                      unsigned char *window) {
+                                      off_t in, off_t out, off_t lines,
+                                      unsigned left, unsigned char *window) {
     struct point *next;
 
     /* if list is empty, create it (start with eight points) */
     if (index == NULL) {
-        index = malloc(sizeof(struct deflate_index));
+        index = deflate_index_new();
         if (index == NULL) return NULL;
-        index->list = malloc(sizeof(struct point) << 3);
-        if (index->list == NULL) {
-            free(index);
-            return NULL;
-        }
-        index->gzip = 8;
-        index->have = 0;
     }
 
         /* if list is full, make it bigger */
-    else if (index->have == index->gzip) {
-        index->gzip <<= 1;
-        next = realloc(index->list, sizeof(struct point) * index->gzip);
+    else if (index->have == index->size) {
+        index->size <<= 1;
+        next = realloc(index->list, sizeof(struct point) * index->size);
         if (next == NULL) {
             deflate_index_free(index);
             return NULL;
@@ -222,13 +267,18 @@ static struct deflate_index *addpoint(struct deflate_index *index, int bits,
     next->bits = bits;
     next->in = in;
     next->out = out;
+    next->lines = lines;
+    next->dict = NULL;
+    next->dict_len = 0;
+    next->dict_flags = 0;
     if (left)
         memcpy(next->window, window + WINSIZE - left, left);
     if (left < WINSIZE)
         memcpy(next->window + left, window, WINSIZE - left);
 
     char msg[MSGSIZE];
-    snprintf(msg, MSGSIZE, "Making index %d in: %lu out: %lu", index->have, next->in, next->out);
+    snprintf(msg, MSGSIZE, "Making index %d in: %lu out: %lu", index->written + index->have,
+             next->in, next->out);
     logger(LOG_DEBUG, msg);
 
     index->have++;
@@ -238,26 +288,550 @@ static struct deflate_index *addpoint(struct deflate_index *index, int bits,
 
 /* END ZRAN CODE */
 
+/* With reads spacing every chunk of reads gets an access point of its own
+ * at the start of the block its first read is in, so that readers inflate
+ * less than a block before getting to it. Points can only be made at block
+ * boundaries, which come before the reads in the block are seen, so the
+ * state at the last one is kept as a candidate until it is known whether a
+ * chunk starts before the next one */
+struct point candidate;
+int have_candidate = 0;
+
+/* take_candidate() makes the block boundary at bit position in * 8 - bits
+ * the candidate, with the window that ends left bytes into window */
+static void take_candidate(int bits, off_t in, off_t out, unsigned left,
+                           const unsigned char *window) {
+    candidate.bits = bits;
+    candidate.in = in;
+    candidate.out = out;
+    candidate.lines = line_num - 1;
+    if (left)
+        memcpy(candidate.window, window + WINSIZE - left, left);
+    if (left < WINSIZE)
+        memcpy(candidate.window + left, window, WINSIZE - left);
+    have_candidate = 1;
+}
+
+/* promote_candidate() adds the candidate to the index once a chunk has
+ * started after it
+ * @returns: 0 on success, < 0 on failure
+ */
+static int promote_candidate(struct deflate_index **index) {
+    *index = addpoint(*index, candidate.bits, candidate.in, candidate.out,
+                      candidate.lines, 0, candidate.window);
+    if (NULL == *index)
+        return -1;
+    block_num++;
+    have_candidate = 0;
+    want_point = 0;
+    return 0;
+}
+
+/* point_due() says whether the spacing policy wants an access point at a
+ * block boundary at byte in of the input and byte out of the output. For a
+ * latency the reader's worst case is inflating everything since the last
+ * point, which is taken to go as fast as it has gone in this build */
+static int point_due(struct deflate_index *index, off_t in, off_t out) {
+    off_t last_in, last_out;
+
+    if (NULL == index)
+        return 1;               /* the first block always gets one */
+    if (spacing == IDX_SPACING_READS)
+        return 0;               /* made from the candidates instead */
+
+    /* the last point was written out already if none are waiting */
+    if (index->have) {
+        struct point *last = (struct point *) index->list + index->have - 1;
+        last_in = last->in;
+        last_out = last->out;
+    } else {
+        last_in = index->table[index->written - 1].in;
+        last_out = index->table[index->written - 1].out;
+    }
+    if (spacing == IDX_SPACING_IN)
+        return in - last_in >= spacing_every;
+    if (spacing == IDX_SPACING_OUT)
+        return out - last_out >= spacing_every;
+
+    double ms = (double) (clock() - spacing_clock) * 1000 / CLOCKS_PER_SEC;
+    return ms > 0 && (out - last_out) * ms >= (double) (out - spacing_out) * spacing_every;
+}
+
+/* parse_spacing() sets the spacing policy from the argument of -s: reads,
+ * out=BYTES, in=BYTES or latency=MS, where BYTES can end in K, M or G
+ * @returns: 0 on success, < 0 if arg isn't one of those
+ */
+static int parse_spacing(const char *arg) {
+    static const char *names[] = {"reads", "out=", "in=", "latency="};
+    const char *suffixes = "KMG";
+    char *end;
+
+    if (strcmp(arg, names[IDX_SPACING_READS]) == 0) {
+        spacing = IDX_SPACING_READS;
+        return 0;
+    }
+    for (int i = IDX_SPACING_OUT; i <= IDX_SPACING_LATENCY; i++) {
+        size_t len = strlen(names[i]);
+        if (strncmp(arg, names[i], len) != 0)
+            continue;
+        long long n = strtoll(arg + len, &end, 10);
+        if (end == arg + len || n <= 0)
+            return -1;
+        if (i != IDX_SPACING_LATENCY && *end) {
+            const char *unit = strchr(suffixes, *end);
+            if (NULL == unit || end[1])
+                return -1;
+            n <<= 10 * (unit - suffixes + 1);
+            end++;
+        }
+        if (*end)
+            return -1;
+        spacing = i;
+        spacing_every = n;
+        return 0;
+    }
+    return -1;
+}
+
+/* trace_input keeps the compressed input from the oldest access point whose
+ * window hasn't been traced yet, or from the candidate, so that
+ * trace_points() can look at the deflate data that follows it */
+struct trace_input {
+    unsigned char *buf;
+    size_t have;
+    size_t size;
+    off_t start;        /* input file offset of buf[0] */
+};
+
+/* trace_append() adds len bytes of input to the end of trace */
+static int trace_append(struct trace_input *trace, const unsigned char *data,
+                        size_t len) {
+    if (trace->have + len > trace->size) {
+        size_t size = trace->size ? trace->size : CHUNKSIZE;
+        while (size < trace->have + len)
+            size <<= 1;
+        unsigned char *buf = realloc(trace->buf, size);
+        if (NULL == buf)
+            return -1;
+        trace->buf = buf;
+        trace->size = size;
+    }
+    memcpy(trace->buf + trace->have, data, len);
+    trace->have += len;
+    return 0;
+}
+
+/* point_byte() is the offset of the first input byte an access point needs */
+static off_t point_byte(const struct point *pt) {
+    return pt->in - (pt->bits ? 1 : 0);
+}
+
+/* trace_from() is the offset of the first input byte that trace has to keep:
+ * that of the oldest point not traced yet, or else of the candidate, which
+ * may become one. It is -1 if there is nothing to keep */
+static off_t trace_from(struct deflate_index *index) {
+    if (index != NULL && index->traced < index->have)
+        return point_byte((struct point *) index->list + index->traced);
+    return have_candidate ? point_byte(&candidate) : -1;
+}
+
+/* trace_keep() adds what trace needs of the len bytes of input at offset
+ * start, which follow last, the final byte of the input before them
+ * @returns: 0 on success, < 0 on failure
+ */
+static int trace_keep(struct deflate_index *index, struct trace_input *trace,
+                      const unsigned char *input, size_t len, off_t start,
+                      unsigned char last) {
+    off_t first = trace_from(index);
+
+    if (first < 0) {
+        trace->have = 0;
+        return 0;
+    }
+
+    /* What came before this input is kept already if it is needed, along
+     * with what no pending point or the candidate needs any more */
+    if (first < start - 1) {
+        off_t drop = first - trace->start;
+        memmove(trace->buf, trace->buf + drop, trace->have - drop);
+        trace->have -= drop;
+        trace->start = first;
+        return trace_append(trace, input, len);
+    }
+    trace->have = 0;
+    trace->start = first;
+    if (first < start) {
+        /* the partial byte of a point at the start */
+        if (trace_append(trace, &last, 1) < 0)
+            return -1;
+        first = start;
+    }
+    return trace_append(trace, input + (first - start), len - (first - start));
+}
+
+/* trace_points() cuts the windows of the access points added since the last
+ * call down to the bytes that the deflate data after each point refers back
+ * to. A point is only traced once TRACE_AHEAD bytes of input after it are in
+ * trace, which is plenty for the 32K of output that can reach its window,
+ * unless last says that the input has ended
+ * @returns: 0 on success, < 0 on failure
+ */
+static int trace_points(struct deflate_index *index, struct trace_input *trace,
+                        int last) {
+    unsigned char used[WINSIZE];
+    unsigned char blob[WINSIZE];
+
+    if (NULL == index)
+        return 0;
+
+    while (index->traced < index->have) {
+        struct point *pt = (struct point *) index->list + index->traced;
+        off_t off = point_byte(pt) - trace->start;
+
+        if (!last && trace->start + (off_t) trace->have < pt->in + TRACE_AHEAD)
+            break;
+
+        /* If the data can't be traced keep the whole window, it's still right */
+        memset(used, 0, WINSIZE);
+        if (bi_trace_window(trace->buf + off, trace->have - off,
+                            pt->bits ? 8 - pt->bits : 0, used) == BI_OK) {
+            pt->dict_len = idx_sparse_window(pt->window, used, blob, &pt->dict_flags);
+            if (pt->dict_flags) {
+                pt->dict = malloc(pt->dict_len ? pt->dict_len : 1);
+                if (NULL == pt->dict)
+                    return -1;
+                memcpy(pt->dict, blob, pt->dict_len);
+            }
+        }
+
+        char msg[MSGSIZE];
+        snprintf(msg, MSGSIZE, "Window of index %d keeps %u bytes", index->traced,
+                 pt->dict_flags ? pt->dict_len : WINSIZE);
+        logger(LOG_DEBUG, msg);
+        index->traced++;
+    }
+
+    return 0;
+}
+
+/* read_index accumulates the dense read index (see index-format.h), which
+ * is written out one block of EF_BLOCK read end offsets at a time */
+struct read_index {
+    FILE *fp;
+    char fullname[256];
+    uint64_t *ends;             /* read end offsets of the current block */
+    uint32_t have;              /* entries in ends */
+    struct ef_block *blocks;    /* descriptors of the blocks written */
+    uint64_t nblocks;
+    uint64_t size;              /* blocks allocated */
+    uint64_t nreads;            /* reads added so far */
+};
+
+/* read_index_open() creates the dense read index file fname.read-idx
+ * @returns: 0 on success, < 0 on failure
+ */
+static int read_index_open(struct read_index *ri, char *fname) {
+    memset(ri, 0, sizeof(struct read_index));
+    snprintf(ri->fullname, sizeof(ri->fullname), "%s.read-idx", fname);
+    ri->ends = malloc(EF_BLOCK * sizeof(uint64_t));
+    if (NULL == ri->ends)
+        return -1;
+    ri->fp = fopen(ri->fullname, "wb");
+    if (NULL == ri->fp || ridx_write_begin(ri->fp) < 0) {
+        logger(LOG_CRITICAL, "Failed to open read index file for writing");
+        return -1;
+    }
+    return 0;
+}
+
+/* read_index_flush() writes out the block of read ends collected so far */
+static int read_index_flush(struct read_index *ri) {
+    if (ri->have == 0)
+        return 0;
+    if (ri->nblocks == ri->size) {
+        ri->size = ri->size ? ri->size << 1 : 8;
+        struct ef_block *next = realloc(ri->blocks, ri->size * sizeof(struct ef_block));
+        if (NULL == next)
+            return -1;
+        ri->blocks = next;
+    }
+    if (ridx_write_block(ri->fp, ri->ends, ri->have, ri->blocks + ri->nblocks) < 0)
+        return -1;
+    ri->nblocks++;
+    ri->have = 0;
+    return 0;
+}
+
+/* read_index_add() records that a read ends at uncompressed offset end */
+static int read_index_add(struct read_index *ri, off_t end) {
+    ri->ends[ri->have++] = end;
+    ri->nreads++;
+    if (ri->have == EF_BLOCK)
+        return read_index_flush(ri);
+    return 0;
+}
+
+/* read_index_close() finishes the dense read index file
+ * @returns: 0 on success, < 0 on failure
+ */
+static int read_index_close(struct read_index *ri) {
+    struct ridx_header hdr = {0};
+    off_t size = 0;
+    int ret = 0;
+
+    hdr.nreads = ri->nreads;
+    hdr.created = time(NULL);
+    hdr.source = source;
+    if (read_index_flush(ri) < 0 ||
+        ridx_write_end(ri->fp, &hdr, ri->blocks, ri->nblocks) < 0 ||
+        fseeko(ri->fp, 0, SEEK_END) != 0 || (size = ftello(ri->fp)) < 0)
+        ret = -1;
+    if (fclose(ri->fp) != 0)
+        ret = -1;
+
+    char msg[MSGSIZE * 2];
+    if (ret < 0) {
+        logger(LOG_CRITICAL, "Failed writing the read index file");
+    } else {
+        snprintf(msg, MSGSIZE * 2, "Wrote %lu reads to read index file %s (%.2f bits per read)",
+                 ri->nreads, ri->fullname,
+                 ri->nreads ? 8.0 * size / ri->nreads : 0.0);
+        logger(LOG_INFO, msg);
+    }
+    free(ri->ends);
+    free(ri->blocks);
+    return ret;
+}
+
+/* tally_read
+ * @brief: adds the read just completed in read_stats to the stats of the
+ * sequence index chunk it is in, the last entry starting at or before it.
+ * Entries for the reads after it may already have been made
+ * @params:
+ * list (struct seq_list *): The sequence index entries so far
+ * @returns: 0 on success, < 0 on failure
+ */
+static int tally_read(struct seq_list *list) {
+    struct seq_entry *entries = list != NULL ? list->seq_entry : NULL;
+    int i = list != NULL && list->have ? list->have - 1 : 0;
+
+    while (i > 0 && (uint64_t) entries[i].seq_num > stats_reads)
+        i--;
+    if (i >= stats_size) {
+        int size = stats_size ? stats_size : 8;
+        while (size <= i)
+            size <<= 1;
+        struct seq_stats *next = realloc(stats, size * sizeof(struct seq_stats));
+        if (NULL == next)
+            return -1;
+        memset(next + stats_size, 0, (size - stats_size) * sizeof(struct seq_stats));
+        stats = next;
+        stats_size = size;
+    }
+
+    struct seq_stats *c = stats + i;
+    if (c->reads == 0 || read_stats.bases < c->min_len)
+        c->min_len = read_stats.bases;
+    if (read_stats.bases > c->max_len)
+        c->max_len = read_stats.bases;
+    c->reads++;
+    c->bases += read_stats.bases;
+    for (int k = 0; k < 5; k++)
+        c->base[k] += read_stats.base[k];
+    c->qual += read_stats.qual;
+    memset(&read_stats, 0, sizeof(struct seq_stats));
+    stats_reads++;
+    return 0;
+}
+
+/* tally_output
+ * @brief: tallies the bases and quality scores of len bytes of decompressed
+ * FASTQ, going on from where the last call left off. Only the sequence and
+ * quality lines are looked at byte by byte; the others are skipped with
+ * memchr()
+ * @params:
+ * buf (unsigned char *): The decompressed FASTQ
+ * len (size_t): Its length
+ * list (struct seq_list *): The sequence index entries so far
+ * @returns: 0 on success, < 0 on failure
+ */
+static int tally_output(const unsigned char *buf, size_t len, struct seq_list *list) {
+    size_t pos = 0;
+
+    while (pos < len) {
+        const unsigned char *nl = memchr(buf + pos, '\n', len - pos);
+        size_t end = nl != NULL ? (size_t) (nl - buf) : len;
+
+        if (stats_line == 1) {
+            for (size_t i = pos; i < end; i++)
+                switch (buf[i]) {
+                    case 'A': case 'a': read_stats.base[0]++; break;
+                    case 'C': case 'c': read_stats.base[1]++; break;
+                    case 'G': case 'g': read_stats.base[2]++; break;
+                    case 'T': case 't': read_stats.base[3]++; break;
+                    case 'N': case 'n': read_stats.base[4]++; break;
+                }
+            read_stats.bases += end - pos;
+        } else if (stats_line == 3) {
+            for (size_t i = pos; i < end; i++)
+                if (buf[i] > 33)
+                    read_stats.qual += buf[i] - 33;
+        }
+        if (NULL == nl)
+            break;
+        pos = end + 1;
+        if (++stats_line == 4) {
+            stats_line = 0;
+            if (tally_read(list) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* scan_output() walks len bytes of decompressed FASTQ starting at offset
+ * start of the uncompressed data, counting lines and reads. Every
+ * idx_chunk_size reads it makes a sequence index entry and asks for an
+ * access point, or with points spaced by the data (-s) it makes an entry at
+ * the first read after each point. If ri isn't NULL it records the end of
+ * every read. Only
+ * the newlines that end such a read are looked for one by one, the rest are
+ * just counted (see line-scan.h). With -u the bytes are also passed on to
+ * fastq_out, and with -t their reads are tallied
+ * @returns: 0 on success, < 0 on failure
+ */
+static int scan_output(const unsigned char *buf, unsigned len, off_t start,
+                       struct seq_list **seqList, struct read_index *ri) {
+    unsigned pos = 0;
+
+    if (fastq_out != NULL && fwrite(buf, 1, len, fastq_out) != len) {
+        logger(LOG_ERROR, "Error writing the decompressed FASTQ");
+        return -1;
+    }
+
+    if (len)
+        last_out = buf[len - 1];
+    while (pos < len) {
+        off_t every = ri != NULL || need_seq ? 4 : 4 * (off_t) idx_chunk_size;
+
+        /* Points spaced by the data leave no read to look for until the
+         * next point is made */
+        if (ri == NULL && !need_seq && spacing != IDX_SPACING_READS) {
+            line_num += ls_count(buf + pos, len - pos);
+            seq_num = (line_num - 1) / 4;
+            break;
+        }
+
+        /* The next newline that ends a read we need is this many away */
+        off_t target = (line_num + every - 1) / every * every;
+        size_t want = target - line_num + 1, n = want;
+        size_t i = ls_find(buf + pos, len - pos, &n);
+
+        if (i == len - pos) {
+            line_num += want - n;
+            seq_num = (line_num - 1) / 4;
+            break;
+        }
+        line_num = target + 1;
+        seq_num = target / 4;
+        pos += i + 1;
+        if (ri != NULL && read_index_add(ri, start + pos) < 0)
+            return -1;
+
+        /* If this is a multiple of the chunk size, or the first read after
+         * a point spaced by the data, make an entry in the sequence index */
+        if (spacing == IDX_SPACING_READS ? seq_num % idx_chunk_size == 0 : need_seq) {
+
+            char msg[MSGSIZE];
+            snprintf(msg, MSGSIZE, "Making sequence index entry for sequence number %lu", seq_num);
+            logger(LOG_DEBUG, msg);
+            /* The candidate becomes its point when the caller promotes it */
+            int own = spacing == IDX_SPACING_READS && have_candidate;
+            *seqList = add_seq(*seqList, seq_num, start + pos, block_num + own);
+            if (NULL == *seqList)
+                return -1;
+            want_point |= own;
+            need_seq = 0;
+        }
+    }
+
+    /* With -t the reads are tallied after the entries they may start have
+     * been made */
+    if (chunk_stats && tally_output(buf, len, *seqList) < 0)
+        return -1;
+    return 0;
+}
+
+/* finish_output
+ * @brief: ends the last read if the data stops in its quality line without
+ * a newline after it, which scan_output() and tally_output() would
+ * otherwise wait for
+ * @params:
+ * totout (off_t): The length of the uncompressed data
+ * list (struct seq_list *): The sequence index entries
+ * ri (struct read_index *): The dense read index, or NULL
+ * @returns: 1 if there was such a read, 0 if not, < 0 on failure
+ */
+static int finish_output(off_t totout, struct seq_list *list, struct read_index *ri) {
+    if (totout == 0 || last_out == '\n' || (line_num - 1) % 4 != 3)
+        return 0;
+    if (ri != NULL && read_index_add(ri, totout) < 0)
+        return -1;
+    if (chunk_stats && stats_line == 3) {
+        stats_line = 0;
+        if (tally_read(list) < 0)
+            return -1;
+    }
+    return 1;
+}
 
 //Prints the usage information on error
 void print_usage(char *argv[]) {
-    fprintf(stderr, "Usage: %s [-c CHUNKSIZE] GZIP_FILE\n", argv[0]);
+    fprintf(stderr, "Usage: %s [-a] [-c CHUNKSIZE] [-d] [-e] [-f SECONDS] [-i] [-n N_THREADS] [-o OUTFILE] [-s SPACING] [-t] [-u FASTQ] GZIP_FILE\n", argv[0]);
+    fprintf(stderr, "       %s -p MATE_FILE [-a] [-c CHUNKSIZE] [-d] [-e] [-n N_THREADS] [-o OUTFILE] [-t] GZIP_FILE\n", argv[0]);
+    fprintf(stderr, "       %s -b JOBS [-a] [-c CHUNKSIZE] [-d] [-e] [-n N_THREADS] [-s SPACING] [-t] GZIP_FILE...\n", argv[0]);
 }
 
 void print_help(char *argv[]) {
     fprintf(stderr, "index-builder builds an index into a gzipped FASTQ ");
     fprintf(stderr, "file to allow for parallel processing\n\n");
-    fprintf(stderr, "Usage: %s [-c CHUNKSIZE] [-o OUTFILE] GZIP_FILE\n", argv[0]);
+    print_usage(argv);
+    fprintf(stderr, "-a\t\tappend to the index in OUTFILE, indexing only the ");
+    fprintf(stderr, "data added to GZIP_FILE since it was written\n");
+    fprintf(stderr, "-b JOBS\t\tindex every GZIP_FILE (names, glob patterns or ");
+    fprintf(stderr, "- for names on stdin), largest first and JOBS at a time ");
+    fprintf(stderr, "(0 for one per CPU), writing each index next to its file\n");
     fprintf(stderr, "-c CHUNKSIZE\tthe integer chunk size with which to ");
     fprintf(stderr, "store indexes into the gzip file (default 10000)\n");
+    fprintf(stderr, "-d\t\talso write a dense index of every read's offset ");
+    fprintf(stderr, "to OUTFILE.read-idx\n");
+    fprintf(stderr, "-e\t\talso append the index files to GZIP_FILE, where ");
+    fprintf(stderr, "gzip ignores them\n");
+    fprintf(stderr, "-f SECONDS\tkeep indexing GZIP_FILE as it grows, until ");
+    fprintf(stderr, "it hasn't grown for SECONDS\n");
+    fprintf(stderr, "-i\t\tread the gzip file from stdin, saving it as ");
+    fprintf(stderr, "GZIP_FILE while indexing it\n");
+    fprintf(stderr, "-n N_THREADS\tdecompress a gzip file with N_THREADS threads ");
+    fprintf(stderr, "(default 1, 0 for one per CPU)\n");
     fprintf(stderr, "-o OUTFILE\tthe name of the output index file to ");
     fprintf(stderr, "write (default 'output.idx')\n");
+    fprintf(stderr, "-p MATE_FILE\talso index MATE_FILE, the mates of the reads ");
+    fprintf(stderr, "in GZIP_FILE, to OUTFILE_2 with the same read chunks\n");
+    fprintf(stderr, "-s SPACING\thow far apart to put access points: reads ");
+    fprintf(stderr, "(every CHUNKSIZE reads, the default), out=BYTES or ");
+    fprintf(stderr, "in=BYTES of uncompressed or compressed data, or ");
+    fprintf(stderr, "latency=MS of inflating\n");
+    fprintf(stderr, "-t\t\talso store the read count, base counts, read ");
+    fprintf(stderr, "lengths and quality sum of every chunk in the sequence index\n");
+    fprintf(stderr, "-u FASTQ\talso write the decompressed FASTQ to FASTQ, ");
+    fprintf(stderr, "or to stdout if it is -\n");
     fprintf(stderr, "-v\t\tenable verbose logging\n");
     fprintf(stderr, "GZIP_FILE\t<gzip file> is a gzipped FASTQ file to index\n");
 }
 
-int write_seqs(char * fname, char * infile, struct seq_list* list) {
+int write_seqs(char * fname, char * infile, struct seq_list* list, off_t length) {
     FILE *fp;
+    int have = list->have;
     time_t t;
     char fullname[256];
     char header[256];
@@ -273,21 +847,39 @@ int write_seqs(char * fname, char * infile, struct seq_list* list) {
     // Write the sequence index file header
     t = time(NULL);
     snprintf(header, sizeof(header),
-             "#time: %ld\n#input: %s\n#sequence_skip: %d\n#seq_num,block_num,out_offset\n",
-             (long) t, infile, idx_chunk_size);
+             "#time: %ld\n#input: %s\n#source: %lu,%ld,%08x,%08x\n"
+             "#sequence_skip: %d\n#seq_num,block_num,out_offset%s\n",
+             (long) t, infile, source.size, (long) source.mtime, source.head_crc,
+             source.tail_crc, idx_chunk_size,
+             chunk_stats ? ",reads,bases,A,C,G,T,N,min_len,max_len,qual_sum" : "");
     fputs(header, fp);
 
+    /* A read boundary at the very end of the data doesn't start another
+     * chunk, at least until more data is appended */
+    if (have > 1 && ((struct seq_entry *) list->seq_entry)[have - 1].start == length)
+        have--;
+
     // Iterate over each of the access points in the index, writing the
     // info to the index file
-    for (int i = 0; i < list->have; i++) {
+    for (int i = 0; i < have; i++) {
         char line[MAXLINE];
         struct seq_entry* this = list->seq_entry + (i * sizeof(struct seq_entry)); /* Get the next seq_entry */
-        sprintf(line, "%lu,%d,%lu\n", this->seq_num, this->block, this->start);
+        if (chunk_stats) {
+            struct seq_stats c = {0};
+            if (i < stats_size)
+                c = stats[i];
+            sprintf(line, "%lu,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+                    this->seq_num, this->block, this->start, c.reads, c.bases,
+                    c.base[0], c.base[1], c.base[2], c.base[3], c.base[4],
+                    c.min_len, c.max_len, c.qual);
+        } else {
+            sprintf(line, "%lu,%d,%lu\n", this->seq_num, this->block, this->start);
+        }
         fputs(line,fp);
     }
 
     char msg[MSGSIZE * 2];
-    snprintf(msg, MSGSIZE * 2, "Wrote %d entries to sequence index file %s", list->have, fullname);
+    snprintf(msg, MSGSIZE * 2, "Wrote %d entries to sequence index file %s", have, fullname);
     logger(LOG_INFO, msg);
     // Close the file
     fclose(fp);
@@ -295,8 +887,182 @@ int write_seqs(char * fname, char * infile, struct seq_list* list) {
 }
 
 
+/* read_whole
+ * @brief: reads all of a file into memory
+ * @params:
+ * path (string): The file to read
+ * len (uint64_t *): Set to the length of the file
+ * @returns: the malloc()ed contents, or NULL on failure
+ */
+static unsigned char *read_whole(char *path, uint64_t *len) {
+    FILE *fp = fopen(path, "rb");
+    unsigned char *buf = NULL;
+    off_t size;
+
+    if (NULL == fp)
+        return NULL;
+    if (fseeko(fp, 0, SEEK_END) == 0 && (size = ftello(fp)) >= 0 &&
+        fseeko(fp, 0, SEEK_SET) == 0 && (buf = malloc(size ? size : 1)) != NULL &&
+        fread(buf, 1, size, fp) == (size_t) size) {
+        *len = size;
+        fclose(fp);
+        return buf;
+    }
+    free(buf);
+    fclose(fp);
+    return NULL;
+}
+
+/* embed_index
+ * @brief: appends the index files just written to the gzip file they
+ * describe (see index-format.h), replacing any index embedded there before
+ * @params:
+ * fname (string): Output file name the index files were written under
+ * infile (string): The gzip file
+ * @returns: 0 on success, < 0 on failure
+ */
+int embed_index(char * fname, char * infile) {
+    static const char *suffix[EMB_NSECT] = {".idx", ".seq-idx", ".read-idx"};
+    unsigned char *sect[EMB_NSECT] = {0};
+    uint64_t len[EMB_NSECT] = {0};
+    uint64_t data_end;
+    char fullname[256];
+    char msg[MSGSIZE * 2];
+    FILE *fp = NULL;
+    int ret = -1;
+
+    for (int i = 0; i < EMB_NSECT; i++) {
+        if (i == EMB_RIDX && !dense_reads)
+            continue;
+        snprintf(fullname, sizeof(fullname), "%s%s", fname, suffix[i]);
+        sect[i] = read_whole(fullname, &len[i]);
+        if (NULL == sect[i]) {
+            snprintf(msg, MSGSIZE * 2, "Error reading back %s to embed it", fullname);
+            logger(LOG_ERROR, msg);
+            goto embed_index_ret;
+        }
+    }
+
+    /* Drop an index embedded by an earlier run before adding this one */
+    if (emb_data_end(infile, &data_end, msg, MSGSIZE * 2) < 0 ||
+        truncate(infile, data_end) != 0 ||
+        (fp = fopen(infile, "r+b")) == NULL ||
+        fseeko(fp, data_end, SEEK_SET) != 0 ||
+        emb_write(fp, sect, len, data_end) < 0) {
+        logger(LOG_ERROR, "Error appending the index to the gzip file");
+        goto embed_index_ret;
+    }
+    snprintf(msg, MSGSIZE * 2, "Embedded %lu bytes of index in %s",
+             len[EMB_IDX] + len[EMB_SEQ] + len[EMB_RIDX], infile);
+    logger(LOG_INFO, msg);
+    ret = 0;
+
+    embed_index_ret:
+    if (fp != NULL && fclose(fp) != 0)
+        ret = -1;
+    for (int i = 0; i < EMB_NSECT; i++)
+        free(sect[i]);
+    return ret;
+}
+
+/* spill_points
+ * @brief: appends the windows of the first n points in the list to the .idx
+ * file and moves the points into the table, so that the list only holds
+ * points whose windows haven't been traced yet. The file is opened on first
+ * use; points written by the run being resumed keep their windows where
+ * they are, and anything after them (the old table) is written over
+ * @params:
+ * fname (string): Output file name
+ * index (struct deflate_index *): The access point index pointer
+ * n (int): How many points to write
+ * @returns: 0 on success, < 0 on failure
+ */
+static int spill_points(char * fname, struct deflate_index * index, int n) {
+    char fullname[256];
+
+    if (n == 0)
+        return 0;
+    if (NULL == index->fp) {
+        snprintf(fullname, sizeof(fullname), "%s.idx", fname);
+        index->fp = fopen(fullname, index->written ? "r+b" : "wb");
+        if (NULL == index->fp) {
+            logger(LOG_CRITICAL, "Failed to open output file for writing");
+            return -1;
+        }
+
+        /* Windows are stored as raw deflate streams; FASTQ text compresses well */
+        index->zs.zalloc = Z_NULL;
+        index->zs.zfree = Z_NULL;
+        index->zs.opaque = Z_NULL;
+        if (deflateInit2(&index->zs, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            logger(LOG_CRITICAL, "Failed to initialize window compression");
+            fclose(index->fp);
+            index->fp = NULL;
+            return -1;
+        }
+        if (!index->written && idx_write_begin(index->fp) < 0)
+            goto spill_points_error;
+        if (!index->written && (index->windows_end = ftello(index->fp)) < 0)
+            goto spill_points_error;
+    }
+
+    if (index->written + n > index->table_size) {
+        int size = index->table_size ? index->table_size : 64;
+        while (size < index->written + n)
+            size <<= 1;
+        struct idx_point *table = realloc(index->table, size * sizeof(struct idx_point));
+        if (NULL == table) {
+            logger(LOG_CRITICAL, "Failed to allocate the access point table");
+            return -1;
+        }
+        index->table = table;
+        index->table_size = size;
+    }
+    if (fseeko(index->fp, index->windows_end, SEEK_SET) != 0)
+        goto spill_points_error;
+
+    // Write each access point's window, remembering where it went in the table
+    for (int i = 0; i < n; i++) {
+        struct point * pt = (struct point *) index->list + i;
+        struct idx_point * entry = index->table + index->written + i;
+        memset(entry, 0, sizeof(struct idx_point));
+        entry->out = pt->out;
+        entry->in = pt->in;
+        entry->bits = pt->bits;
+        entry->flags = pt->dict_flags;
+        entry->lines = pt->lines;
+        if (pt->dict_flags) {
+            if (idx_write_window(index->fp, entry, &index->zs, pt->dict, pt->dict_len) < 0)
+                goto spill_points_error;
+        } else if (idx_write_window(index->fp, entry, &index->zs, pt->window, WINSIZE) < 0) {
+            goto spill_points_error;
+        }
+        index->window_bytes += entry->window_len;
+        free(pt->dict);
+        pt->dict = NULL;
+    }
+    if ((index->windows_end = ftello(index->fp)) < 0)
+        goto spill_points_error;
+
+    /* The windows are on disk now */
+    memmove(index->list, (struct point *) index->list + n,
+            (index->have - n) * sizeof(struct point));
+    index->written += n;
+    index->have -= n;
+    index->traced = index->traced > n ? index->traced - n : 0;
+    return 0;
+
+    spill_points_error:
+    logger(LOG_CRITICAL, "Failed writing the gzip index file");
+    return -1;
+}
+
 /* write_index
- * @brief: writes the index file to the specified output file
+ * @brief: writes the binary access point index (see index-format.h) to the
+ * specified output file: the windows of the points still in the list, then
+ * the table and the header, after which the list is empty. It can be called
+ * again with more points, which then go over the table
  * @params:
  * fname (string): Output file name
  * infile (string): The file we're parsing
@@ -304,180 +1070,824 @@ int write_seqs(char * fname, char * infile, struct seq_list* list) {
  * @returns: 0 on success, < 0 on failure
  */
 int write_index(char * fname, char * infile, struct deflate_index * index) {
-    FILE *fp;
-    time_t t;
-    char fullname[256];
-    char header[256];
+    struct idx_header hdr = {0};
 
     /* Check that the index is NULL first */
     if (NULL == index) {
         logger(LOG_ERROR, "Index was NULL");
         return -1;
     }
-
-    // Open file for writing, or create it if it doesn't exist
-    sprintf(fullname, "%s.idx", fname);
-    fp = fopen(fullname, "w");
-    if (NULL == fp) {
-        logger(LOG_CRITICAL, "Failed to open output file for writing");
+    if (spill_points(fname, index, index->have) < 0)
         return -1;
-    }
-
-    // Write the index file header
-    t = time(NULL);
-    snprintf(header, sizeof(header),
-             "#time: %ld\n#input: %s\n#sequence_skip: %d\n#block_num,out_offset,in_offset,bits_in,window\n",
-             (long) t, infile, idx_chunk_size);
-    fputs(header, fp);
 
-    // Iterate over each of the access points in the index, writing the
-    // info to the index file
-    for (int i = 0; i < index->have; i++) {
-        size_t output_len;
-        char line[MAXLINE];
-        struct point * pt = index->list + (i * sizeof(struct point)); /* Get the next point */
-        char * b64 = base64_encode(pt->window,
-                      strlen((const char *) pt->window),
-                      &output_len); /* Base64 encode the window */
-
-        //Create the output line and write it to the file
-        sprintf(line, "%d,%ld,%ld,%d,%s\n",
-                i,pt->out, pt->in, pt->bits, b64);
-        fputs(line,fp);
+    hdr.flags = index->gzip ? IDX_FLAG_GZIP : 0;
+    hdr.sequence_skip = idx_chunk_size;
+    hdr.spacing = spacing;
+    hdr.spacing_every = spacing_every;
+    hdr.length = index->length;
+    hdr.created = time(NULL);
+    hdr.source = source;
+    if (NULL == index->fp || fseeko(index->fp, index->windows_end, SEEK_SET) != 0 ||
+        idx_write_end(index->fp, &hdr, index->table, index->written) < 0 ||
+        fflush(index->fp) != 0 ||
+        ftruncate(fileno(index->fp), index->windows_end +
+                  (off_t) index->written * sizeof(struct idx_point)) != 0) {
+        logger(LOG_CRITICAL, "Failed writing the gzip index file");
+        return -1;
     }
 
     char msg[MSGSIZE * 2];
-    snprintf(msg, MSGSIZE * 2, "Wrote %d entries to gzip index file %s", index->have, fullname);
+    snprintf(msg, MSGSIZE * 2, "Wrote %d entries to gzip index file %s.idx (input %s)",
+             index->written, fname, infile);
     logger(LOG_INFO, msg);
-
-    // Close the file
-    fclose(fp);
-
+    snprintf(msg, MSGSIZE * 2, "Compressed windows to %lu bytes", index->window_bytes);
+    logger(LOG_DEBUG, msg);
+    index->published = 1;
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    int opt;
-    char *filename;
-    while ((opt = getopt(argc, argv, "c:ho:v")) != -1) {
-        switch (opt) {
-            case 'c': //chunk size
-                idx_chunk_size = atoi(optarg);
-                break;
-            case 'o': //output filename
-                output_file = optarg;
-                break;
-            case 'h':
-                print_help(argv);
-                return 0;
-            case 'v':
-                GLOBAL_LEVEL = LOG_DEBUG;
-                logger(LOG_DEBUG, "Debug logging enabled");
-                break;
-            default:
-                print_usage(argv);
-                return 1;
+/* read_seqs
+ * @brief: reads back the entries of a sequence index file written by an
+ * earlier run, up to uncompressed offset limit
+ * @params:
+ * fname (string): Output file name the sequence index was written under
+ * limit (off_t): Entries starting after this are dropped
+ * @returns: the entries, or NULL on failure
+ */
+static struct seq_list *read_seqs(char * fname, off_t limit) {
+    struct seq_list *list = NULL;
+    char fullname[256];
+    char line[MAXLINE];
+    FILE *fp;
+
+    snprintf(fullname, sizeof(fullname), "%s.seq-idx", fname);
+    fp = fopen(fullname, "r");
+    if (NULL == fp) {
+        logger(LOG_ERROR, "Failed to open the sequence index file to append to");
+        return NULL;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        off_t seq, start;
+        int block;
+
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%ld,%d,%ld", &seq, &block, &start) != 3) {
+            logger(LOG_ERROR, "Malformed line in the sequence index file");
+            break;
         }
+        if (start > limit)
+            continue;
+        list = add_seq(list, seq, start, block);
+        if (NULL == list)
+            break;
     }
-
-    if (optind >= argc) {
-        print_usage(argv);
-        return 1;
+    if (ferror(fp) || !feof(fp)) {
+        if (list != NULL) {
+            free(list->seq_entry);
+            free(list);
+        }
+        list = NULL;
     }
+    fclose(fp);
+    return list;
+}
 
-    filename = argv[optind];
+/* resume_index
+ * @brief: picks up indexing where an earlier run on a shorter version of the
+ * same gzip file left off. The existing .idx and .seq-idx files are loaded,
+ * and the inflate state is restored at the last access point, so only the
+ * data from there on needs to be decompressed again
+ * @params:
+ * fname (string): Output file name the index files were written under
+ * infile (string): The gzip file
+ * in (FILE *): The open gzip file, left positioned at the restart point
+ * strm (z_stream *): Set up as a raw inflate at the last access point
+ * window (unsigned char *): Sliding window, filled with the point's window
+ * totin, totout (off_t *): Set to the compressed and uncompressed offsets of
+ * the last access point
+ * index (struct deflate_index **): Set to the index holding the points
+ * already written
+ * seqList (struct seq_list **): Set to the sequence index entries up to the
+ * last access point
+ * last (unsigned char *): Set to the byte before the access point
+ * @returns: 1 if the index was resumed, 0 if there is no index to resume,
+ * < 0 on failure
+ */
+static int resume_index(char * fname, char * infile, FILE * in, z_stream * strm,
+                        unsigned char * window, off_t * totin, off_t * totout,
+                        struct deflate_index ** index, struct seq_list ** seqList,
+                        unsigned char * last) {
+    struct idx_file idx;
+    const struct idx_point *pt;
+    unsigned char dict[WINSIZE];
+    char fullname[256];
+    char msg[MSGSIZE * 2];
+    int len, ret = -1;
 
-    time_t start_time = time(NULL);
-    FILE *fp= fopen(filename, "rb");
-    if (!fp) {
+    snprintf(fullname, sizeof(fullname), "%s.idx", fname);
+    if (access(fullname, F_OK) != 0) {
+        snprintf(msg, MSGSIZE * 2, "No index %s to append to, starting afresh", fullname);
+        logger(LOG_INFO, msg);
+        return 0;
+    }
+    if (idx_open(&idx, fullname, msg, MSGSIZE * 2) < 0) {
+        logger(LOG_ERROR, msg);
+        return -1;
+    }
+
+    /* Only appending to the file leaves the old index usable */
+    if (idx_check_prefix(&idx.hdr->source, infile, msg, MSGSIZE * 2) < 0) {
+        logger(LOG_ERROR, msg);
+        goto resume_index_ret;
+    }
+    if (idx.hdr->sequence_skip < 1) {
+        logger(LOG_ERROR, "The index to append to has no reads per sequence chunk");
+        goto resume_index_ret;
+    }
+    idx_chunk_size = idx.hdr->sequence_skip;
+    spacing = idx.hdr->spacing;
+    spacing_every = idx.hdr->spacing_every;
+
+    /* Restart from the last access point with its window as the dictionary */
+    pt = idx_get_point(&idx, idx.hdr->npoints - 1);
+    len = idx_load_window(&idx, pt, dict);
+    if (len < 0) {
+        logger(LOG_ERROR, "The window of the last access point is corrupt");
+        goto resume_index_ret;
+    }
+    memset(window, 0, WINSIZE);
+    memcpy(window + WINSIZE - len, dict, len);
+    if (inflateInit2(strm, -15) != Z_OK ||
+        fseeko(in, pt->in - (pt->bits ? 1 : 0), SEEK_SET) != 0)
+        goto resume_index_ret;
+    if (pt->bits) {
+        int c = getc(in);
+        if (c == EOF)
+            goto resume_index_ret;
+        (void)inflatePrime(strm, pt->bits, c >> (8 - pt->bits));
+        *last = c;
+    }
+    if (len)
+        (void)inflateSetDictionary(strm, dict, len);
+    strm->next_out = window;
+    strm->avail_out = WINSIZE;
+    *totin = pt->in;
+    *totout = pt->out;
+    line_num = pt->lines + 1;
+    seq_num = pt->lines / 4;
+    block_num = idx.hdr->npoints - 1;
+
+    /* The points already written stay where they are in the .idx file */
+    *index = deflate_index_new();
+    if (NULL == *index)
+        goto resume_index_ret;
+    (*index)->table = malloc(idx.hdr->npoints * sizeof(struct idx_point));
+    if (NULL == (*index)->table)
+        goto resume_index_ret;
+    memcpy((*index)->table, idx.base + idx.hdr->table_off,
+           idx.hdr->npoints * sizeof(struct idx_point));
+    (*index)->written = idx.hdr->npoints;
+    (*index)->table_size = idx.hdr->npoints;
+    (*index)->published = 1;
+    (*index)->windows_end = idx.hdr->table_off;
+    (*index)->gzip = (idx.hdr->flags & IDX_FLAG_GZIP) != 0;
+
+    /* Entries after the point will be found again. One right at the point
+     * was left out if the data ended there */
+    *seqList = read_seqs(fname, pt->out);
+    if (NULL == *seqList)
+        goto resume_index_ret;
+    need_seq = spacing != IDX_SPACING_READS && block_num > 0;
+    if (spacing == IDX_SPACING_READS && pt->lines && pt->lines % 4 == 0 &&
+        seq_num % idx_chunk_size == 0 &&
+        ((struct seq_entry *) (*seqList)->seq_entry)[(*seqList)->have - 1].start != (off_t) pt->out &&
+        (*seqList = add_seq(*seqList, seq_num, pt->out, block_num)) == NULL)
+        goto resume_index_ret;
+
+    snprintf(msg, MSGSIZE * 2, "Appending to %s from access point %d at %lu",
+             fullname, block_num, pt->out);
+    logger(LOG_INFO, msg);
+    ret = 1;
+
+    resume_index_ret:
+    if (ret < 0)
+        logger(LOG_ERROR, "Failed to resume the existing index");
+    idx_close(&idx);
+    return ret;
+}
+
+/* wait_for_growth
+ * @brief: waits for the file at path to grow
+ * @params:
+ * path (string): The file to watch
+ * @returns: 1 if it grew, 0 if it didn't within follow seconds
+ */
+static int wait_for_growth(char * path) {
+    struct stat st;
+    off_t size;
+
+    if (stat(path, &st) != 0)
+        return 0;
+    size = st.st_size;
+    for (int waited = 0; waited < follow; waited++) {
+        sleep(1);
+        if (stat(path, &st) == 0 && st.st_size > size)
+            return 1;
+    }
+    return 0;
+}
+
+/* stitch is the state of putting the chunks of a parallel build back
+ * together, in order */
+struct stitch {
+    unsigned char hist[WINSIZE];    /* the last 32K of output so far */
+    off_t totout;                   /* bytes of output so far */
+    uLong crc;                      /* CRC-32 of the current member so far */
+    uint32_t isize;                 /* and its length mod 2^32 */
+    struct deflate_index *index;
+    struct seq_list *seqList;
+    struct read_index *ri;          /* dense read index, or NULL */
+};
+
+/* window_before() copies the 32K of output before offset out of buf, a
+ * chunk that follows the output in st->hist, to win */
+static void window_before(const struct stitch *st, const unsigned char *buf,
+                          size_t out, unsigned char *win) {
+    if (out >= WINSIZE) {
+        memcpy(win, buf + out - WINSIZE, WINSIZE);
+    } else {
+        memcpy(win, st->hist + out, WINSIZE - out);
+        if (out)
+            memcpy(win + WINSIZE - out, buf, out);
+    }
+}
+
+/* stitch_span() takes in len bytes of output: it counts their lines and
+ * reads and adds them to the CRC-32 of their gzip member */
+static int stitch_span(struct stitch *st, const unsigned char *buf, size_t len) {
+    while (len) {
+        unsigned n = len < (1U << 30) ? len : 1U << 30;
+        if (scan_output(buf, n, st->totout, &st->seqList, st->ri) < 0 ||
+            (want_point && promote_candidate(&st->index) < 0))
+            return -1;
+        st->crc = crc32(st->crc, buf, n);
+        st->isize += n;
+        st->totout += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* stitch_boundary() checks the trailer at the end of a gzip member, or
+ * makes an access point at a block boundary if one is needed, just like the
+ * loop in main() does with zlib. buf is the output of the chunk b is in */
+static int stitch_boundary(struct stitch *st, const unsigned char *buf,
+                           const struct ci_boundary *b) {
+    unsigned char win[WINSIZE];
+
+    if (b->kind == CI_TRAILER) {
+        if (b->crc != st->crc || b->isize != st->isize) {
+            logger(LOG_ERROR, "A gzip member's CRC-32 or length doesn't match its trailer");
+            return -1;
+        }
+        st->crc = crc32(0L, Z_NULL, 0);
+        st->isize = 0;
+        return 0;
+    }
+    off_t in = (b->bit + 7) >> 3;
+    if (!point_due(st->index, in, st->totout)) {
+        if (spacing == IDX_SPACING_READS) {
+            window_before(st, buf, b->out, win);
+            take_candidate(in * 8 - b->bit, in, st->totout, 0, win);
+        }
+        return 0;
+    }
+
+    /* We need to make an index point in the sequence-index if this is the very first block */
+    if (st->index == NULL) {
+        st->seqList = add_seq(st->seqList, 0, 0, 0);
+        if (NULL == st->seqList)
+            return -1;
+    } else {
+        block_num++;
+        need_seq = spacing != IDX_SPACING_READS;
+    }
+    window_before(st, buf, b->out, win);
+    st->index = addpoint(st->index, in * 8 - b->bit, in, st->totout, line_num - 1,
+                         0, win);
+    if (NULL == st->index)
+        return -1;
+    return 0;
+}
+
+/* stitch_chunk() adds the output of chunk c, which starts where the output
+ * so far ends, first filling in the bytes it copied from the window before
+ * it */
+static int stitch_chunk(struct stitch *st, struct ci_chunk *c) {
+    unsigned char *buf = c->out.buf;
+    size_t prev = 0;
+
+    if (c->out.wide != NULL) {
+        for (size_t i = 0; i < c->out.wide_len; i++)
+            if (c->out.wide[i] >= BI_MARKER)
+                buf[i] = st->hist[c->out.wide[i] - BI_MARKER];
+    }
+
+    for (size_t i = 0; i < c->nbounds; i++) {
+        const struct ci_boundary *b = c->bounds + i;
+        if (stitch_span(st, buf + prev, b->out - prev) < 0 ||
+            stitch_boundary(st, buf, b) < 0)
+            return -1;
+        prev = b->out;
+    }
+    if (stitch_span(st, buf + prev, c->out.len - prev) < 0)
+        return -1;
+
+    unsigned char win[WINSIZE];
+    window_before(st, buf, c->out.len, win);
+    memcpy(st->hist, win, WINSIZE);
+    return 0;
+}
+
+/* par_build is what the workers of a parallel build share with the thread
+ * that stitches their chunks together */
+struct par_build {
+    const unsigned char *map;   /* the gzip file */
+    uint64_t data_end;          /* where its gzip data ends */
+    uint64_t first;             /* bit offset of the first deflate block */
+    struct ci_chunk *chunks;
+    int *done;                  /* 1 once a chunk has been decoded */
+    uint64_t nchunks;
+    uint64_t next;              /* next chunk for a worker to decode */
+    uint64_t stitched;          /* chunks before this are done with */
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* decode_chunk() decodes chunk k from the first block that starts in it,
+ * or leaves its start at CI_NONE if none does */
+static void decode_chunk(struct par_build *pb, uint64_t k) {
+    struct ci_chunk *c = pb->chunks + k;
+    uint64_t from = k * PAR_CHUNK * 8;
+    uint64_t to = (k + 1) * PAR_CHUNK < pb->data_end ? (k + 1) * PAR_CHUNK * 8 :
+                  pb->data_end * 8;
+    uint64_t stop = k + 1 < pb->nchunks ? to : CI_NONE;
+
+    /* The first chunk starts at the first block, with nothing before it */
+    if (k == 0) {
+        if (ci_decode(pb->map, pb->data_end, pb->first, stop,
+                      (const unsigned char *) "", 0, c) < 0)
+            c->start = CI_NONE;
+        return;
+    }
+
+    /* Try everything that looks like a block header until one decodes */
+    for (;;) {
+        uint64_t start = bi_find_block(pb->map, pb->data_end, from, to);
+        if (start == UINT64_MAX) {
+            memset(c, 0, sizeof(struct ci_chunk));
+            c->start = CI_NONE;
+            return;
+        }
+        if (ci_decode(pb->map, pb->data_end, start, stop, NULL, 0, c) == 0)
+            return;
+        ci_free(c);
+        from = start + 1;
+    }
+}
+
+/* par_task is a worker, decoding chunks in order as long as it doesn't get
+ * too far ahead of the stitching */
+void *par_task(void *arg) {
+    struct par_build *pb = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pb->lock);
+        while (!pb->quit && pb->next < pb->nchunks &&
+               pb->next >= pb->stitched + 2 * (uint64_t) num_threads)
+            pthread_cond_wait(&pb->cond, &pb->lock);
+        if (pb->quit || pb->next >= pb->nchunks) {
+            pthread_mutex_unlock(&pb->lock);
+            return NULL;
+        }
+        uint64_t k = pb->next++;
+        pthread_mutex_unlock(&pb->lock);
+
+        decode_chunk(pb, k);
+
+        pthread_mutex_lock(&pb->lock);
+        pb->done[k] = 1;
+        pthread_cond_broadcast(&pb->cond);
+        pthread_mutex_unlock(&pb->lock);
+    }
+}
+
+/* release_chunk() frees chunk k once it has been stitched or thrown away,
+ * letting the workers move on */
+static void release_chunk(struct par_build *pb, uint64_t k) {
+    ci_free(pb->chunks + k);
+    pthread_mutex_lock(&pb->lock);
+    pb->stitched = k + 1;
+    pthread_cond_broadcast(&pb->cond);
+    pthread_mutex_unlock(&pb->lock);
+}
+
+/* build_parallel
+ * @brief: builds the access points and sequence index of a gzip file with
+ * num_threads threads. Each decodes chunks of the file that start at the
+ * first deflate block in them (see chunk-inflate.h), while this thread puts
+ * them together in order and does everything the loop in main() does with
+ * the output. Where two chunks don't meet, because a chunk started at
+ * something that only looked like a block header or because the block
+ * boundary the chunk before it stopped at wasn't one that
+ * bi_find_block() looks for, the gap is decoded again here
+ * @params:
+ * filename (string): The gzip file
+ * st (struct stitch *): Gets the access points and sequence index entries
+ * @returns: 0 on success, 1 if the file isn't gzip, < 0 on failure
+ */
+static int build_parallel(char * filename, struct stitch * st) {
+    struct thread_pool pool;
+    struct par_build pb = {0};
+    uint64_t data_end, pos;
+    char msg[MSGSIZE];
+    struct stat sb;
+    int head, fd, ended = 0, ret = -1;
+
+    if (emb_data_end(filename, &data_end, msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
+        return -1;
+    }
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb) != 0 || data_end == 0) {
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    pb.map = mmap(NULL, data_end, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (pb.map == MAP_FAILED) {
+        logger(LOG_ERROR, "Failed to map the gzip file");
+        return -1;
+    }
+    head = ci_header(pb.map, data_end, 0);
+    if (head < 0) {
+        munmap((void *) pb.map, data_end);
+        return 1;
+    }
+
+    pb.data_end = data_end;
+    pb.first = (uint64_t) head << 3;
+    pb.nchunks = (data_end + PAR_CHUNK - 1) / PAR_CHUNK;
+    pb.chunks = calloc(pb.nchunks, sizeof(struct ci_chunk));
+    pb.done = calloc(pb.nchunks, sizeof(int));
+    if (NULL == pb.chunks || NULL == pb.done) {
+        free(pb.chunks);
+        free(pb.done);
+        munmap((void *) pb.map, data_end);
+        return -1;
+    }
+    pthread_mutex_init(&pb.lock, NULL);
+    pthread_cond_init(&pb.cond, NULL);
+    if (tp_start(&pool, (uint64_t) num_threads < pb.nchunks ? num_threads : (int) pb.nchunks,
+                 par_task, &pb, 0) < 0) {
+        logger(LOG_ERROR, "Couldn't start the threads");
+        goto build_parallel_ret;
+    }
+
+    /* The first member's deflate data is where zlib makes the first point */
+    struct ci_boundary first = {pb.first, 0, CI_MEMBER, 0, 0};
+    st->crc = crc32(0L, Z_NULL, 0);
+    if (stitch_boundary(st, NULL, &first) < 0)
+        goto build_parallel_ret;
+
+    /* The file holds everything there is to see after each point, so they
+     * can all be traced and written out straight away */
+    struct trace_input whole = {(unsigned char *) pb.map, data_end, data_end, 0};
+
+    pos = pb.first;
+    for (uint64_t k = 0; !ended;) {
+        struct ci_chunk *c = NULL;
+        struct ci_chunk gap;
+
+        if (k < pb.nchunks) {
+            pthread_mutex_lock(&pb.lock);
+            while (!pb.done[k])
+                pthread_cond_wait(&pb.cond, &pb.lock);
+            pthread_mutex_unlock(&pb.lock);
+            c = pb.chunks + k;
+
+            /* A chunk that starts before where the last one stopped started
+             * at something that wasn't a block */
+            if (c->start == CI_NONE || c->start < pos) {
+                release_chunk(&pb, k++);
+                continue;
+            }
+        }
+
+        if (NULL == c || c->start > pos) {
+            unsigned dict = st->totout < WINSIZE ? st->totout : WINSIZE;
+            snprintf(msg, MSGSIZE, "Decoding again from bit %lu", pos);
+            logger(LOG_DEBUG, msg);
+            if (ci_decode(pb.map, data_end, pos, NULL == c ? CI_NONE : c->start,
+                          st->hist + WINSIZE - dict, dict, &gap) < 0) {
+                ci_free(&gap);
+                logger(LOG_ERROR, "Invalid deflate data in the gzip file");
+                goto build_parallel_ret;
+            }
+            c = &gap;
+        }
+
+        if (stitch_chunk(st, c) < 0 || trace_points(st->index, &whole, 1) < 0 ||
+            spill_points(output_file, st->index, st->index->traced) < 0) {
+            if (c == &gap)
+                ci_free(&gap);
+            goto build_parallel_ret;
+        }
+        pos = c->end;
+        if (c->end == CI_NONE) {
+            ended = 1;
+            if (c->garbage)
+                logger(LOG_WARNING, "Ignoring data after the last gzip member");
+        }
+        if (c == &gap)
+            ci_free(&gap);
+        else
+            release_chunk(&pb, k++);
+    }
+
+    st->index->gzip = 1;
+    ret = 0;
+
+    build_parallel_ret:
+    pthread_mutex_lock(&pb.lock);
+    pb.quit = 1;
+    pthread_cond_broadcast(&pb.cond);
+    pthread_mutex_unlock(&pb.lock);
+    tp_join(&pool, NULL);
+    for (uint64_t k = 0; k < pb.nchunks; k++)
+        ci_free(pb.chunks + k);
+    free(pb.chunks);
+    free(pb.done);
+    pthread_mutex_destroy(&pb.lock);
+    pthread_cond_destroy(&pb.cond);
+    munmap((void *) pb.map, data_end);
+    return ret;
+}
+
+/* write_outputs
+ * @brief: writes the .idx and .seq-idx files for the data indexed so far
+ * @params:
+ * infile (string): The gzip file
+ * index (struct deflate_index *): The access points
+ * trace (struct trace_input *): Input kept for points not traced yet
+ * seqList (struct seq_list *): The sequence index entries
+ * gzip (int): 1 if the input has a gzip wrapper
+ * length (off_t): Length of the uncompressed data indexed
+ * @returns: 0 on success, < 0 on failure
+ */
+static int write_outputs(char * infile, struct deflate_index * index,
+                         struct trace_input * trace, struct seq_list * seqList,
+                         int gzip, off_t length) {
+    char msg[MSGSIZE];
+
+    if (NULL == index || NULL == seqList) {
+        logger(LOG_ERROR, "No data to index in the gzip file");
+        return -1;
+    }
+
+    /* Fingerprint the file that was just indexed, so that readers can refuse
+     * to use the index with anything else */
+    if (idx_fingerprint(infile, &source, msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
+        return -1;
+    }
+    if (embed)
+        source.mtime = 0;   /* embedding the index changes it */
+
+    /* Everything there is to see after the last points has been read */
+    if (trace_points(index, trace, 1) < 0)
+        return -1;
+
+    /* Record what kind of stream this was and how long it is */
+    index->gzip = gzip;
+    index->length = length;
+
+    /* Write the GZIP index file with suffix ".idx" */
+    if (write_index(output_file, infile, index) < 0) {
+        logger(LOG_ERROR, "Error writing gzip index file; exiting");
+        return -1;
+    }
+
+    /* Write the sequence index file with suffix ".seq-idx" */
+    if (write_seqs(output_file, infile, seqList, length) < 0) {
+        logger(LOG_ERROR, "Error writing sequence index file; exiting");
+        return -1;
+    }
+    return 0;
+}
+
+/* build_index
+ * @brief: builds the index files of a gzip file under the name in
+ * output_file, with the options given
+ * @params:
+ * filename (string): The gzip file, or where to save stdin with -i
+ * fastq_file (string): Where to write the decompressed FASTQ with -u, or NULL
+ * @returns: 0 on success, non-zero on failure
+ */
+static int build_index(char *filename, char *fastq_file) {
+    time_t start_time = time(NULL);
+    FILE *fp = from_stdin ? stdin : fopen(filename, "rb");
+    FILE *save = NULL;                  /* the copy of stdin, with -i */
+    if (!fp) {
         snprintf(err_str, 100, "Fatal error; failed to open %s\n", filename);
         logger(LOG_ERROR, err_str);
         return 1;
     }
+    if (from_stdin && NULL == (save = fopen(filename, "wb"))) {
+        snprintf(err_str, 100, "Fatal error; failed to create %s\n", filename);
+        logger(LOG_ERROR, err_str);
+        return 1;
+    }
+    if (fastq_file != NULL) {
+        fastq_out = strcmp(fastq_file, "-") == 0 ? stdout : fopen(fastq_file, "wb");
+        if (NULL == fastq_out) {
+            snprintf(err_str, 100, "Fatal error; failed to create %s\n", fastq_file);
+            logger(LOG_ERROR, err_str);
+            return 1;
+        }
+    }
 
     int ret;
+    int gzip = 0;               /* 1 if the input has a gzip wrapper */
     off_t totin, totout;        /* our own total counters to avoid 4GB limit */
-    struct deflate_index *index;    /* access points being generated */
-    struct seq_list *seqList;
+    struct deflate_index *index = NULL;     /* access points being generated */
+    struct seq_list *seqList = NULL;
     z_stream strm;
-    unsigned char input[CHUNKSIZE];
+    unsigned char *input = NULL;        /* the buffer read ahead last */
     unsigned char window[WINSIZE];
+    struct read_ahead ra;               /* the thread reading the input */
+    struct trace_input trace = {0};     /* input after untraced points */
+    off_t chunk_start;                  /* input offset of input[0] */
+    size_t chunk_len = 0;               /* bytes in input */
+    unsigned char last_in = 0;          /* last byte of the previous chunk */
+    struct read_index ri;               /* dense read index, with -d */
+    uint64_t data_end;                  /* where the gzip data ends */
+    int raw = 0;                        /* 1 while inflating raw deflate data */
+    int member_end = 0;                 /* 1 between two gzip members */
+    unsigned skip = 0;                  /* gzip trailer bytes left to skip */
+    int done = 0;                       /* 1 once there is no more data */
+    int current = 0;                    /* 1 if the outputs are up to date */
+    int reading = 0;                    /* 1 once ra is reading the input */
+    char msg[MSGSIZE];
+
+    /* An index embedded by an earlier run isn't part of the data, but
+     * there's no telling where it starts in stdin */
+    if (from_stdin) {
+        data_end = UINT64_MAX;
+    } else if (emb_data_end(filename, &data_end, msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
+        return 1;
+    }
+
+    if (dense_reads && read_index_open(&ri, output_file) < 0)
+        return 1;
 
-    /* initialize inflate */
+    /* initialize inflate, either where an earlier run left off or at the
+     * start of the file */
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
     strm.avail_in = 0;
     strm.next_in = Z_NULL;
-    ret = inflateInit2(&strm, 47);      /* automatic zlib or gzip decoding */
-    if (ret != Z_OK)
-        return ret;
+    strm.avail_out = 0;
+    totin = totout = 0;
+    ret = append ? resume_index(output_file, filename, fp, &strm, window,
+                                &totin, &totout, &index, &seqList, &last_in) : 0;
+    if (ret < 0)
+        return 1;
+    if (ret) {
+        raw = 1;
+        gzip = index->gzip;
+    } else if (inflateInit2(&strm, 47) != Z_OK) {  /* automatic zlib or gzip decoding */
+        return 1;
+    }
+
+    spacing_clock = clock();
+    spacing_out = totout;
+
+    /* With more than one thread a gzip file is decompressed in chunks at the
+     * same time instead */
+    if (num_threads > 1) {
+        struct stitch st = {0};
+        st.ri = dense_reads ? &ri : NULL;
+        ret = build_parallel(filename, &st);
+        if (ret < 0)
+            return 1;
+        if (ret == 0) {
+            index = st.index;
+            seqList = st.seqList;
+            totout = st.totout;
+            gzip = 1;
+            done = 1;
+        }
+    }
+
+    /* The input is read on another thread while this one inflates */
+    if (!done) {
+        if (ra_start(&ra, fp, (uint64_t) totin < data_end ? data_end - totin : 0) < 0) {
+            logger(LOG_ERROR, "Couldn't start reading the gzip file");
+            return 1;
+        }
+        reading = 1;
+    }
 
     /* inflate the input, maintain a sliding window, and build an index -- this
        also validates the integrity of the compressed data using the check
        information in the gzip or zlib stream */
-    totin = totout = 0;
-    index = NULL;               /* will be allocated by first addpoint() */
-    strm.avail_out = 0;
-    do {
+    while (!done) {
 
-        strm.avail_in = fread(input, 1, CHUNKSIZE, fp);
-        if (ferror(fp)) {
+        /* the buffer is reused once the next one is taken */
+        if (chunk_len)
+            last_in = input[chunk_len - 1];
+        chunk_start = totin;
+        if (ra_next(&ra, &input, &chunk_len) < 0) {
             ret = Z_ERRNO;
             //goto build_index_error;
             return ret;
         }
-        if (strm.avail_in == 0) {
-            ret = Z_DATA_ERROR;
-            //goto build_index_error;
-            return ret;
+        strm.avail_in = chunk_len;
+        if (save != NULL && fwrite(input, 1, chunk_len, save) != chunk_len) {
+            snprintf(msg, MSGSIZE, "Error writing %s", filename);
+            logger(LOG_ERROR, msg);
+            return 1;
+        }
+
+        /* The data has run out; between gzip members that's the end of it */
+        if (chunk_len == 0) {
+            if (!(member_end && !skip) && !append && !follow) {
+                logger(LOG_ERROR, "The gzip file ends in the middle of its data");
+                return Z_DATA_ERROR;
+            }
+
+            /* Keep the index files up to date while waiting for more */
+            if (follow) {
+                if (!current && index != NULL) {
+                    if (write_outputs(filename, index, &trace, seqList, gzip, totout) < 0)
+                        return -1;
+                    current = 1;
+                }
+                if (wait_for_growth(filename)) {
+                    ra_stop(&ra);
+                    clearerr(fp);
+                    if (emb_data_end(filename, &data_end, msg, MSGSIZE) < 0) {
+                        logger(LOG_ERROR, msg);
+                        return 1;
+                    }
+                    if (ra_start(&ra, fp, (uint64_t) totin < data_end ? data_end - totin : 0) < 0) {
+                        logger(LOG_ERROR, "Couldn't start reading the gzip file");
+                        return 1;
+                    }
+                    continue;
+                }
+            }
+            if (!(member_end && !skip))
+                logger(LOG_WARNING, "The gzip file ends in the middle of its data, "
+                                    "indexing what there is so far");
+            break;
         }
         strm.next_in = input;
+        current = 0;
+
+        /* inflateInit2() with 47 detects the wrapper itself, but the index
+         * needs to say which one it was */
+        if (totin == 0)
+            gzip = strm.avail_in >= 2 && input[0] == 0x1f && input[1] == 0x8b;
 
         /* process all of that, or until end of stream */
-        do {
+        while (strm.avail_in != 0) {
+            /* what's left of the gzip trailer a raw inflate stops short of */
+            if (skip) {
+                unsigned n = skip < strm.avail_in ? skip : strm.avail_in;
+                strm.next_in += n;
+                strm.avail_in -= n;
+                totin += n;
+                skip -= n;
+                continue;
+            }
+
             /* reset sliding window if necessary */
             if (strm.avail_out == 0) {
                 strm.avail_out = WINSIZE;
                 strm.next_out = window;
-                /* If we haven't read any actual data bytes yet, this
-                 * is header goop. Ignore */
-                if (totout) {
-
-                    /* Read through the decompressed data in next_out */
-                    for (int i = 0; i < strm.avail_out; i++){
-
-                        /* If there's a new line, we care about that because they have meaning
-                         * in FASTQ files */
-                        if (strm.next_out[i] == '\n') {
-
-                            /* If this is the 4th one, it's a new sequence */
-                            if ((line_num % 4) == 0) {
-
-                                seq_num++;
-
-                                /* If this is a multiple of the chunk size, make an
-                                 * entry in the sequence index */
-                                if ((seq_num % idx_chunk_size) == 0) {
-
-                                    char msg[MSGSIZE];
-                                    snprintf(msg, MSGSIZE, "Making sequence index entry for sequence number %lu", seq_num);
-                                    logger(LOG_DEBUG, msg);
-                                    /* This position is (totout - strm.avail_out) + i */
-                                    seqList = add_seq(seqList, seq_num, (totout - strm.avail_out) + i + 1, block_num);
-                                    need_idx = 1;
-                                }
-                            }
-                            line_num++;
-                        }
-                    }
-                }
             }
 
-
-
             /* inflate until out of input, output, or at end of block --
                update the total input and output counters */
+            unsigned char *out = strm.next_out;
             totin += strm.avail_in;
             totout += strm.avail_out;
             ret = inflate(&strm, Z_BLOCK);      /* return at end of block */
@@ -485,68 +1895,510 @@ int main(int argc, char *argv[]) {
             totout -= strm.avail_out;
             if (ret == Z_NEED_DICT)
                 ret = Z_DATA_ERROR;
+            if (ret == Z_DATA_ERROR && member_end) {
+                logger(LOG_WARNING, "Ignoring data after the last gzip member");
+                done = 1;
+                break;
+            }
             if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
                 //TODO handle errors
                 return ret;
-            if (ret == Z_STREAM_END)
-                break;
 
+            /* Count the lines and reads in what that produced, so that line_num
+             * is exact when a point is made below */
+            unsigned produced = strm.next_out - out;
+            if (scan_output(out, produced, totout - produced, &seqList,
+                            dense_reads ? &ri : NULL) < 0 ||
+                (want_point && promote_candidate(&index) < 0))
+                return Z_MEM_ERROR;
+
+            if (ret == Z_STREAM_END) {
+                if (!gzip) {
+                    done = 1;
+                    break;
+                }
+
+                /* Another gzip member may follow. zlib reads the trailers
+                 * itself, except after the raw deflate of a resumed run */
+                if (raw)
+                    skip = 8;
+                if (inflateReset2(&strm, 31) != Z_OK)
+                    return Z_STREAM_ERROR;
+                raw = 0;
+                member_end = 1;
+                continue;
+            }
+            if (strm.data_type & 128)
+                member_end = 0;
 
             /* if at end of block, consider adding an index entry (note that if
                data_type indicates an end-of-block, then all of the
                uncompressed data from that block has been delivered, and none
                of the compressed data after that block has been consumed,
-               except for up to seven bits) -- the totout == 0 provides an
+               except for up to seven bits) -- the index == NULL provides an
                entry point after the zlib or gzip header, and assures that the
                index always has at least one access point; we avoid creating an
                access point after the last block by checking bit 6 of data_type
              */
             if ((strm.data_type & 128) && !(strm.data_type & 64) &&
-                (totout == 0 || need_idx)) {
+                point_due(index, totin, totout)) {
 
                 /* We need to make an index point in the sequence-index if this is the very first block */
-                if (totout == 0) {
-                    char msg[MSGSIZE];
+                if (index == NULL) {
                     snprintf(msg, MSGSIZE, "Making sequence index entry for sequence number %lu", seq_num);
                     logger(LOG_DEBUG, msg);
                     /* This position is (totout - strm.avail_out) + i */
                     seqList = add_seq(seqList, 0, 0, 0);
+                } else {
+                    block_num++;
+                    need_seq = spacing != IDX_SPACING_READS;
                 }
 
                 index = addpoint(index, strm.data_type & 7, totin,
-                                 totout, strm.avail_out, window);
-                char msg[MSGSIZE];
-                snprintf(msg, MSGSIZE, "Adding index checkpoint for block %d\n", block_num);
-                if (totout)
-                    block_num++;
-                if (index == NULL) {
+                                 totout, line_num - 1, strm.avail_out, window);
+                if (index == NULL || seqList == NULL) {
                     ret = Z_MEM_ERROR;
                     return ret;
                 }
-                need_idx = 0;
+            } else if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+                       spacing == IDX_SPACING_READS) {
+                take_candidate(strm.data_type & 7, totin, totout,
+                               strm.avail_out, window);
             }
-        } while (strm.avail_in != 0);
-    } while (ret != Z_STREAM_END);
+        }
 
-    /* Write the GZIP index file with suffix ".idx" */
-    if (write_index(output_file, filename, index) < 0) {
-        logger(LOG_ERROR, "Error writing gzip index file; exiting");
+        /* Points that still need tracing, and the candidate, need to see
+         * this input too */
+        if (trace_keep(index, &trace, input, chunk_len, chunk_start, last_in) < 0 ||
+            trace_points(index, &trace, 0) < 0)
+            return Z_MEM_ERROR;
+
+        /* Traced windows go to disk, unless the index files are up for
+         * readers to use while they are added to */
+        if (index != NULL && !index->published &&
+            spill_points(output_file, index, index->traced) < 0)
+            return 1;
+    }
+    (void)inflateEnd(&strm);
+
+    /* Whatever followed the data still belongs in the saved copy, which has
+     * to be complete before it is fingerprinted. The reading thread goes on
+     * to the end of stdin, as data_end is unknown there */
+    if (save != NULL) {
+        while ((ret = ra_next(&ra, &input, &chunk_len)) == 0 && chunk_len != 0)
+            if (fwrite(input, 1, chunk_len, save) != chunk_len)
+                break;
+        ret = ret < 0 || ferror(save);
+        if (fclose(save) != 0 || ret) {
+            snprintf(msg, MSGSIZE, "Error saving stdin to %s", filename);
+            logger(LOG_ERROR, msg);
+            return 1;
+        }
+    }
+    if (reading)
+        ra_stop(&ra);
+    fclose(fp);
+
+    /* A last read without a newline after it is a read all the same */
+    ret = finish_output(totout, seqList, dense_reads ? &ri : NULL);
+    if (ret < 0)
+        return -1;
+    if (ret)
+        current = 0;
+
+    if (!current && write_outputs(filename, index, &trace, seqList, gzip, totout) < 0)
+        return -1;
+    free(trace.buf);
+    free(stats);
+    deflate_index_free(index);
+
+    if (fastq_out != NULL && fclose(fastq_out) != 0) {
+        logger(LOG_ERROR, "Error writing the decompressed FASTQ");
         return -1;
     }
 
-    /* Write the sequence index file with suffix ".seq-idx" */
-    if (write_seqs(output_file, filename, seqList) < 0) {
-        logger(LOG_ERROR, "Error writing sequence index file; exiting");
+    if (dense_reads && read_index_close(&ri) < 0) {
+        logger(LOG_ERROR, "Error writing read index file; exiting");
+        return -1;
+    }
+
+    if (embed && embed_index(output_file, filename) < 0) {
+        logger(LOG_ERROR, "Error embedding the index files; exiting");
         return -1;
     }
 
     time_t end_time = time(NULL);
     double elapsed_time = difftime(end_time, start_time);
-    char msg[MSGSIZE];
     snprintf(msg, MSGSIZE, "Time elapsed creating index files: %f seconds", elapsed_time);
     logger(LOG_INFO, msg);
 
     return 0;
+}
+
+/* batch_file is one of the gzip files of a batch and how building its
+ * index went */
+struct batch_file {
+    char *path;
+    off_t size;
+    pid_t pid;              /* the process building it */
+    struct timespec start;
+    double seconds;         /* how long that took */
+    int status;             /* 0 if it succeeded, 1 if not */
+};
+
+/* batch_add() adds path to the files of a batch
+ * @returns: 0 on success, < 0 on failure */
+static int batch_add(struct batch_file **files, int *have, int *size, const char *path) {
+    if (*have == *size) {
+        int next_size = *size ? *size << 1 : 64;
+        struct batch_file *next = realloc(*files, next_size * sizeof(struct batch_file));
+        if (NULL == next)
+            return -1;
+        *files = next;
+        *size = next_size;
+    }
+    memset(*files + *have, 0, sizeof(struct batch_file));
+    (*files)[*have].path = strdup(path);
+    if (NULL == (*files)[*have].path)
+        return -1;
+    (*have)++;
+    return 0;
+}
+
+/* larger_first() orders the files of a batch by decreasing size */
+static int larger_first(const void *a, const void *b) {
+    off_t x = ((const struct batch_file *) a)->size;
+    off_t y = ((const struct batch_file *) b)->size;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* build_batch
+ * @brief: builds the index files of many gzip files, each next to its gzip
+ * file, batch_jobs at a time. Every build runs in a process of its own,
+ * since the builder keeps its state in globals, and the largest files go
+ * first so that a big one doesn't start last and run on its own. Prints how
+ * fast each one went
+ * @params:
+ * argc (int): The number of names
+ * argv (string array): The gzip files, as names or glob patterns, or - to
+ * read the names from stdin, one per line
+ * @returns: 0 if every index was built, 1 if not
+ */
+static int build_batch(int argc, char **argv) {
+    struct batch_file *files = NULL;
+    int have = 0, size = 0;
+    char msg[MSGSIZE];
+    char line[MAXLINE];
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-") == 0) {
+            while (fgets(line, sizeof(line), stdin) != NULL) {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0] != '\0' && batch_add(&files, &have, &size, line) < 0)
+                    return 1;
+            }
+            continue;
+        }
+        glob_t g;
+        if (glob(argv[i], GLOB_NOCHECK, NULL, &g) != 0) {
+            snprintf(msg, MSGSIZE, "Couldn't expand %s", argv[i]);
+            logger(LOG_ERROR, msg);
+            return 1;
+        }
+        for (size_t j = 0; j < g.gl_pathc; j++)
+            if (batch_add(&files, &have, &size, g.gl_pathv[j]) < 0) {
+                globfree(&g);
+                return 1;
+            }
+        globfree(&g);
+    }
+    if (have == 0) {
+        logger(LOG_ERROR, "No gzip files to index");
+        return 1;
+    }
+
+    for (int i = 0; i < have; i++) {
+        struct stat st;
+        if (stat(files[i].path, &st) == 0)
+            files[i].size = st.st_size;
+    }
+    qsort(files, have, sizeof(struct batch_file), larger_first);
+
+    /* Each build has num_threads threads of its own */
+    int jobs = batch_jobs;
+    if (jobs == 0) {
+        int cpus = tp_cpus();
+        jobs = cpus > num_threads ? cpus / num_threads : 1;
+    }
+    snprintf(msg, MSGSIZE, "Indexing %d files, %d at a time", have, jobs);
+    logger(LOG_INFO, msg);
+
+    struct timespec batch_start, now;
+    int next = 0, running = 0;
+    clock_gettime(CLOCK_MONOTONIC, &batch_start);
+    while (next < have || running) {
+        while (running < jobs && next < have) {
+            struct batch_file *f = files + next++;
+
+            fflush(stdout);
+            clock_gettime(CLOCK_MONOTONIC, &f->start);
+            f->pid = fork();
+            if (f->pid == 0) {
+                output_file = f->path;
+                exit(build_index(f->path, NULL) != 0);
+            }
+            if (f->pid < 0) {
+                snprintf(msg, MSGSIZE, "Couldn't start indexing %s", f->path);
+                logger(LOG_ERROR, msg);
+                f->status = 1;
+                continue;
+            }
+            running++;
+        }
+        if (running == 0)
+            break;
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            logger(LOG_ERROR, "Lost track of the indexing processes");
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int i = 0; i < next; i++)
+            if (files[i].pid == pid) {
+                files[i].seconds = (now.tv_sec - files[i].start.tv_sec) +
+                                   (now.tv_nsec - files[i].start.tv_nsec) / 1e9;
+                files[i].status = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+                files[i].pid = 0;
+                running--;
+            }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - batch_start.tv_sec) +
+                     (now.tv_nsec - batch_start.tv_nsec) / 1e9;
+
+    /* The summary, in the order the files were started */
+    int failed = 0;
+    double total = 0;
+    for (int i = 0; i < have; i++) {
+        double mib = files[i].size / 1048576.0;
+        printf("%s\t%.1f MiB\t%.2f s\t%.1f MiB/s\t%s\n", files[i].path, mib,
+               files[i].seconds, files[i].seconds > 0 ? mib / files[i].seconds : 0.0,
+               files[i].status ? "failed" : "ok");
+        failed += files[i].status;
+        total += mib;
+        free(files[i].path);
+    }
+    printf("%d files, %.1f MiB in %.2f s, %.1f MiB/s, %d failed\n", have, total,
+           seconds, seconds > 0 ? total / seconds : 0.0, failed);
+    free(files);
+    return failed != 0;
+}
+
+/* build_pair
+ * @brief: builds the index files of the two files of paired-end reads, the
+ * mate's under output_file with "_2" added, each in a process of its own.
+ * With the points spaced by reads both sequence indexes then have their
+ * entries at the same read numbers, so readers can hand out matching chunks
+ * of the two; this checks that the files have the same number of reads
+ * @params:
+ * filename (string): The gzip file of the first reads
+ * mate (string): The gzip file of their mates
+ * @returns: 0 on success, 1 on failure
+ */
+static int build_pair(char *filename, char *mate) {
+    char mate_output[256];
+    char *names[2] = {filename, mate};
+    char *outputs[2] = {output_file, mate_output};
+    pid_t pids[2];
+    int fds[2][2];
+    uint64_t reads[2] = {0};
+    int failed = 0;
+    char msg[MSGSIZE];
+
+    snprintf(mate_output, sizeof(mate_output), "%s_2", output_file);
+    for (int i = 0; i < 2; i++) {
+        if (pipe(fds[i]) < 0) {
+            logger(LOG_ERROR, "Couldn't start indexing the mate files");
+            return 1;
+        }
+        fflush(stdout);
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            /* the read count goes back to the parent */
+            output_file = outputs[i];
+            int ret = build_index(names[i], NULL);
+            uint64_t n = (line_num - 1) / 4;
+            if (ret == 0 && write(fds[i][1], &n, sizeof(n)) != sizeof(n))
+                ret = 1;
+            exit(ret != 0);
+        }
+        close(fds[i][1]);
+        if (pids[i] < 0) {
+            logger(LOG_ERROR, "Couldn't start indexing the mate files");
+            return 1;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        int status;
+        if (read(fds[i][0], &reads[i], sizeof(reads[i])) != sizeof(reads[i]))
+            failed = 1;
+        close(fds[i][0]);
+        if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0)
+            failed = 1;
+    }
+    if (failed)
+        return 1;
+    if (reads[0] != reads[1]) {
+        snprintf(msg, MSGSIZE, "%s has %lu reads but its mate file %s has %lu",
+                 filename, reads[0], mate, reads[1]);
+        logger(LOG_ERROR, msg);
+        return 1;
+    }
+    snprintf(msg, MSGSIZE, "Indexed %lu read pairs", reads[0]);
+    logger(LOG_INFO, msg);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int named = 0;              /* 1 if -o was given */
+    char *fastq_file = NULL;
+    while ((opt = getopt(argc, argv, "ab:c:def:hin:o:p:s:tu:v")) != -1) {
+        switch (opt) {
+            case 'a': //append to the existing index
+                append = 1;
+                break;
+            case 'b': //batch of gzip files
+                batch_jobs = atoi(optarg);
+                if (batch_jobs < 0) {
+                    print_usage(argv);
+                    return 1;
+                }
+                break;
+            case 'c': //chunk size
+                idx_chunk_size = atoi(optarg);
+                if (idx_chunk_size < 1) {
+                    print_usage(argv);
+                    return 1;
+                }
+                break;
+            case 'd': //dense read index
+                dense_reads = 1;
+                break;
+            case 'e': //embed the index in the gzip file
+                embed = 1;
+                break;
+            case 'f': //follow a growing file
+                follow = atoi(optarg);
+                if (follow <= 0) {
+                    print_usage(argv);
+                    return 1;
+                }
+                break;
+            case 'i': //read the gzip file from stdin
+                from_stdin = 1;
+                break;
+            case 'n': //number of threads
+                num_threads = atoi(optarg);
+                if (num_threads < 0) {
+                    print_usage(argv);
+                    return 1;
+                }
+                break;
+            case 'o': //output filename
+                output_file = optarg;
+                named = 1;
+                break;
+            case 'p': //mate file of paired-end reads
+                mate_file = optarg;
+                break;
+            case 's': //access point spacing
+                if (parse_spacing(optarg) < 0) {
+                    print_usage(argv);
+                    return 1;
+                }
+                break;
+            case 't': //per-chunk statistics
+                chunk_stats = 1;
+                break;
+            case 'u': //decompressed output
+                fastq_file = optarg;
+                break;
+            case 'h':
+                print_help(argv);
+                return 0;
+            case 'v':
+                GLOBAL_LEVEL = LOG_DEBUG;
+                logger(LOG_DEBUG, "Debug logging enabled");
+                break;
+            default:
+                print_usage(argv);
+                return 1;
+        }
+    }
+
+    if (num_threads == 0)
+        num_threads = tp_cpus();
+
+    if (optind >= argc) {
+        print_usage(argv);
+        return 1;
+    }
+
+    /* The dense read index is written in one go, and a file that is still
+     * growing can't have the index added to its end */
+    if (dense_reads && (append || follow)) {
+        logger(LOG_ERROR, "-d can't be combined with -a or -f");
+        return 1;
+    }
+    /* The reads before the point a resumed run restarts at aren't there to
+     * be tallied */
+    if (chunk_stats && append) {
+        logger(LOG_ERROR, "-t can't be combined with -a");
+        return 1;
+    }
+    if (embed && follow) {
+        logger(LOG_ERROR, "-e can't be combined with -f");
+        return 1;
+    }
+    if (num_threads > 1 && (append || follow)) {
+        logger(LOG_ERROR, "-n can't be combined with -a or -f");
+        return 1;
+    }
+
+    /* A latency is measured against how fast this thread inflates */
+    if (spacing == IDX_SPACING_LATENCY && num_threads > 1) {
+        logger(LOG_ERROR, "-s latency can't be combined with -n");
+        return 1;
+    }
+
+    /* A batch writes every index next to its gzip file, and reads its
+     * inputs whole */
+    if (batch_jobs >= 0 && (named || from_stdin || fastq_file != NULL || follow)) {
+        logger(LOG_ERROR, "-b can't be combined with -o, -i, -u or -f");
+        return 1;
+    }
+
+    /* Mates are kept in step by their read numbers */
+    if (mate_file != NULL && (spacing != IDX_SPACING_READS || batch_jobs >= 0 ||
+                              from_stdin || fastq_file != NULL || follow)) {
+        logger(LOG_ERROR, "-p can't be combined with -s, -b, -i, -u or -f");
+        return 1;
+    }
+
+    /* Input from stdin is indexed as it arrives, in one pass */
+    if (from_stdin && (append || follow || num_threads > 1)) {
+        logger(LOG_ERROR, "-i can't be combined with -a, -f or -n");
+        return 1;
+    }
 
+    if (batch_jobs >= 0)
+        return build_batch(argc - optind, argv + optind);
+    if (mate_file != NULL)
+        return build_pair(argv[optind], mate_file);
+    return build_index(argv[optind], fastq_file);
 }
 
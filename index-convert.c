@@ -0,0 +1,985 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "index-format.h"
+#include "bit-inflate.h"
+#include "line-scan.h"
+#include "inflate-backend.h"
+#include "thread-pool.h"
+
+#define WINSIZE 32768U          /* sliding window size */
+#define CHUNKSIZE 16384         /* file input buffer size */
+#define TRACE_AHEAD (4 * WINSIZE)   /* input read to trace a window's use */
+#define MSGSIZE 256
+
+enum log_level_t {
+    LOG_NOTHING,
+    LOG_CRITICAL,
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,
+    LOG_DEBUG,
+    LOG_TRACE
+};
+
+enum log_level_t GLOBAL_LEVEL = LOG_INFO;
+int idx_chunk_size = 10000;
+int num_threads = 0;            /* -n, or one per CPU if 0 */
+char *output_file = "output";
+
+/* level_to_string is a utility to toggle log levels */
+const char* level_to_string(enum log_level_t level) {
+    switch (level) {
+        case LOG_CRITICAL:
+            return "CRITICAL";
+        case LOG_ERROR:
+            return "ERROR";
+        case LOG_WARNING:
+            return "WARNING";
+        case LOG_INFO:
+            return "INFO";
+        case LOG_DEBUG:
+            return "DEBUG";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+/* Logger prints log messages at the specified granularity to stdout */
+void logger(enum log_level_t level, const char* message) {
+    if (level <= GLOBAL_LEVEL) {
+        time_t now;
+        time (&now);
+        fprintf (stderr,"%ld [%s]: %s\n", now, level_to_string(level), message);
+    }
+}
+
+/* The foreign index formats. Both store zran style access points: an
+ * uncompressed offset, the offset of the first full compressed byte, the
+ * number of bits taken from the byte before it, and the 32K window before
+ * the point.
+ *
+ * gztool (https://github.com/circulosmeos/gztool), all integers big-endian:
+ *   8 zero bytes, "gzipindx" (or "gzipindX" for version 1 indexes, which
+ *   then have a uint32_t line number format), uint64_t have, uint64_t size,
+ *   then per point uint64_t out, uint64_t in, uint32_t bits,
+ *   uint32_t window_size, window_size bytes of zlib compressed window
+ *   (nothing if 0) and, in version 1, a uint64_t line number.
+ *
+ * indexed_gzip (https://github.com/pauldmccarthy/indexed_gzip), also written
+ * and read by rapidgzip, all integers little-endian:
+ *   "GZIDX", uint8_t version, uint8_t flags, uint64_t compressed size,
+ *   uint64_t uncompressed size, uint32_t spacing, uint32_t window size,
+ *   uint32_t npoints, then per point uint64_t cmp_offset,
+ *   uint64_t uncmp_offset, uint8_t bits and, from version 1, a uint8_t
+ *   saying whether the point has a window, then the window of every point
+ *   that has one, uncompressed. Version 0 has a window for every point but
+ *   the first. */
+enum cvt_format {
+    FMT_GZTOOL,
+    FMT_GZIDX
+};
+
+#define GZTOOL_MAGIC "gzipindx"
+#define GZTOOL_MAGIC_V1 "gzipindX"
+#define GZIDX_MAGIC "GZIDX"
+
+/* cvt_point is an access point on its way from one format to another */
+struct cvt_point {
+    uint64_t out;               /* corresponding offset in uncompressed data */
+    uint64_t in;                /* offset in input file of first full byte */
+    int bits;                   /* number of bits (1-7) from byte at in-1, or 0 */
+    unsigned char *window;      /* the last window_len bytes before out */
+    uint32_t window_len;        /* 0 if the point needs no window */
+    unsigned char *dict;        /* the window as stored in the .idx */
+    uint32_t dict_len;
+    uint8_t dict_flags;         /* IDX_PT_SPARSE/IDX_PT_NODICT, 0 for all of window */
+};
+
+/* cvt_index is the list of access points being converted */
+struct cvt_index {
+    uint64_t have;
+    struct cvt_point *list;
+};
+
+/* seq_entry and seq_list are the sequence index entries, as in index-builder */
+struct seq_entry {
+    off_t seq_num;      /* Sequence number */
+    off_t start;        /* Offset from the start the uncompressed file */
+    int block;          /* Block number this sequence starts in */
+};
+
+struct seq_list {
+    int have;           /* Number of seq_entries */
+    int size;           /* Number of seq_entries we can have */
+    struct seq_entry *seq_entry;    /* List of seq_entries */
+};
+
+/* scan_job is what the workers computing the sequence index share. The
+ * access points split the data into spans that are decompressed
+ * independently: the first pass counts the newlines in every span, and once
+ * the line number at the start of every span is known from those counts the
+ * second pass finds the reads that start sequence chunks */
+struct scan_job {
+    char *filename;             /* the gzip file */
+    uint64_t data_end;          /* where its gzip data ends */
+    int gzip;                   /* 1 for gzip, 0 for zlib */
+    struct cvt_index *index;
+    uint64_t *newlines;         /* newlines in each span */
+    uint64_t *lines_before;     /* newlines before each span */
+    struct seq_list *entries;   /* sequence entries found in each span */
+    uint64_t length;            /* end of the last span */
+    int pass;                   /* 1 or 2 */
+    int failed;
+};
+
+/* scan_args is one worker's share of the spans */
+struct scan_args {
+    struct scan_job *job;
+    uint64_t first;             /* first span */
+    uint64_t last;              /* one past the last span */
+};
+
+static int add_seq(struct seq_list *list, off_t seqNum, off_t start, int blockNum) {
+    if (list->have == list->size) {
+        int size = list->size ? list->size << 1 : 8;
+        struct seq_entry *next = realloc(list->seq_entry, sizeof(struct seq_entry) * size);
+        if (NULL == next)
+            return -1;
+        list->seq_entry = next;
+        list->size = size;
+    }
+    list->seq_entry[list->have].seq_num = seqNum;
+    list->seq_entry[list->have].start = start;
+    list->seq_entry[list->have].block = blockNum;
+    list->have++;
+    return 0;
+}
+
+static void cvt_index_free(struct cvt_index *index) {
+    for (uint64_t i = 0; i < index->have; i++) {
+        free(index->list[i].window);
+        free(index->list[i].dict);
+    }
+    free(index->list);
+    index->list = NULL;
+    index->have = 0;
+}
+
+/* get_be() and get_le() read an n byte big or little-endian integer */
+static int get_be(FILE *fp, int n, uint64_t *val) {
+    unsigned char buf[8];
+
+    if (fread(buf, 1, n, fp) != (size_t) n)
+        return -1;
+    *val = 0;
+    for (int i = 0; i < n; i++)
+        *val = *val << 8 | buf[i];
+    return 0;
+}
+
+static int get_le(FILE *fp, int n, uint64_t *val) {
+    unsigned char buf[8];
+
+    if (fread(buf, 1, n, fp) != (size_t) n)
+        return -1;
+    *val = 0;
+    for (int i = n - 1; i >= 0; i--)
+        *val = *val << 8 | buf[i];
+    return 0;
+}
+
+/* put_be() and put_le() write val as an n byte big or little-endian integer */
+static int put_be(FILE *fp, int n, uint64_t val) {
+    unsigned char buf[8];
+
+    for (int i = n - 1; i >= 0; i--, val >>= 8)
+        buf[i] = val & 0xff;
+    return fwrite(buf, 1, n, fp) == (size_t) n ? 0 : -1;
+}
+
+static int put_le(FILE *fp, int n, uint64_t val) {
+    unsigned char buf[8];
+
+    for (int i = 0; i < n; i++, val >>= 8)
+        buf[i] = val & 0xff;
+    return fwrite(buf, 1, n, fp) == (size_t) n ? 0 : -1;
+}
+
+/* read_gztool
+ * @brief: reads a gztool index
+ * @params:
+ * fp (FILE *): The gztool index, positioned after the 8 zero bytes
+ * index (struct cvt_index *): The access points read
+ * @returns: 0 on success, < 0 on failure
+ */
+static int read_gztool(FILE *fp, struct cvt_index *index) {
+    char magic[8];
+    uint64_t have, size, val;
+    unsigned char *packed = NULL;
+    int version;
+
+    if (fread(magic, 1, 8, fp) != 8)
+        return -1;
+    if (memcmp(magic, GZTOOL_MAGIC, 8) == 0)
+        version = 0;
+    else if (memcmp(magic, GZTOOL_MAGIC_V1, 8) == 0)
+        version = 1;
+    else
+        return -1;
+    if (version == 1 && get_be(fp, 4, &val) < 0)
+        return -1;
+
+    /* One of these is the point count and the other the allocated size,
+     * which is 0 while gztool is still building the index */
+    if (get_be(fp, 8, &have) < 0 || get_be(fp, 8, &size) < 0)
+        return -1;
+    if (have == 0 || (size != 0 && size < have))
+        have = size ? size : have;
+    if (have == 0 || have > (1ULL << 32))
+        return -1;
+
+    index->list = calloc(have, sizeof(struct cvt_point));
+    packed = malloc(compressBound(WINSIZE));
+    if (NULL == index->list || NULL == packed) {
+        free(packed);
+        return -1;
+    }
+    for (index->have = 0; index->have < have; index->have++) {
+        struct cvt_point *pt = index->list + index->have;
+        uint64_t bits, packed_len;
+        uLongf len = WINSIZE;
+
+        if (get_be(fp, 8, &pt->out) < 0 || get_be(fp, 8, &pt->in) < 0 ||
+            get_be(fp, 4, &bits) < 0 || get_be(fp, 4, &packed_len) < 0 ||
+            bits > 7 || packed_len > compressBound(WINSIZE))
+            goto read_gztool_error;
+        pt->bits = bits;
+        if (packed_len) {
+            pt->window = malloc(WINSIZE);
+            if (NULL == pt->window || fread(packed, 1, packed_len, fp) != packed_len ||
+                uncompress(pt->window, &len, packed, packed_len) != Z_OK)
+                goto read_gztool_error;
+            pt->window_len = len;
+        }
+        if (version == 1 && get_be(fp, 8, &val) < 0)
+            goto read_gztool_error;
+    }
+    free(packed);
+    return 0;
+
+    read_gztool_error:
+    index->have++;
+    free(packed);
+    return -1;
+}
+
+/* read_gzidx
+ * @brief: reads an indexed_gzip (or rapidgzip) index
+ * @params:
+ * fp (FILE *): The index, positioned after the magic
+ * index (struct cvt_index *): The access points read
+ * @returns: 0 on success, < 0 on failure
+ */
+static int read_gzidx(FILE *fp, struct cvt_index *index) {
+    uint64_t version, flags, val, window_size, npoints;
+
+    if (get_le(fp, 1, &version) < 0 || get_le(fp, 1, &flags) < 0 || version > 1 ||
+        get_le(fp, 8, &val) < 0 || get_le(fp, 8, &val) < 0 ||
+        get_le(fp, 4, &val) < 0 || get_le(fp, 4, &window_size) < 0 ||
+        get_le(fp, 4, &npoints) < 0 || window_size > WINSIZE || npoints == 0)
+        return -1;
+
+    index->list = calloc(npoints, sizeof(struct cvt_point));
+    if (NULL == index->list)
+        return -1;
+    index->have = npoints;
+    for (uint64_t i = 0; i < npoints; i++) {
+        struct cvt_point *pt = index->list + i;
+        uint64_t bits, data = i > 0;
+
+        if (get_le(fp, 8, &pt->in) < 0 || get_le(fp, 8, &pt->out) < 0 ||
+            get_le(fp, 1, &bits) < 0 || bits > 7 ||
+            (version >= 1 && get_le(fp, 1, &data) < 0))
+            return -1;
+        pt->bits = bits;
+        pt->window_len = data ? window_size : 0;
+    }
+
+    /* The windows follow the point table */
+    for (uint64_t i = 0; i < npoints; i++) {
+        struct cvt_point *pt = index->list + i;
+
+        if (pt->window_len == 0)
+            continue;
+        pt->window = malloc(pt->window_len);
+        if (NULL == pt->window || fread(pt->window, 1, pt->window_len, fp) != pt->window_len)
+            return -1;
+    }
+    return 0;
+}
+
+/* read_foreign
+ * @brief: reads a foreign index, working out which format it is in
+ * @params:
+ * path (string): The foreign index file
+ * index (struct cvt_index *): The access points read
+ * @returns: 0 on success, < 0 on failure
+ */
+static int read_foreign(char *path, struct cvt_index *index) {
+    unsigned char magic[8];
+    char msg[MSGSIZE];
+    int ret = -1;
+    FILE *fp;
+
+    memset(index, 0, sizeof(struct cvt_index));
+    fp = fopen(path, "rb");
+    if (NULL == fp) {
+        snprintf(msg, MSGSIZE, "Error opening %s for reading", path);
+        logger(LOG_ERROR, msg);
+        return -1;
+    }
+    if (fread(magic, 1, 5, fp) == 5 && memcmp(magic, GZIDX_MAGIC, 5) == 0) {
+        ret = read_gzidx(fp, index);
+    } else if (fread(magic + 5, 1, 3, fp) == 3 &&
+               memcmp(magic, "\0\0\0\0\0\0\0\0", 8) == 0) {
+        ret = read_gztool(fp, index);
+    } else {
+        snprintf(msg, MSGSIZE, "%s is neither a gztool nor an indexed_gzip index", path);
+        logger(LOG_ERROR, msg);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    if (ret < 0) {
+        snprintf(msg, MSGSIZE, "%s is truncated or corrupt", path);
+        logger(LOG_ERROR, msg);
+        cvt_index_free(index);
+        return -1;
+    }
+
+    for (uint64_t i = 1; i < index->have; i++) {
+        if (index->list[i].out <= index->list[i - 1].out ||
+            index->list[i].in <= index->list[i - 1].in) {
+            logger(LOG_ERROR, "The access points of the index are out of order");
+            cvt_index_free(index);
+            return -1;
+        }
+    }
+    if (index->list[0].out != 0) {
+        logger(LOG_ERROR, "The index has no access point at the start of the data");
+        cvt_index_free(index);
+        return -1;
+    }
+    return 0;
+}
+
+/* trace_window() works out which bytes of point n's window the deflate data
+ * after it refers back to, like index-builder does, and keeps only those */
+static int trace_window(struct scan_job *job, FILE *in, uint64_t n) {
+    struct cvt_point *pt = job->index->list + n;
+    unsigned char window[WINSIZE];
+    unsigned char used[WINSIZE];
+    unsigned char blob[WINSIZE];
+    unsigned char *buf;
+    size_t got;
+
+    if (pt->window_len == 0) {
+        pt->dict_flags = IDX_PT_NODICT;
+        return 0;
+    }
+    buf = malloc(TRACE_AHEAD);
+    if (NULL == buf)
+        return -1;
+    if (fseeko(in, pt->in - (pt->bits ? 1 : 0), SEEK_SET) != 0) {
+        free(buf);
+        return -1;
+    }
+    got = fread(buf, 1, TRACE_AHEAD, in);
+
+    /* The window ends at the point; anything before it is zeros */
+    memset(window, 0, WINSIZE - pt->window_len);
+    memcpy(window + WINSIZE - pt->window_len, pt->window, pt->window_len);
+    memset(used, 0, WINSIZE);
+    if (bi_trace_window(buf, got, pt->bits ? 8 - pt->bits : 0, used) == BI_OK) {
+        pt->dict_len = idx_sparse_window(window, used, blob, &pt->dict_flags);
+    } else {
+        memcpy(blob, window, WINSIZE);
+        pt->dict_len = WINSIZE;
+        pt->dict_flags = 0;
+    }
+    free(buf);
+    pt->dict = malloc(pt->dict_len ? pt->dict_len : 1);
+    if (NULL == pt->dict)
+        return -1;
+    memcpy(pt->dict, blob, pt->dict_len);
+    return 0;
+}
+
+/* scan_span() decompresses the data from access point n up to the next one,
+ * or to the end for the last point, and counts the newlines in it (pass 1)
+ * or makes the sequence index entries for it (pass 2)
+ * @returns: 0 on success, < 0 on failure
+ */
+static int scan_span(struct scan_job *job, FILE *in, uint64_t n) {
+    struct cvt_point *pt = job->index->list + n;
+    uint64_t limit = n + 1 < job->index->have ? job->index->list[n + 1].out : UINT64_MAX;
+    uint64_t out = pt->out, line = job->pass == 2 ? job->lines_before[n] : 0;
+    uint64_t pos = pt->in - (pt->bits ? 1 : 0);
+    unsigned char input[CHUNKSIZE];
+    unsigned char buf[WINSIZE];
+    int header = 0, ret;        /* header is 1 while skipping a gzip header */
+    struct ib_stream strm;
+
+    if (ib_init(&strm) != Z_OK)
+        return -1;
+    if (fseeko(in, pos, SEEK_SET) != 0)
+        goto scan_span_error;
+    if (pt->bits) {
+        ret = getc(in);
+        if (ret == EOF)
+            goto scan_span_error;
+        pos++;
+        (void) ib_prime(&strm, pt->bits, ret >> (8 - pt->bits));
+    }
+    if (pt->window_len)
+        (void) ib_set_dictionary(&strm, pt->window, pt->window_len);
+
+    while (out < limit) {
+        if (strm.avail_in == 0) {
+            size_t want = job->data_end - pos < CHUNKSIZE ? job->data_end - pos : CHUNKSIZE;
+            strm.avail_in = fread(input, 1, want, in);
+            if (ferror(in))
+                goto scan_span_error;
+            if (strm.avail_in == 0)
+                break;          /* the end of the data */
+            strm.next_in = input;
+            pos += strm.avail_in;
+        }
+        if (header) {
+            ret = ib_header(&strm);
+            if (ret < 0)
+                goto scan_span_error;
+            header = !ret;
+            continue;
+        }
+        strm.next_out = buf;
+        strm.avail_out = limit - out < WINSIZE ? limit - out : WINSIZE;
+        ret = ib_inflate(&strm);
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+            goto scan_span_error;
+
+        /* Count the lines of what came out, stopping only at the newlines
+         * that end a chunk of reads in pass 2 */
+        unsigned got = strm.next_out - buf;
+        if (job->pass == 1) {
+            line += ls_count(buf, got);
+        } else {
+            uint64_t every = 4 * (uint64_t) idx_chunk_size;
+            size_t i = 0;
+
+            while (i < got) {
+                uint64_t target = (line / every + 1) * every;
+                size_t want = target - line, left = want;
+                size_t at = ls_find(buf + i, got - i, &left);
+
+                if (at == got - i) {
+                    line += want - left;
+                    break;
+                }
+                line = target;
+                i += at + 1;
+
+                uint64_t start = out + i;
+                int block = start == limit ? n + 1 : n;
+                if (add_seq(job->entries + n, line / 4, start, block) < 0)
+                    goto scan_span_error;
+            }
+        }
+        out += got;
+
+        if (ret == Z_STREAM_END) {
+            if (!job->gzip)
+                break;
+
+            /* Another gzip member may follow: skip the trailer the raw
+             * deflate stream leaves behind, then the next header */
+            for (int skip = 8; skip; skip--) {
+                if (strm.avail_in == 0) {
+                    if (pos == job->data_end || (ret = getc(in)) == EOF)
+                        break;
+                    pos++;
+                } else {
+                    strm.next_in++;
+                    strm.avail_in--;
+                }
+            }
+            header = 1;
+        }
+    }
+
+    if (out < limit && limit != UINT64_MAX)
+        goto scan_span_error;   /* the data ended before the next point */
+    if (job->pass == 1) {
+        job->newlines[n] = line;
+        if (n + 1 == job->index->have)
+            job->length = out;
+    }
+    ib_end(&strm);
+    return 0;
+
+    scan_span_error:
+    ib_end(&strm);
+    return -1;
+}
+
+/* scan_task is a worker, scanning its share of the spans */
+void *scan_task(void *arg) {
+    struct scan_args *sa = arg;
+    struct scan_job *job = sa->job;
+    char msg[MSGSIZE];
+    FILE *in;
+
+    in = fopen(job->filename, "rb");
+    if (NULL == in) {
+        job->failed = 1;
+        return NULL;
+    }
+    for (uint64_t n = sa->first; n < sa->last && !job->failed; n++) {
+        if ((job->pass == 1 && trace_window(job, in, n) < 0) ||
+            scan_span(job, in, n) < 0) {
+            snprintf(msg, MSGSIZE, "Error decompressing from access point %lu; the index doesn't match the gzip file",
+                     n);
+            logger(LOG_ERROR, msg);
+            job->failed = 1;
+        }
+    }
+    fclose(in);
+    return NULL;
+}
+
+/* run_pass
+ * @brief: runs one pass of scan_span() over all spans with num_threads
+ * workers, each taking a contiguous share of them
+ * @returns: 0 on success, < 0 on failure
+ */
+static int run_pass(struct scan_job *job) {
+    struct thread_pool pool;
+    uint64_t have = job->index->have;
+    int nthreads = (uint64_t) num_threads < have ? num_threads : (int) have;
+    struct scan_args *args = calloc(nthreads, sizeof(struct scan_args));
+
+    if (NULL == args)
+        return -1;
+    for (int i = 0; i < nthreads; i++) {
+        args[i].job = job;
+        args[i].first = have * i / nthreads;
+        args[i].last = have * (i + 1) / nthreads;
+    }
+    if (tp_start(&pool, nthreads, scan_task, args, sizeof(struct scan_args)) < 0) {
+        logger(LOG_ERROR, "Couldn't start the threads");
+        job->failed = 1;
+    }
+    tp_join(&pool, NULL);
+    free(args);
+    return job->failed ? -1 : 0;
+}
+
+/* write_converted_index
+ * @brief: writes the imported access points as a .idx (see index-format.h)
+ * @params:
+ * fname (string): Output file name
+ * job (struct scan_job *): The scanned access points
+ * source (struct idx_source *): Fingerprint of the gzip file
+ * @returns: 0 on success, < 0 on failure
+ */
+static int write_converted_index(char *fname, struct scan_job *job,
+                                 struct idx_source *source) {
+    struct cvt_index *index = job->index;
+    struct idx_header hdr = {0};
+    struct idx_point *table;
+    char fullname[256];
+    char msg[MSGSIZE * 2];
+    z_stream strm;
+    FILE *fp;
+
+    table = calloc(index->have, sizeof(struct idx_point));
+    if (NULL == table)
+        return -1;
+    snprintf(fullname, sizeof(fullname), "%s.idx", fname);
+    fp = fopen(fullname, "wb");
+    if (NULL == fp) {
+        logger(LOG_CRITICAL, "Failed to open output file for writing");
+        free(table);
+        return -1;
+    }
+
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(table);
+        fclose(fp);
+        return -1;
+    }
+    if (idx_write_begin(fp) < 0)
+        goto write_converted_index_error;
+    for (uint64_t i = 0; i < index->have; i++) {
+        struct cvt_point *pt = index->list + i;
+        table[i].out = pt->out;
+        table[i].in = pt->in;
+        table[i].bits = pt->bits;
+        table[i].lines = job->lines_before[i];
+        table[i].flags = pt->dict_flags;
+        if (idx_write_window(fp, &table[i], &strm, pt->dict, pt->dict_len) < 0)
+            goto write_converted_index_error;
+    }
+    hdr.flags = job->gzip ? IDX_FLAG_GZIP : 0;
+    hdr.sequence_skip = idx_chunk_size;
+    hdr.length = job->length;
+    hdr.created = time(NULL);
+    hdr.source = *source;
+    if (idx_write_end(fp, &hdr, table, index->have) < 0)
+        goto write_converted_index_error;
+    (void) deflateEnd(&strm);
+    free(table);
+    if (fclose(fp) != 0)
+        return -1;
+    snprintf(msg, MSGSIZE * 2, "Wrote %lu entries to gzip index file %s", index->have, fullname);
+    logger(LOG_INFO, msg);
+    return 0;
+
+    write_converted_index_error:
+    logger(LOG_CRITICAL, "Failed writing the gzip index file");
+    (void) deflateEnd(&strm);
+    free(table);
+    fclose(fp);
+    return -1;
+}
+
+/* write_converted_seqs
+ * @brief: writes the sequence index found by the second pass, in the same
+ * format as index-builder
+ * @returns: 0 on success, < 0 on failure
+ */
+static int write_converted_seqs(char *fname, char *infile, struct scan_job *job,
+                                struct idx_source *source) {
+    char fullname[256];
+    char msg[MSGSIZE * 2];
+    uint64_t total = 1;
+    FILE *fp;
+
+    snprintf(fullname, sizeof(fullname), "%s.seq-idx", fname);
+    fp = fopen(fullname, "w");
+    if (NULL == fp) {
+        logger(LOG_CRITICAL, "Failed to open output file for writing");
+        return -1;
+    }
+    fprintf(fp, "#time: %ld\n#input: %s\n#source: %lu,%ld,%08x,%08x\n"
+            "#sequence_skip: %d\n#seq_num,block_num,out_offset\n",
+            (long) time(NULL), infile, source->size, (long) source->mtime,
+            source->head_crc, source->tail_crc, idx_chunk_size);
+    fprintf(fp, "0,0,0\n");
+    for (uint64_t n = 0; n < job->index->have; n++) {
+        for (int i = 0; i < job->entries[n].have; i++) {
+            struct seq_entry *this = job->entries[n].seq_entry + i;
+
+            /* A read boundary at the very end doesn't start another chunk */
+            if ((uint64_t) this->start == job->length)
+                continue;
+            fprintf(fp, "%lu,%d,%lu\n", this->seq_num, this->block, this->start);
+            total++;
+        }
+    }
+    if (fclose(fp) != 0) {
+        logger(LOG_CRITICAL, "Failed writing the sequence index file");
+        return -1;
+    }
+    snprintf(msg, MSGSIZE * 2, "Wrote %lu entries to sequence index file %s", total, fullname);
+    logger(LOG_INFO, msg);
+    return 0;
+}
+
+/* import_index
+ * @brief: converts a foreign index of filename to a .idx and a .seq-idx
+ * @params:
+ * foreign (string): The foreign index file
+ * filename (string): The gzip file it indexes
+ * @returns: 0 on success, < 0 on failure
+ */
+static int import_index(char *foreign, char *filename) {
+    struct cvt_index index;
+    struct scan_job job = {0};
+    struct idx_source source;
+    unsigned char magic[2] = {0};
+    char msg[MSGSIZE];
+    int ret = -1;
+    FILE *in;
+
+    if (read_foreign(foreign, &index) < 0)
+        return -1;
+    snprintf(msg, MSGSIZE, "Read %lu access points from %s", index.have, foreign);
+    logger(LOG_INFO, msg);
+
+    in = fopen(filename, "rb");
+    if (NULL == in || fread(magic, 1, 2, in) != 2) {
+        logger(LOG_ERROR, "Error reading the gzip file");
+        if (in != NULL)
+            fclose(in);
+        cvt_index_free(&index);
+        return -1;
+    }
+    fclose(in);
+    if (idx_fingerprint(filename, &source, msg, MSGSIZE) < 0 ||
+        emb_data_end(filename, &job.data_end, msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
+        cvt_index_free(&index);
+        return -1;
+    }
+
+    job.filename = filename;
+    job.gzip = magic[0] == 0x1f && magic[1] == 0x8b;
+    job.index = &index;
+    job.newlines = calloc(index.have, sizeof(uint64_t));
+    job.lines_before = calloc(index.have, sizeof(uint64_t));
+    job.entries = calloc(index.have, sizeof(struct seq_list));
+    if (NULL == job.newlines || NULL == job.lines_before || NULL == job.entries)
+        goto import_index_ret;
+
+    /* Pass 1: count the newlines between access points, in parallel */
+    job.pass = 1;
+    if (run_pass(&job) < 0)
+        goto import_index_ret;
+
+    /* Now every span knows which line it starts in, so pass 2 can number the
+     * reads in all of them at once */
+    for (uint64_t n = 1; n < index.have; n++)
+        job.lines_before[n] = job.lines_before[n - 1] + job.newlines[n - 1];
+    job.pass = 2;
+    if (run_pass(&job) < 0)
+        goto import_index_ret;
+
+    if (write_converted_index(output_file, &job, &source) < 0 ||
+        write_converted_seqs(output_file, filename, &job, &source) < 0)
+        goto import_index_ret;
+    ret = 0;
+
+    import_index_ret:
+    if (job.entries != NULL)
+        for (uint64_t n = 0; n < index.have; n++)
+            free(job.entries[n].seq_entry);
+    free(job.entries);
+    free(job.newlines);
+    free(job.lines_before);
+    cvt_index_free(&index);
+    return ret;
+}
+
+/* export_index
+ * @brief: converts a .idx to a gztool or indexed_gzip index
+ * @params:
+ * path (string): The .idx
+ * filename (string): The gzip file it indexes
+ * format (enum cvt_format): The format to write
+ * @returns: 0 on success, < 0 on failure
+ */
+static int export_index(char *path, char *filename, enum cvt_format format) {
+    struct idx_file index;
+    struct idx_source have;
+    unsigned char window[WINSIZE];
+    unsigned char *packed = NULL;
+    char msg[MSGSIZE];
+    uint64_t spacing = 0;
+    FILE *fp = NULL;
+    int ret;
+
+    if (idx_open(&index, path, msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
+        return -1;
+    }
+    ret = idx_check_source(&index.hdr->source, filename, msg, MSGSIZE);
+    if (ret < 0 || idx_fingerprint(filename, &have, msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
+        idx_close(&index);
+        return -1;
+    }
+    if (ret > 0)
+        logger(LOG_WARNING, msg);
+
+    fp = fopen(output_file, "wb");
+    packed = malloc(compressBound(WINSIZE));
+    if (NULL == fp || NULL == packed) {
+        logger(LOG_CRITICAL, "Failed to open output file for writing");
+        goto export_index_error;
+    }
+    for (uint64_t i = 1; i < index.have; i++)
+        if (index.points[i].out - index.points[i - 1].out > spacing)
+            spacing = index.points[i].out - index.points[i - 1].out;
+
+    if (format == FMT_GZTOOL) {
+        if (put_be(fp, 8, 0) < 0 || fwrite(GZTOOL_MAGIC, 1, 8, fp) != 8 ||
+            put_be(fp, 8, index.have) < 0 || put_be(fp, 8, index.have) < 0)
+            goto export_index_error;
+    } else {
+        if (fwrite(GZIDX_MAGIC, 1, 5, fp) != 5 || put_le(fp, 1, 1) < 0 ||
+            put_le(fp, 1, 0) < 0 || put_le(fp, 8, have.size) < 0 ||
+            put_le(fp, 8, index.hdr->length) < 0 || put_le(fp, 4, spacing) < 0 ||
+            put_le(fp, 4, WINSIZE) < 0 || put_le(fp, 4, index.have) < 0)
+            goto export_index_error;
+        for (uint64_t i = 0; i < index.have; i++) {
+            const struct idx_point *pt = index.points + i;
+            if (put_le(fp, 8, pt->in) < 0 || put_le(fp, 8, pt->out) < 0 ||
+                put_le(fp, 1, pt->bits) < 0 || put_le(fp, 1, pt->out != 0) < 0)
+                goto export_index_error;
+        }
+    }
+
+    /* Both formats want whole windows. A sparse window is rebuilt with zeros
+     * where nothing refers back, which decompresses the same */
+    for (uint64_t i = 0; i < index.have; i++) {
+        const struct idx_point *pt = index.points + i;
+        int len = idx_load_window(&index, pt, window);
+
+        if (len < 0) {
+            logger(LOG_ERROR, "Corrupt window in the gzip index");
+            goto export_index_error;
+        }
+        memmove(window + WINSIZE - len, window, len);
+        memset(window, 0, WINSIZE - len);
+
+        if (format == FMT_GZTOOL) {
+            uLongf packed_len = compressBound(WINSIZE);
+            if (pt->out && compress2(packed, &packed_len, window, WINSIZE,
+                                     Z_BEST_COMPRESSION) != Z_OK)
+                goto export_index_error;
+            if (pt->out == 0)
+                packed_len = 0;
+            if (put_be(fp, 8, pt->out) < 0 || put_be(fp, 8, pt->in) < 0 ||
+                put_be(fp, 4, pt->bits) < 0 || put_be(fp, 4, packed_len) < 0 ||
+                fwrite(packed, 1, packed_len, fp) != packed_len)
+                goto export_index_error;
+        } else if (pt->out && fwrite(window, 1, WINSIZE, fp) != WINSIZE) {
+            goto export_index_error;
+        }
+    }
+
+    /* gztool ends a complete index with the uncompressed size */
+    if (format == FMT_GZTOOL && put_be(fp, 8, index.hdr->length) < 0)
+        goto export_index_error;
+    snprintf(msg, MSGSIZE, "Wrote %lu access points to %s", index.have, output_file);
+    free(packed);
+    idx_close(&index);
+    if (fclose(fp) != 0) {
+        logger(LOG_CRITICAL, "Failed writing the exported index");
+        return -1;
+    }
+    logger(LOG_INFO, msg);
+    return 0;
+
+    export_index_error:
+    logger(LOG_CRITICAL, "Failed writing the exported index");
+    free(packed);
+    idx_close(&index);
+    if (fp != NULL)
+        fclose(fp);
+    return -1;
+}
+
+/* parse_format() maps a format name to its enum cvt_format, or -1 */
+static int parse_format(char *name) {
+    if (strcmp(name, "gztool") == 0)
+        return FMT_GZTOOL;
+    if (strcmp(name, "indexed_gzip") == 0 || strcmp(name, "rapidgzip") == 0 ||
+        strcmp(name, "gzidx") == 0)
+        return FMT_GZIDX;
+    return -1;
+}
+
+//Prints the usage information on error
+void print_usage(char *argv[]) {
+    fprintf(stderr, "Usage: %s [-c CHUNKSIZE] [-n N_THREADS] [-o OUTFILE] FOREIGN_INDEX GZIP_FILE\n", argv[0]);
+    fprintf(stderr, "       %s -x FORMAT [-o OUTFILE] GZIP-INDEX.IDX GZIP_FILE\n", argv[0]);
+}
+
+void print_help(char *argv[]) {
+    fprintf(stderr, "index-convert imports the access points of other gzip random access ");
+    fprintf(stderr, "tools' indexes, and exports them\n\n");
+    print_usage(argv);
+    fprintf(stderr, "-c CHUNKSIZE\tthe integer chunk size of the sequence index to ");
+    fprintf(stderr, "make (default 10000)\n");
+    fprintf(stderr, "-n N_THREADS\tthe number of threads to scan the file with (default one per CPU)\n");
+    fprintf(stderr, "-o OUTFILE\tthe prefix of the index files to write, or the ");
+    fprintf(stderr, "exported index (default 'output')\n");
+    fprintf(stderr, "-x FORMAT\texport GZIP-INDEX.IDX as FORMAT instead of importing\n");
+    fprintf(stderr, "-v\t\tenable verbose logging\n");
+    fprintf(stderr, "FOREIGN_INDEX\ta gztool (.gzi) or indexed_gzip/rapidgzip (.gzidx) ");
+    fprintf(stderr, "index, recognized by its contents\n");
+    fprintf(stderr, "FORMAT\t\tgztool, or indexed_gzip (also read by rapidgzip)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt, format = -1;
+
+    while ((opt = getopt(argc, argv, "c:hn:o:vx:")) != -1) {
+        switch (opt) {
+            case 'c': //chunk size
+                idx_chunk_size = atoi(optarg);
+                break;
+            case 'n':
+                num_threads = atoi(optarg);
+                break;
+            case 'o': //output filename
+                output_file = optarg;
+                break;
+            case 'v':
+                GLOBAL_LEVEL = LOG_DEBUG;
+                logger(LOG_DEBUG, "Debug logging enabled");
+                break;
+            case 'x': //export format
+                format = parse_format(optarg);
+                if (format < 0) {
+                    print_help(argv);
+                    return 1;
+                }
+                break;
+            case 'h':
+                print_help(argv);
+                return 0;
+            default:
+                print_usage(argv);
+                return 1;
+        }
+    }
+    if (argc - optind != 2 || idx_chunk_size < 1) {
+        print_usage(argv);
+        return 1;
+    }
+    if (num_threads < 1)
+        num_threads = tp_cpus();
+    if (ib_use(getenv("INFLATE_ENGINE")) < 0) {
+        char msg[MSGSIZE];
+        snprintf(msg, MSGSIZE, "Inflate engine %s isn't built in", getenv("INFLATE_ENGINE"));
+        logger(LOG_ERROR, msg);
+        return 1;
+    }
+
+    time_t start_time = time(NULL);
+    if (format >= 0) {
+        if (export_index(argv[optind], argv[optind + 1], format) < 0)
+            return 1;
+    } else if (import_index(argv[optind], argv[optind + 1]) < 0) {
+        return 1;
+    }
+
+    char msg[MSGSIZE];
+    snprintf(msg, MSGSIZE, "Time elapsed converting the index: %f seconds",
+             difftime(time(NULL), start_time));
+    logger(LOG_INFO, msg);
+    return 0;
+}
@@ -0,0 +1,832 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "index-format.h"
+
+_Static_assert(sizeof(struct idx_header) == 104, "idx_header must stay packed");
+_Static_assert(sizeof(struct idx_point) == 40, "idx_point must stay packed");
+_Static_assert(sizeof(struct ridx_header) == 80, "ridx_header must stay packed");
+_Static_assert(sizeof(struct ef_block) == 32, "ef_block must stay packed");
+_Static_assert(sizeof(struct emb_footer) == 48, "emb_footer must stay packed");
+
+/* map_file() maps all of path read-only. Returns 0 on success, < 0 on failure
+ * with msg filled in */
+static int map_file(const char *path, size_t min, const unsigned char **base,
+                    size_t *size, char *msg, size_t msglen) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(msg, msglen, "Error opening index file %s", path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < min) {
+        snprintf(msg, msglen, "Index file %s is too short to be an index", path);
+        close(fd);
+        return -1;
+    }
+
+    /* Map the whole file read-only and shared, so that concurrent readers of
+     * the same index all use one page cache copy */
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        snprintf(msg, msglen, "Error mapping index file %s", path);
+        return -1;
+    }
+
+    /* Everything is touched in no particular order by the worker threads */
+    (void) madvise(map, st.st_size, MADV_RANDOM);
+    *base = map;
+    *size = st.st_size;
+    return 0;
+}
+
+int idx_input_open(struct idx_input *in, const char *path, char *msg, size_t msglen) {
+    struct stat st;
+    void *map = NULL;
+    int fd;
+
+    memset(in, 0, sizeof(struct idx_input));
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        snprintf(msg, msglen, "Error opening %s for reading", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            snprintf(msg, msglen, "Error mapping %s", path);
+            close(fd);
+            return -1;
+        }
+
+        /* Each thread reads through its own part of the file */
+        (void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    in->data = map;
+    in->size = st.st_size;
+    return 0;
+}
+
+void idx_input_advise(const struct idx_input *in, uint64_t start, uint64_t end) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t from = ((uintptr_t) in->data + start) & ~(page - 1);
+
+    if (end > in->size)
+        end = in->size;
+    if (start < end)
+        (void) madvise((void *) from, (uintptr_t) in->data + end - from, MADV_WILLNEED);
+}
+
+void idx_input_close(struct idx_input *in) {
+    if (in->data != NULL)
+        munmap((void *) in->data, in->size);
+    memset(in, 0, sizeof(struct idx_input));
+}
+
+/* idx_check() validates the header of the index at idx->base and sets up
+ * the rest of idx. Returns 0 on success, < 0 on failure with msg filled in */
+static int idx_check(struct idx_file *idx, const char *path, char *msg,
+                     size_t msglen) {
+    if (idx->size < sizeof(struct idx_header)) {
+        snprintf(msg, msglen, "Index file %s is too short to be an index", path);
+        return -1;
+    }
+    idx->hdr = (const struct idx_header *) idx->base;
+
+    if (memcmp(idx->hdr->magic, IDX_MAGIC, sizeof(idx->hdr->magic)) != 0) {
+        snprintf(msg, msglen, "%s is not a binary gzip index (rebuild it with index-builder)", path);
+        return -1;
+    }
+    if (idx->hdr->byte_order != IDX_BYTE_ORDER) {
+        snprintf(msg, msglen, "%s was written on a host with a different byte order", path);
+        return -1;
+    }
+    if (idx->hdr->version != IDX_VERSION) {
+        snprintf(msg, msglen, "%s has index version %u, expected %u", path,
+                 idx->hdr->version, IDX_VERSION);
+        return -1;
+    }
+    if (idx->hdr->table_off > idx->size ||
+        idx->hdr->npoints > (idx->size - idx->hdr->table_off) / sizeof(struct idx_point)) {
+        snprintf(msg, msglen, "%s is truncated", path);
+        return -1;
+    }
+
+    /* Nothing past the header is looked at here: the table and windows are
+     * only paged in and checked by the worker that uses a point */
+    idx->points = (const struct idx_point *) (idx->base + idx->hdr->table_off);
+    idx->have = idx->hdr->npoints;
+    return 0;
+}
+
+int idx_open(struct idx_file *idx, const char *path, char *msg, size_t msglen) {
+    memset(idx, 0, sizeof(struct idx_file));
+
+    if (map_file(path, sizeof(struct idx_header), &idx->base, &idx->size,
+                 msg, msglen) < 0)
+        return -1;
+    if (idx_check(idx, path, msg, msglen) < 0) {
+        munmap((void *) idx->base, idx->size);
+        memset(idx, 0, sizeof(struct idx_file));
+        return -1;
+    }
+    return 0;
+}
+
+int idx_open_mem(struct idx_file *idx, unsigned char *base, size_t size,
+                 const char *name, char *msg, size_t msglen) {
+    memset(idx, 0, sizeof(struct idx_file));
+    idx->base = base;
+    idx->size = size;
+    if (base == NULL || idx_check(idx, name, msg, msglen) < 0) {
+        if (base == NULL)
+            snprintf(msg, msglen, "%s has no gzip index", name);
+        memset(idx, 0, sizeof(struct idx_file));
+        return -1;
+    }
+    idx->heap = 1;
+    return 0;
+}
+
+void idx_close(struct idx_file *idx) {
+    if (idx != NULL && idx->base != NULL) {
+        if (idx->heap)
+            free((void *) idx->base);
+        else
+            munmap((void *) idx->base, idx->size);
+        memset(idx, 0, sizeof(struct idx_file));
+    }
+}
+
+/* emb_member() writes one empty gzip member carrying len (<= EMB_CHUNK)
+ * bytes of data in its extra field */
+static int emb_member(FILE *fp, const unsigned char *data, uint16_t len) {
+    unsigned char head[16] = {
+        0x1f, 0x8b, 8, 4,       /* gzip, deflate, FEXTRA */
+        0, 0, 0, 0, 0, 255,     /* no mtime, no xfl, unknown OS */
+    };
+    /* an empty fixed Huffman block, then a zero CRC-32 and ISIZE */
+    static const unsigned char tail[10] = {3, 0};
+    uint16_t xlen = len + 4;
+
+    head[10] = xlen & 0xff;
+    head[11] = xlen >> 8;
+    head[12] = EMB_SI1;
+    head[13] = EMB_SI2;
+    head[14] = len & 0xff;
+    head[15] = len >> 8;
+    if (fwrite(head, 1, sizeof(head), fp) != sizeof(head) ||
+        fwrite(data, 1, len, fp) != len ||
+        fwrite(tail, 1, sizeof(tail), fp) != sizeof(tail))
+        return -1;
+    return 0;
+}
+
+/* emb_parse() checks that the member at p (avail bytes) is one written by
+ * emb_member() and points data at its payload. Returns the size of the
+ * member, or 0 if it isn't one */
+static size_t emb_parse(const unsigned char *p, size_t avail,
+                        const unsigned char **data, uint16_t *len) {
+    static const unsigned char tail[10] = {3, 0};
+    size_t size;
+
+    if (avail < EMB_FRAMING || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 ||
+        p[3] != 4 || p[12] != EMB_SI1 || p[13] != EMB_SI2)
+        return 0;
+    *len = p[14] | p[15] << 8;
+    size = EMB_FRAMING + *len;
+    if ((p[10] | p[11] << 8) != *len + 4 || size > avail ||
+        memcmp(p + 16 + *len, tail, sizeof(tail)) != 0)
+        return 0;
+    *data = p + 16;
+    return size;
+}
+
+/* emb_get_footer() reads the footer of an embedded index from the end of fd,
+ * fsize bytes long. Returns 0 if there is one, 1 if there isn't */
+static int emb_get_footer(int fd, uint64_t fsize, struct emb_footer *ft) {
+    unsigned char member[EMB_MEMBER_SIZE];
+    const unsigned char *data;
+    uint16_t len;
+
+    if (fsize < EMB_MEMBER_SIZE ||
+        pread(fd, member, EMB_MEMBER_SIZE, fsize - EMB_MEMBER_SIZE) != EMB_MEMBER_SIZE ||
+        emb_parse(member, EMB_MEMBER_SIZE, &data, &len) != EMB_MEMBER_SIZE)
+        return 1;
+    memcpy(ft, data, sizeof(struct emb_footer));
+    if (memcmp(ft->magic, EMB_MAGIC, sizeof(ft->magic)) != 0 ||
+        ft->version != EMB_VERSION || ft->byte_order != IDX_BYTE_ORDER ||
+        ft->data_end > fsize - EMB_MEMBER_SIZE)
+        return 1;
+    return 0;
+}
+
+int emb_data_end(const char *path, uint64_t *end, char *msg, size_t msglen) {
+    struct emb_footer ft;
+    struct stat st;
+    int fd, ret;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        snprintf(msg, msglen, "Error opening %s", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    ret = emb_get_footer(fd, st.st_size, &ft);
+    close(fd);
+    *end = ret == 0 ? ft.data_end : (uint64_t) st.st_size;
+    return ret == 0;
+}
+
+int emb_read(const char *path, unsigned char *sect[EMB_NSECT],
+             uint64_t len[EMB_NSECT], char *msg, size_t msglen) {
+    struct emb_footer ft;
+    struct stat st;
+    unsigned char *buf = NULL;
+    uint64_t size, total = 0, pos;
+    int fd, i;
+
+    memset(sect, 0, EMB_NSECT * sizeof(unsigned char *));
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        snprintf(msg, msglen, "Error opening %s", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (emb_get_footer(fd, st.st_size, &ft) != 0) {
+        snprintf(msg, msglen, "%s has no embedded index", path);
+        close(fd);
+        return 1;
+    }
+
+    /* Read all the members between the data and the footer in one go */
+    size = st.st_size - EMB_MEMBER_SIZE - ft.data_end;
+    for (i = 0; i < EMB_NSECT; i++)
+        total += ft.len[i];
+    if (total > size)
+        goto emb_read_corrupt;
+    buf = malloc(size ? size : 1);
+    if (NULL == buf || (size && pread(fd, buf, size, ft.data_end) != (ssize_t) size)) {
+        snprintf(msg, msglen, "Error reading the embedded index of %s", path);
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    /* Copy the payloads out to the sections they belong to; members don't
+     * straddle sections */
+    pos = 0;
+    for (i = 0; i < EMB_NSECT; i++) {
+        uint64_t have = 0;
+
+        len[i] = ft.len[i];
+        if (len[i] == 0)
+            continue;
+        sect[i] = malloc(len[i]);
+        if (NULL == sect[i])
+            goto emb_read_corrupt;
+        while (have < len[i]) {
+            const unsigned char *data;
+            uint16_t n;
+            size_t member = emb_parse(buf + pos, size - pos, &data, &n);
+
+            if (member == 0 || n > len[i] - have)
+                goto emb_read_corrupt;
+            memcpy(sect[i] + have, data, n);
+            have += n;
+            pos += member;
+        }
+    }
+    if (pos != size)
+        goto emb_read_corrupt;
+    free(buf);
+    return 0;
+
+    emb_read_corrupt:
+    snprintf(msg, msglen, "The embedded index of %s is corrupt", path);
+    free(buf);
+    for (i = 0; i < EMB_NSECT; i++) {
+        free(sect[i]);
+        sect[i] = NULL;
+    }
+    return -1;
+}
+
+int emb_write(FILE *fp, unsigned char *const sect[EMB_NSECT],
+              const uint64_t len[EMB_NSECT], uint64_t data_end) {
+    struct emb_footer ft = {0};
+
+    for (int i = 0; i < EMB_NSECT; i++) {
+        for (uint64_t pos = 0; pos < len[i]; pos += EMB_CHUNK) {
+            uint64_t n = len[i] - pos < EMB_CHUNK ? len[i] - pos : EMB_CHUNK;
+            if (emb_member(fp, sect[i] + pos, n) < 0)
+                return -1;
+        }
+        ft.len[i] = len[i];
+    }
+    memcpy(ft.magic, EMB_MAGIC, sizeof(ft.magic));
+    ft.version = EMB_VERSION;
+    ft.byte_order = IDX_BYTE_ORDER;
+    ft.data_end = data_end;
+    if (emb_member(fp, (unsigned char *) &ft, sizeof(ft)) < 0)
+        return -1;
+    return 0;
+}
+
+/* le32() reads a little-endian 32-bit integer, as gzip stores them */
+static uint32_t le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* crc_range() is the CRC-32 of len bytes of fd starting at off */
+static int crc_range(int fd, off_t off, size_t len, uint32_t *crc) {
+    unsigned char buf[65536];
+    uLong c = crc32(0L, Z_NULL, 0);
+
+    while (len) {
+        ssize_t got = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+        if (got <= 0)
+            return -1;
+        c = crc32(c, buf, (uInt) got);
+        off += got;
+        len -= got;
+    }
+    *crc = (uint32_t) c;
+    return 0;
+}
+
+int idx_fingerprint(const char *path, struct idx_source *src, char *msg,
+                    size_t msglen) {
+    unsigned char trailer[8];
+    struct stat st;
+    size_t span;
+    int fd;
+
+    memset(src, 0, sizeof(struct idx_source));
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        snprintf(msg, msglen, "Error opening %s", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    /* An embedded index isn't part of the data it describes */
+    struct emb_footer ft;
+    src->size = emb_get_footer(fd, st.st_size, &ft) == 0 ? ft.data_end : (uint64_t) st.st_size;
+    src->mtime = st.st_mtime;
+    span = src->size < IDX_FP_SPAN ? src->size : IDX_FP_SPAN;
+    if (crc_range(fd, 0, span, &src->head_crc) < 0 ||
+        crc_range(fd, src->size - span, span, &src->tail_crc) < 0 ||
+        (src->size >= sizeof(trailer) &&
+         pread(fd, trailer, sizeof(trailer), src->size - sizeof(trailer)) != sizeof(trailer))) {
+        snprintf(msg, msglen, "Error reading %s", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if (src->size >= sizeof(trailer)) {
+        src->trailer_crc = le32(trailer);
+        src->trailer_isize = le32(trailer + 4);
+    }
+    return 0;
+}
+
+int idx_check_source(const struct idx_source *want, const char *path,
+                     char *msg, size_t msglen) {
+    struct idx_source have;
+
+    if (idx_fingerprint(path, &have, msg, msglen) < 0)
+        return -1;
+    if (have.size != want->size) {
+        snprintf(msg, msglen, "%s is %lu bytes but the index is of a %lu byte file; rebuild the index",
+                 path, have.size, want->size);
+        return -1;
+    }
+    if (have.head_crc != want->head_crc || have.tail_crc != want->tail_crc ||
+        have.trailer_crc != want->trailer_crc || have.trailer_isize != want->trailer_isize) {
+        snprintf(msg, msglen, "%s has changed since the index was built; rebuild the index", path);
+        return -1;
+    }
+    if (want->mtime != 0 && have.mtime != want->mtime) {
+        snprintf(msg, msglen, "%s has a different mtime than when the index was built, but its fingerprint matches",
+                 path);
+        return 1;
+    }
+    return 0;
+}
+
+int idx_check_prefix(const struct idx_source *want, const char *path,
+                     char *msg, size_t msglen) {
+    unsigned char trailer[8];
+    uint32_t head_crc, tail_crc;
+    struct stat st;
+    size_t span;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        snprintf(msg, msglen, "Error opening %s", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if ((uint64_t) st.st_size < want->size) {
+        snprintf(msg, msglen, "%s is shorter than when it was indexed", path);
+        close(fd);
+        return -1;
+    }
+    span = want->size < IDX_FP_SPAN ? want->size : IDX_FP_SPAN;
+    if (crc_range(fd, 0, span, &head_crc) < 0 ||
+        crc_range(fd, want->size - span, span, &tail_crc) < 0 ||
+        (want->size >= sizeof(trailer) &&
+         pread(fd, trailer, sizeof(trailer), want->size - sizeof(trailer)) != sizeof(trailer))) {
+        snprintf(msg, msglen, "Error reading %s", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if (head_crc != want->head_crc || tail_crc != want->tail_crc ||
+        (want->size >= sizeof(trailer) &&
+         (want->trailer_crc != le32(trailer) || want->trailer_isize != le32(trailer + 4)))) {
+        snprintf(msg, msglen, "The data of %s that was indexed has changed; rebuild the index", path);
+        return -1;
+    }
+    return 0;
+}
+
+const struct idx_point *idx_get_point(const struct idx_file *idx, uint64_t n) {
+    if (n >= idx->have)
+        return NULL;
+    return idx->points + n;
+}
+
+int64_t idx_find_point(const struct idx_file *idx, uint64_t out) {
+    uint64_t lo = 0, hi = idx->have;
+
+    /* points are in increasing order of out; find the last one <= out */
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (idx->points[mid].out <= out)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (int64_t) lo - 1;
+}
+
+const unsigned char *idx_window(const struct idx_file *idx,
+                                const struct idx_point *point) {
+    return idx->base + point->window_off;
+}
+
+int idx_load_window(const struct idx_file *idx, const struct idx_point *point,
+                    unsigned char *window) {
+    unsigned char packed[IDX_WINSIZE];
+    const unsigned char *stored = idx_window(idx, point);
+    uint32_t len = point->window_len;
+    z_stream strm;
+    int ret;
+
+    if (point->flags & IDX_PT_NODICT)
+        return 0;
+    if (point->window_off > idx->size || len > idx->size - point->window_off)
+        return -1;
+
+    if (point->flags & IDX_PT_DEFLATE) {
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        strm.avail_in = 0;
+        strm.next_in = Z_NULL;
+        if (inflateInit2(&strm, -15) != Z_OK)
+            return -1;
+        strm.next_in = (unsigned char *) stored;
+        strm.avail_in = len;
+        strm.next_out = packed;
+        strm.avail_out = IDX_WINSIZE;
+        ret = inflate(&strm, Z_FINISH);
+        (void) inflateEnd(&strm);
+        if (ret != Z_STREAM_END)
+            return -1;
+        stored = packed;
+        len = IDX_WINSIZE - strm.avail_out;
+    }
+
+    if (!(point->flags & IDX_PT_SPARSE)) {
+        if (len > IDX_WINSIZE)
+            return -1;
+        memcpy(window, stored, len);
+        return len;
+    }
+
+    /* Put the ranges that are used back where they were in the window */
+    uint16_t nranges, start, n;
+    uint32_t data;
+
+    if (len < sizeof(nranges))
+        return -1;
+    memcpy(&nranges, stored, sizeof(nranges));
+    data = sizeof(nranges) + (uint32_t) nranges * 2 * sizeof(uint16_t);
+    if (data > len)
+        return -1;
+    memset(window, 0, IDX_WINSIZE);
+    for (uint32_t i = 0; i < nranges; i++) {
+        memcpy(&start, stored + sizeof(nranges) + i * 4, sizeof(start));
+        memcpy(&n, stored + sizeof(nranges) + i * 4 + 2, sizeof(n));
+        if ((uint32_t) start + n > IDX_WINSIZE || data + n > len)
+            return -1;
+        memcpy(window + start, stored + data, n);
+        data += n;
+    }
+    return IDX_WINSIZE;
+}
+
+/* next_range() finds the next run of used bytes at or after pos, running
+ * over unused gaps shorter than IDX_SPARSE_GAP, which cost less to keep than
+ * another range entry. Returns 0 if there are no more used bytes */
+static int next_range(const unsigned char *used, uint32_t pos,
+                      uint32_t *start, uint32_t *end) {
+    uint32_t gap;
+
+    while (pos < IDX_WINSIZE && !used[pos])
+        pos++;
+    if (pos == IDX_WINSIZE)
+        return 0;
+    *start = pos;
+    for (;;) {
+        while (pos < IDX_WINSIZE && used[pos])
+            pos++;
+        gap = pos;
+        while (gap < IDX_WINSIZE && !used[gap] && gap - pos < IDX_SPARSE_GAP)
+            gap++;
+        if (gap == IDX_WINSIZE || !used[gap])
+            break;
+        pos = gap;
+    }
+    *end = pos;
+    return 1;
+}
+
+uint32_t idx_sparse_window(const unsigned char *window,
+                           const unsigned char *used, unsigned char *blob,
+                           uint8_t *flags) {
+    uint16_t nranges = 0;
+    uint32_t total = 0, start, end, data, i;
+
+    for (end = 0; next_range(used, end, &start, &end); ) {
+        nranges++;
+        total += end - start;
+    }
+
+    if (nranges == 0) {
+        *flags = IDX_PT_NODICT;
+        return 0;
+    }
+    data = sizeof(nranges) + (uint32_t) nranges * 2 * sizeof(uint16_t);
+    if (data + total >= IDX_WINSIZE) {
+        *flags = 0;
+        memcpy(blob, window, IDX_WINSIZE);
+        return IDX_WINSIZE;
+    }
+
+    memcpy(blob, &nranges, sizeof(nranges));
+    for (i = 0, end = 0; next_range(used, end, &start, &end); i++) {
+        uint16_t pos = start, n = end - start;
+        memcpy(blob + sizeof(nranges) + i * 4, &pos, sizeof(pos));
+        memcpy(blob + sizeof(nranges) + i * 4 + 2, &n, sizeof(n));
+        memcpy(blob + data, window + start, n);
+        data += n;
+    }
+    *flags = IDX_PT_SPARSE;
+    return data;
+}
+
+int idx_write_begin(FILE *fp) {
+    struct idx_header hdr = {0};
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        return -1;
+    return 0;
+}
+
+int idx_write_window(FILE *fp, struct idx_point *point, z_stream *strm,
+                     const unsigned char *window, uint32_t len) {
+    unsigned char packed[IDX_WINSIZE];
+    off_t pos = ftello(fp);
+
+    if (pos < 0)
+        return -1;
+    point->window_off = pos;
+    point->window_len = len;
+    point->flags &= ~IDX_PT_DEFLATE;
+
+    /* Try to deflate the window into a buffer no bigger than the window
+     * itself; if it doesn't fit it isn't worth storing compressed */
+    if (strm != NULL && len) {
+        if (deflateReset(strm) != Z_OK)
+            return -1;
+        strm->next_in = (unsigned char *) window;
+        strm->avail_in = len;
+        strm->next_out = packed;
+        strm->avail_out = sizeof(packed) - 1;
+        if (deflate(strm, Z_FINISH) == Z_STREAM_END) {
+            point->window_len = sizeof(packed) - 1 - strm->avail_out;
+            point->flags |= IDX_PT_DEFLATE;
+            window = packed;
+        }
+    }
+
+    if (point->window_len &&
+        fwrite(window, 1, point->window_len, fp) != point->window_len)
+        return -1;
+    return 0;
+}
+
+int idx_write_end(FILE *fp, struct idx_header *hdr,
+                  const struct idx_point *points, uint64_t npoints) {
+    off_t pos = ftello(fp);
+
+    if (pos < 0)
+        return -1;
+    if (npoints && fwrite(points, sizeof(struct idx_point), npoints, fp) != npoints)
+        return -1;
+
+    memcpy(hdr->magic, IDX_MAGIC, sizeof(hdr->magic));
+    hdr->version = IDX_VERSION;
+    hdr->byte_order = IDX_BYTE_ORDER;
+    hdr->npoints = npoints;
+    hdr->table_off = pos;
+
+    /* The header goes in last, so a partially written index never validates */
+    if (fflush(fp) != 0 || fseeko(fp, 0, SEEK_SET) != 0)
+        return -1;
+    if (fwrite(hdr, sizeof(struct idx_header), 1, fp) != 1)
+        return -1;
+    if (fseeko(fp, 0, SEEK_END) != 0)
+        return -1;
+    return 0;
+}
+
+/* ridx_check() is idx_check() for a dense read index */
+static int ridx_check(struct ridx_file *ridx, const char *path, char *msg,
+                      size_t msglen) {
+    if (ridx->size < sizeof(struct ridx_header)) {
+        snprintf(msg, msglen, "%s is too short to be a dense read index", path);
+        return -1;
+    }
+    ridx->hdr = (const struct ridx_header *) ridx->base;
+
+    if (memcmp(ridx->hdr->magic, RIDX_MAGIC, sizeof(ridx->hdr->magic)) != 0) {
+        snprintf(msg, msglen, "%s is not a dense read index", path);
+        return -1;
+    }
+    if (ridx->hdr->byte_order != IDX_BYTE_ORDER) {
+        snprintf(msg, msglen, "%s was written on a host with a different byte order", path);
+        return -1;
+    }
+    if (ridx->hdr->version != RIDX_VERSION) {
+        snprintf(msg, msglen, "%s has read index version %u, expected %u", path,
+                 ridx->hdr->version, RIDX_VERSION);
+        return -1;
+    }
+    if (ridx->hdr->table_off > ridx->size ||
+        ridx->hdr->nblocks > (ridx->size - ridx->hdr->table_off) / sizeof(struct ef_block) ||
+        ridx->hdr->nblocks != (ridx->hdr->nreads + EF_BLOCK - 1) / EF_BLOCK) {
+        snprintf(msg, msglen, "%s is truncated", path);
+        return -1;
+    }
+    ridx->blocks = (const struct ef_block *) (ridx->base + ridx->hdr->table_off);
+    return 0;
+}
+
+int ridx_open(struct ridx_file *ridx, const char *path, char *msg, size_t msglen) {
+    memset(ridx, 0, sizeof(struct ridx_file));
+
+    if (map_file(path, sizeof(struct ridx_header), &ridx->base, &ridx->size,
+                 msg, msglen) < 0)
+        return -1;
+    if (ridx_check(ridx, path, msg, msglen) < 0) {
+        munmap((void *) ridx->base, ridx->size);
+        memset(ridx, 0, sizeof(struct ridx_file));
+        return -1;
+    }
+    return 0;
+}
+
+int ridx_open_mem(struct ridx_file *ridx, unsigned char *base, size_t size,
+                  const char *name, char *msg, size_t msglen) {
+    memset(ridx, 0, sizeof(struct ridx_file));
+    ridx->base = base;
+    ridx->size = size;
+    if (base == NULL || ridx_check(ridx, name, msg, msglen) < 0) {
+        if (base == NULL)
+            snprintf(msg, msglen, "%s has no dense read index", name);
+        memset(ridx, 0, sizeof(struct ridx_file));
+        return -1;
+    }
+    ridx->heap = 1;
+    return 0;
+}
+
+void ridx_close(struct ridx_file *ridx) {
+    if (ridx != NULL && ridx->base != NULL) {
+        if (ridx->heap)
+            free((void *) ridx->base);
+        else
+            munmap((void *) ridx->base, ridx->size);
+        memset(ridx, 0, sizeof(struct ridx_file));
+    }
+}
+
+/* ridx_end() returns the end offset of read, checking its block on the way */
+static int ridx_end(const struct ridx_file *ridx, uint64_t read, uint64_t *end) {
+    const struct ef_block *b = ridx->blocks + read / EF_BLOCK;
+    uint64_t words = (uint64_t) b->lower_words + b->upper_words +
+                     ((b->n + EF_SAMPLE - 1) / EF_SAMPLE * sizeof(uint32_t) + 7) / 8;
+
+    if (b->data_off % 8 || b->data_off > ridx->size ||
+        words > (ridx->size - b->data_off) / 8 || read % EF_BLOCK >= b->n)
+        return -1;
+    *end = ef_get(b, (const uint64_t *) (ridx->base + b->data_off), read % EF_BLOCK);
+    return 0;
+}
+
+int ridx_lookup(const struct ridx_file *ridx, uint64_t read,
+                uint64_t *start, uint64_t *end) {
+    if (read >= ridx->hdr->nreads)
+        return -1;
+    if (ridx_end(ridx, read, end) < 0)
+        return -1;
+    *start = 0;
+    if (read > 0 && ridx_end(ridx, read - 1, start) < 0)
+        return -1;
+    return 0;
+}
+
+int ridx_write_begin(FILE *fp) {
+    struct ridx_header hdr = {0};
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        return -1;
+    return 0;
+}
+
+int ridx_write_block(FILE *fp, const uint64_t *ends, uint32_t n,
+                     struct ef_block *b) {
+    off_t pos = ftello(fp);
+    uint64_t *words;
+    size_t nwords;
+
+    if (pos < 0 || n == 0)
+        return -1;
+    words = malloc(ef_max_words(n, ends[n - 1] - ends[0] + 1) * sizeof(uint64_t));
+    if (NULL == words)
+        return -1;
+    nwords = ef_encode(ends, n, b, words);
+    b->data_off = pos;
+    if (fwrite(words, sizeof(uint64_t), nwords, fp) != nwords) {
+        free(words);
+        return -1;
+    }
+    free(words);
+    return 0;
+}
+
+int ridx_write_end(FILE *fp, struct ridx_header *hdr,
+                   const struct ef_block *blocks, uint64_t nblocks) {
+    off_t pos = ftello(fp);
+
+    if (pos < 0)
+        return -1;
+    if (nblocks && fwrite(blocks, sizeof(struct ef_block), nblocks, fp) != nblocks)
+        return -1;
+
+    memcpy(hdr->magic, RIDX_MAGIC, sizeof(hdr->magic));
+    hdr->version = RIDX_VERSION;
+    hdr->byte_order = IDX_BYTE_ORDER;
+    hdr->nblocks = nblocks;
+    hdr->table_off = pos;
+
+    if (fflush(fp) != 0 || fseeko(fp, 0, SEEK_SET) != 0)
+        return -1;
+    if (fwrite(hdr, sizeof(struct ridx_header), 1, fp) != 1)
+        return -1;
+    if (fseeko(fp, 0, SEEK_END) != 0)
+        return -1;
+    return 0;
+}
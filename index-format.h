@@ -0,0 +1,334 @@
+#ifndef INDEX_FORMAT_H
+#define INDEX_FORMAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include "elias-fano.h"
+
+/* Binary access point index (.idx) shared by index-builder, index-reader and
+ * base-counter. The file is laid out as
+ *
+ *   struct idx_header    fixed size header at offset 0
+ *   window section       one window per access point, referenced by offset
+ *   struct idx_point[]   packed table of access points at header.table_off
+ *
+ * Everything is stored in host (little-endian) byte order so that readers can
+ * mmap() the file and use the header, table and windows in place without any
+ * parsing. The table lives after the windows so that a writer can stream
+ * windows out first and only has to hold the small table until the end. */
+
+#define IDX_MAGIC "FQGZIDX"     /* 7 chars + NUL = 8 bytes */
+#define IDX_VERSION 5
+#define IDX_BYTE_ORDER 0x01020304U
+#define IDX_WINSIZE 32768U      /* sliding window size */
+
+/* header flags */
+#define IDX_FLAG_GZIP 0x1       /* index is of a gzip file, not a zlib stream */
+
+/* access point flags */
+#define IDX_PT_DEFLATE 0x1      /* window is stored as a raw deflate stream */
+#define IDX_PT_SPARSE 0x2       /* window is stored as a sparse window */
+#define IDX_PT_NODICT 0x4       /* nothing after the point uses the window */
+
+/* A sparse window keeps only the parts of the 32K window that the deflate
+ * data after its access point actually copies from; everything else is
+ * rebuilt as zeros, which gives the same decompressed output. It is stored
+ * (before any IDX_PT_DEFLATE compression) as
+ *
+ *   uint16_t nranges
+ *   nranges x { uint16_t start; uint16_t len; }    offsets into the window
+ *   the bytes of each range, in order
+ */
+#define IDX_SPARSE_GAP 8        /* unused runs shorter than this are kept */
+
+/* idx_source fingerprints the gzip file an index was built from, so that a
+ * reader can tell in constant time whether the file has been rewritten since:
+ * a stale index silently produces garbage. Only the size and the sampled
+ * contents have to match; the mtime alone changing (a copy, a touch) is
+ * reported but tolerated */
+#define IDX_FP_SPAN (1 << 20)   /* bytes checksummed at each end of the file */
+
+struct idx_source {
+    uint64_t size;              /* size of the gzip file in bytes */
+    int64_t mtime;              /* its modification time, in seconds */
+    uint32_t head_crc;          /* CRC-32 of the first IDX_FP_SPAN bytes */
+    uint32_t tail_crc;          /* CRC-32 of the last IDX_FP_SPAN bytes */
+    uint32_t trailer_crc;       /* the last gzip member's trailer: CRC-32 */
+    uint32_t trailer_isize;     /* and uncompressed length mod 2^32 */
+};
+
+/* How the builder spaced the access points. By default there is one before
+ * every sequence_skip reads, and each sequence index entry is the first of
+ * such a chunk of reads. Otherwise points are spaced by the data, and each
+ * point but the first has one sequence index entry, at the first read that
+ * starts after it, so chunks of reads vary in size */
+#define IDX_SPACING_READS 0     /* every sequence_skip reads */
+#define IDX_SPACING_OUT 1       /* every spacing_every uncompressed bytes */
+#define IDX_SPACING_IN 2        /* every spacing_every compressed bytes */
+#define IDX_SPACING_LATENCY 3   /* every spacing_every ms of inflating */
+
+struct idx_header {
+    char magic[8];              /* IDX_MAGIC */
+    uint32_t version;           /* IDX_VERSION */
+    uint32_t byte_order;        /* IDX_BYTE_ORDER as written by the builder */
+    uint32_t flags;             /* IDX_FLAG_* */
+    int32_t sequence_skip;      /* reads per sequence chunk */
+    uint64_t npoints;           /* number of access points in the table */
+    uint64_t table_off;         /* file offset of the access point table */
+    uint64_t length;            /* total length of uncompressed data */
+    int64_t created;            /* time(NULL) when the index was written */
+    uint32_t spacing;           /* IDX_SPACING_* */
+    uint32_t pad;
+    uint64_t spacing_every;     /* bytes, or milliseconds for a latency */
+    struct idx_source source;   /* the gzip file the index describes */
+};
+
+/* idx_point is one on-disk access point. It mirrors zran's struct point but
+ * refers to its window by offset instead of carrying it inline */
+struct idx_point {
+    uint64_t out;               /* corresponding offset in uncompressed data */
+    uint64_t in;                /* offset in input file of first full byte */
+    uint64_t window_off;        /* file offset of the preceding 32K of data */
+    uint32_t window_len;        /* bytes stored at window_off */
+    uint8_t bits;               /* number of bits (1-7) from byte at in-1, or 0 */
+    uint8_t flags;              /* IDX_PT_* */
+    uint16_t pad;
+    uint64_t lines;             /* newlines in the uncompressed data before out */
+};
+
+/* idx_file is an opened (mapped) index */
+struct idx_file {
+    const unsigned char *base;          /* start of the mapping */
+    size_t size;                        /* size of the mapping */
+    int heap;                           /* base was malloc()ed, not mapped */
+    const struct idx_header *hdr;       /* header, in place */
+    const struct idx_point *points;     /* access point table, in place */
+    uint64_t have;                      /* number of access points */
+};
+
+/* Dense read index (.read-idx), optionally written next to the .idx. It
+ * holds the uncompressed offset of the end of every read, which is also the
+ * start of the next one, as an Elias-Fano coded sequence (elias-fano.h), so
+ * it costs a few bits per read. It is laid out like the .idx:
+ *
+ *   struct ridx_header   fixed size header at offset 0
+ *   block data           the encoded words of each block
+ *   struct ef_block[]    table of blocks at header.table_off
+ *
+ * Every block but the last holds exactly EF_BLOCK reads. */
+
+#define RIDX_MAGIC "FQGZRDX"    /* 7 chars + NUL = 8 bytes */
+#define RIDX_VERSION 2
+
+struct ridx_header {
+    char magic[8];              /* RIDX_MAGIC */
+    uint32_t version;           /* RIDX_VERSION */
+    uint32_t byte_order;        /* IDX_BYTE_ORDER as written by the builder */
+    uint64_t nreads;            /* number of complete reads */
+    uint64_t nblocks;           /* number of blocks in the table */
+    uint64_t table_off;         /* file offset of the block table */
+    int64_t created;            /* time(NULL) when the index was written */
+    struct idx_source source;   /* the gzip file the index describes */
+};
+
+/* ridx_file is an opened (mapped) dense read index */
+struct ridx_file {
+    const unsigned char *base;          /* start of the mapping */
+    size_t size;                        /* size of the mapping */
+    int heap;                           /* base was malloc()ed, not mapped */
+    const struct ridx_header *hdr;      /* header, in place */
+    const struct ef_block *blocks;      /* block table, in place */
+};
+
+/* The index files can also be embedded in the gzip file they describe, so
+ * that they travel with the data. They are appended as gzip members with an
+ * empty payload, which gzip -d decompresses to nothing, each carrying up to
+ * EMB_CHUNK bytes of the index files in an FEXTRA subfield with the ID
+ * EMB_SI1, EMB_SI2. The files are concatenated in the order of enum
+ * emb_section. The last member is the same kind of member, EMB_MEMBER_SIZE
+ * bytes long, whose subfield is a struct emb_footer, so a reader finds
+ * everything from the tail of the file. The fingerprint in the embedded
+ * index only covers the data before it (emb_footer.data_end) and has no
+ * mtime, since appending the index changes it. */
+
+#define EMB_MAGIC "FQGZEMB"     /* 7 chars + NUL = 8 bytes */
+#define EMB_VERSION 1
+#define EMB_SI1 'F'
+#define EMB_SI2 'Q'
+#define EMB_CHUNK 65528         /* subfield bytes per member; XLEN is 16 bits */
+
+/* the sections of an embedded index, in file order */
+enum emb_section {
+    EMB_IDX,                    /* the .idx */
+    EMB_SEQ,                    /* the .seq-idx */
+    EMB_RIDX,                   /* the .read-idx, or nothing */
+    EMB_NSECT
+};
+
+struct emb_footer {
+    char magic[8];              /* EMB_MAGIC */
+    uint32_t version;           /* EMB_VERSION */
+    uint32_t byte_order;        /* IDX_BYTE_ORDER as written by the builder */
+    uint64_t data_end;          /* where the original gzip data ends */
+    uint64_t len[EMB_NSECT];    /* length of each section */
+};
+
+/* gzip header, XLEN, subfield header, empty deflate block and trailer */
+#define EMB_FRAMING (10 + 2 + 4 + 2 + 8)
+#define EMB_MEMBER_SIZE (EMB_FRAMING + sizeof(struct emb_footer))
+
+/* emb_data_end() sets *end to where the gzip data in the file at path ends,
+ * which is the size of the file unless it has an embedded index. Returns 1
+ * if there is an embedded index, 0 if there isn't, and < 0 on failure with
+ * msg filled in */
+int emb_data_end(const char *path, uint64_t *end, char *msg, size_t msglen);
+
+/* emb_read() reads the index embedded at the end of the gzip file at path.
+ * On success each sect[i] is a malloc()ed copy of section i of len[i] bytes,
+ * or NULL if it is empty. Returns 0 on success, 1 if the file has no
+ * embedded index, < 0 on failure with msg filled in */
+int emb_read(const char *path, unsigned char *sect[EMB_NSECT],
+             uint64_t len[EMB_NSECT], char *msg, size_t msglen);
+
+/* emb_write() appends the sections to fp, which must be positioned at
+ * data_end, the end of the gzip data. Returns 0 on success, < 0 on failure */
+int emb_write(FILE *fp, unsigned char *const sect[EMB_NSECT],
+              const uint64_t len[EMB_NSECT], uint64_t data_end);
+
+/* idx_open() maps the index at path and validates its header. This is O(1):
+ * access points and windows are only read, and their windows decoded, when a
+ * reader first uses them. Returns 0 on success, < 0 on failure with msg
+ * filled in with a description */
+int idx_open(struct idx_file *idx, const char *path, char *msg, size_t msglen);
+
+/* idx_open_mem() is idx_open() for an index already read into size bytes of
+ * malloc()ed memory at base, such as one from emb_read(). The index takes
+ * over base on success */
+int idx_open_mem(struct idx_file *idx, unsigned char *base, size_t size,
+                 const char *name, char *msg, size_t msglen);
+
+/* idx_close() unmaps an index opened with idx_open() */
+void idx_close(struct idx_file *idx);
+
+/* idx_fingerprint() fills in src for the gzip data in the file at path,
+ * leaving out any embedded index. It reads at most 2 * IDX_FP_SPAN bytes
+ * whatever the size of the file. Returns 0 on success, < 0 on failure with
+ * msg filled in */
+int idx_fingerprint(const char *path, struct idx_source *src, char *msg,
+                    size_t msglen);
+
+/* idx_check_source() checks that the file at path is the one fingerprinted
+ * in want. Returns 0 if it is, 1 if it is but its mtime has changed (when
+ * want has one), and < 0 if it isn't or can't be read, with msg filled in
+ * for anything but 0 */
+int idx_check_source(const struct idx_source *want, const char *path,
+                     char *msg, size_t msglen);
+
+/* idx_check_prefix() checks that the file at path still starts with the
+ * data fingerprinted in want, which is all that appending to it may leave
+ * alone. Returns 0 if it does, < 0 if it doesn't or can't be read, with msg
+ * filled in */
+int idx_check_prefix(const struct idx_source *want, const char *path,
+                     char *msg, size_t msglen);
+
+/* idx_input is a gzip file mapped read-only once for all the threads that
+ * decompress parts of it, which feed inflate straight from the mapping
+ * instead of each reading it through a stdio buffer of their own */
+struct idx_input {
+    const unsigned char *data;
+    uint64_t size;
+};
+
+/* idx_input_open() maps the gzip file at path. Returns 0 on success, < 0 on
+ * failure with msg filled in */
+int idx_input_open(struct idx_input *in, const char *path, char *msg, size_t msglen);
+
+/* idx_input_advise() tells the kernel that the bytes from start up to end
+ * are about to be read through, so it can read them ahead */
+void idx_input_advise(const struct idx_input *in, uint64_t start, uint64_t end);
+
+/* idx_input_close() unmaps a file opened with idx_input_open() */
+void idx_input_close(struct idx_input *in);
+
+/* idx_get_point() returns access point n, or NULL if n is out of range */
+const struct idx_point *idx_get_point(const struct idx_file *idx, uint64_t n);
+
+/* idx_find_point() returns the number of the last access point at or before
+ * uncompressed offset out, which is where decompression for out has to
+ * start, or -1 if there is none */
+int64_t idx_find_point(const struct idx_file *idx, uint64_t out);
+
+/* idx_window() returns a pointer into the mapping for point's stored window.
+ * Use idx_load_window() to get the window itself */
+const unsigned char *idx_window(const struct idx_file *idx,
+                                const struct idx_point *point);
+
+/* idx_load_window() fills window (IDX_WINSIZE bytes) with point's window,
+ * inflating it if it was stored compressed and expanding it if it was stored
+ * sparse. Returns the number of bytes of dictionary in window (0 if the point
+ * needs none), or < 0 if the stored window is corrupt */
+int idx_load_window(const struct idx_file *idx, const struct idx_point *point,
+                    unsigned char *window);
+
+/* idx_sparse_window() encodes the bytes of window flagged in used as a sparse
+ * window into blob (at least IDX_WINSIZE bytes) and sets *flags to
+ * IDX_PT_SPARSE, or to IDX_PT_NODICT if nothing is used. If the sparse window
+ * would be no smaller, window is copied to blob as is and *flags is 0.
+ * Returns the number of bytes written to blob */
+uint32_t idx_sparse_window(const unsigned char *window,
+                           const unsigned char *used, unsigned char *blob,
+                           uint8_t *flags);
+
+/* idx_write_begin() writes a placeholder header to fp. The real header is
+ * written by idx_write_end() once the table offset is known */
+int idx_write_begin(FILE *fp);
+
+/* idx_write_window() appends a window of len bytes to fp and records its
+ * location in point. point->flags must already say whether the window is
+ * sparse. If strm is not NULL it must be a raw deflate stream; the window is
+ * then compressed with it and stored that way when that is smaller. Returns 0
+ * on success, < 0 on failure */
+int idx_write_window(FILE *fp, struct idx_point *point, z_stream *strm,
+                     const unsigned char *window, uint32_t len);
+
+/* idx_write_end() writes the access point table and then rewrites the header
+ * at the start of fp. Returns 0 on success, < 0 on failure */
+int idx_write_end(FILE *fp, struct idx_header *hdr,
+                  const struct idx_point *points, uint64_t npoints);
+
+/* ridx_open() maps the dense read index at path and validates its header.
+ * Returns 0 on success, < 0 on failure with msg filled in */
+int ridx_open(struct ridx_file *ridx, const char *path, char *msg, size_t msglen);
+
+/* ridx_open_mem() is ridx_open() for a read index in malloc()ed memory,
+ * which it takes over on success */
+int ridx_open_mem(struct ridx_file *ridx, unsigned char *base, size_t size,
+                  const char *name, char *msg, size_t msglen);
+
+/* ridx_close() unmaps a dense read index opened with ridx_open() */
+void ridx_close(struct ridx_file *ridx);
+
+/* ridx_lookup() finds where read number read (counting from 0) starts and
+ * ends in the uncompressed data. Returns 0 on success, < 0 if there is no
+ * such read or the index is corrupt */
+int ridx_lookup(const struct ridx_file *ridx, uint64_t read,
+                uint64_t *start, uint64_t *end);
+
+/* ridx_write_begin() writes a placeholder header to fp */
+int ridx_write_begin(FILE *fp);
+
+/* ridx_write_block() encodes the n (1..EF_BLOCK) read end offsets in ends as
+ * the next block of fp and describes it in b. Returns 0 on success, < 0 on
+ * failure */
+int ridx_write_block(FILE *fp, const uint64_t *ends, uint32_t n,
+                     struct ef_block *b);
+
+/* ridx_write_end() writes the block table and rewrites the header at the
+ * start of fp. Returns 0 on success, < 0 on failure */
+int ridx_write_end(FILE *fp, struct ridx_header *hdr,
+                   const struct ef_block *blocks, uint64_t nblocks);
+
+#endif
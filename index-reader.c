@@ -6,14 +6,20 @@
 #include <time.h>
 #include <math.h>
 #include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "index-format.h"
+#include "inflate-backend.h"
+#include "thread-pool.h"
 
 #define WINSIZE 32768U          /* sliding window size */
 #define CHUNKSIZE 16384         /* file input buffer size */
+#define MAXFEED (1U << 30)      /* most input handed to inflate at once */
 #define MAXLINE 2 * WINSIZE
 #define MSGSIZE 256
-#define MAXTHREADS 16
 
 enum log_level_t {
     LOG_NOTHING,
@@ -27,7 +33,13 @@ enum log_level_t {
 
 enum log_level_t GLOBAL_LEVEL = LOG_INFO;
 int idx_chunk_size = 10000;
-int num_threads = 4;
+int num_threads = 0;            /* -n, or one per CPU if 0 */
+char *read_index_file = NULL;   /* dense read index, with -d */
+char *read_range = NULL;        /* READ[:COUNT] to extract, with -r */
+int paired = 0;                 /* read the two files of a read pair, -p */
+int interleave = 0;             /* and write their reads in turn, -I */
+char *output_name = NULL;       /* where the reads go, - for stdout, -o */
+char *mate_output = NULL;       /* where their mates go with -p, a second -o */
 
 
 /* level_to_string is a utility to toggle log levels */
@@ -69,14 +81,75 @@ struct seq_list {
     void *seq_entry;    /* List of seq_entries */
 };
 
+/* work_queue hands the sequence chunks out to the threads a few at a time,
+ * so that a thread that gets slow ones (long reads, data that compresses
+ * badly, or a part of the file that isn't cached yet) doesn't hold up the
+ * others. A thread takes the next range with one atomic add */
+#define WORK_WASTE 8            /* a range is this much more than is skipped */
+
+struct work_queue {
+    int next;                   /* the first chunk not taken yet */
+    int nchunks;
+    int grain;                  /* chunks in a range */
+};
+
+/* take_chunks() sets *start and *stop to the next range of chunks, with stop
+ * -1 for the last one, which goes to the end of the file
+ * @returns: 1 if there was a range left, 0 if not
+ */
+static int take_chunks(struct work_queue *q, int *start, int *stop) {
+    int k = __atomic_fetch_add(&q->next, q->grain, __ATOMIC_RELAXED);
+
+    if (k >= q->nchunks)
+        return 0;
+    *start = k;
+    *stop = k + q->grain < q->nchunks ? k + q->grain : -1;
+    return 1;
+}
+
+/* range_grain() picks how many chunks a range holds: enough that what is
+ * inflated only to be thrown away, from the access point of its first chunk
+ * to where the chunk starts, is small next to the range. With a point at the
+ * block each chunk starts in, as index-builder makes them, single chunks do */
+static int range_grain(struct idx_file *index, struct seq_list *list) {
+    struct seq_entry *entries = list->seq_entry;
+    off_t skipped = 0, length = entries[list->have - 1].start + 1;
+
+    for (int i = 0; i < list->have; i++) {
+        const struct idx_point *point = idx_get_point(index, entries[i].block);
+        if (point != NULL)
+            skipped += entries[i].start - point->out;
+    }
+    if ((off_t) index->hdr->length > length)
+        length = index->hdr->length;
+    off_t grain = WORK_WASTE * skipped / length + 1;
+    return grain < list->have ? (int) grain : list->have;
+}
+
 /* task_args contains a pointer to the index struct and the seq chunk struct */
 struct task_args {
     int tid;                                    /* Thread id */
     int start;                                  /* start seq chunk */
     int stop;                                   /* end seq chunk */
-    char * filename;                            /* gz filename to read */
-    struct access * index;                      /* Index point list */
+    const struct idx_input * gz;                /* Mapped gz file to read */
+    struct idx_file * index;                    /* Mapped access point index */
     struct seq_list * list;                     /* Sequence point list */
+    int fd;                                     /* Output file, or -1 */
+    off_t end;                                  /* Where its reads ended */
+    struct work_queue * queue;                  /* Chunks left to read */
+};
+
+/* reads_out is where extract() puts the reads: with pwrite() straight into
+ * fd at their offset in the uncompressed file, so that every thread writes
+ * its part of the output file as it goes, or kept in a string that grows as
+ * needed if fd is -1 */
+struct reads_out {
+    int fd;
+    off_t at;           /* where the next bytes go in fd */
+    char *str;          /* the reads kept, NUL terminated */
+    off_t len;          /* bytes taken so far */
+    off_t size;         /* bytes allocated for str */
+    int reads;          /* reads taken so far */
 };
 
 
@@ -85,87 +158,13 @@ struct task_args {
  * do */
 struct extract_info{
     char * filename;
-    struct access * index;
-    struct point * this_block;
+    struct idx_file * index;
+    const struct idx_point * this_block;
     off_t seq_offset;
     int nchunks;
 };
 
 
-int base64_decode(char* input, size_t input_len, char* output, size_t output_len) {
-    int i, j;
-    unsigned char c;
-    unsigned char buffer[4];
-    unsigned char temp[3];
-
-    for (i = 0, j = 0; i < input_len; i += 4, j += 3) {
-        // Extract 4 base64-encoded characters from input
-        buffer[0] = input[i];
-        buffer[1] = input[i+1];
-        buffer[2] = input[i+2];
-        buffer[3] = input[i+3];
-
-        // Convert base64-encoded characters to their 6-bit values
-        for (int k = 0; k < 4; k++) {
-            if (buffer[k] >= 'A' && buffer[k] <= 'Z') {
-                buffer[k] -= 'A';
-            } else if (buffer[k] >= 'a' && buffer[k] <= 'z') {
-                buffer[k] -= 'a' - 26;
-            } else if (buffer[k] >= '0' && buffer[k] <= '9') {
-                buffer[k] -= '0' - 52;
-            } else if (buffer[k] == '+') {
-                buffer[k] = 62;
-            } else if (buffer[k] == '/') {
-                buffer[k] = 63;
-            }
-        }
-
-        // Combine 4 6-bit values into 3 bytes
-        temp[0] = (buffer[0] << 2) | (buffer[1] >> 4);
-        temp[1] = (buffer[1] << 4) | (buffer[2] >> 2);
-        temp[2] = (buffer[2] << 6) | buffer[3];
-
-        // Copy the decoded bytes to output
-        if (j + 2 < output_len) {
-            output[j] = temp[0];
-            output[j+1] = temp[1];
-            output[j+2] = temp[2];
-        } else {
-            return -1; // Output buffer too small
-        }
-    }
-
-    // Add null terminator to output string
-    output[j] = '\0';
-
-    return j; // Return the number of bytes written to output
-}
-
-/* access point entry  FROM ZRAN */
-struct point {
-    off_t out;          /* corresponding offset in uncompressed data */
-    off_t in;           /* offset in input file of first full byte */
-    int bits;           /* number of bits (1-7) from byte at in - 1, or 0 */
-    unsigned char window[WINSIZE];  /* preceding 32K of uncompressed data */
-};
-
-/* access point list */
-struct access {
-    int have;           /* number of list entries filled in */
-    int size;           /* number of list entries allocated */
-    struct point *list; /* allocated list */
-};
-
-/* Deallocate an index built by build_index() */
-static void free_index(struct access *index)
-{
-    if (index != NULL) {
-        free(index->list);
-        free(index);
-    }
-}
-/* From ZRAN */
-
 static struct seq_list * add_seq(struct seq_list * list, int seqNum,
                                  off_t start, int blockNum) {
 
@@ -206,182 +205,168 @@ static struct seq_list * add_seq(struct seq_list * list, int seqNum,
     return list;
 }
 
-static struct access *add_read_point(struct access *index, int bits,
-                              off_t in, off_t out, unsigned char *window)
-{
-    struct point *next;
-
-    /* if list is empty, create it (start with eight points) */
-    if (index == NULL) {
-        index = malloc(sizeof(struct access));
-        if (index == NULL) return NULL;
-        index->list = malloc(sizeof(struct point) << 3);
-        if (index->list == NULL) {
-            free(index);
-            return NULL;
+/* put_reads() adds the n bytes at p to out
+ * @returns: 0 on success, < 0 on failure
+ */
+static int put_reads(struct reads_out *out, const unsigned char *p, size_t n) {
+    if (out->fd >= 0) {
+        while (n) {
+            ssize_t w = pwrite(out->fd, p, n, out->at);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                logger(LOG_ERROR, "Failed to write the reads to the output file");
+                return -1;
+            }
+            p += w;
+            n -= (size_t) w;
+            out->at += w;
+            out->len += w;
         }
-        index->size = 8;
-        index->have = 0;
+        return 0;
     }
-
-        /* if list is full, make it bigger */
-    else if (index->have == index->size) {
-        index->size <<= 1;
-        next = realloc(index->list, sizeof(struct point) * index->size);
-        if (next == NULL) {
-            free_index(index);
-            return NULL;
+    if (out->len + (off_t) n + 1 > out->size) {
+        off_t size = out->size ? out->size : 2 * WINSIZE;
+        while (size < out->len + (off_t) n + 1)
+            size *= 2;
+        char *str = realloc(out->str, size);
+        if (NULL == str) {
+            logger(LOG_ERROR, "Got NULL returned from realloc, failing");
+            return -1;
         }
-        index->list = next;
+        out->str = str;
+        out->size = size;
     }
+    memcpy(out->str + out->len, p, n);
+    out->len += n;
+    out->str[out->len] = '\0';
+    return 0;
+}
 
-    /* fill in entry and increment how many we have */
-    next = index->list + index->have;
-    next->bits = bits;
-    next->in = in;
-    next->out = out;
-    strcpy(next->window, window);
-    index->have++;
-
-    /* return list, possibly reallocated */
-    return index;
+/* take_reads() adds the n bytes of output at p to out, stopping after the
+ * read that makes seq_num a multiple of nchunks if that comes first. line_num
+ * and seq_num carry on from one call to the next
+ * @returns: 1 if that read has ended, 0 if not, < 0 on failure
+ */
+static int take_reads(struct reads_out *out, const unsigned char *p, size_t n,
+                      off_t *line_num, int *seq_num, int nchunks) {
+    const unsigned char *nl = p, *end = p + n;
+    int done = 0;
+
+    while (!done && (nl = memchr(nl, '\n', end - nl)) != NULL) {
+        nl++;
+        if ((*line_num)++ % 4 == 0) {
+            (*seq_num)++;
+            out->reads++;
+            done = nchunks > 0 && *seq_num % nchunks == 0;
+        }
+    }
+    if (put_reads(out, p, done ? (size_t) (nl - p) : n) < 0)
+        return -1;
+    return done;
 }
 
-char * extract(char * filename, struct access *index, struct point * this,
-        off_t seq_offset, int nchunks)
+/* extract() inflates from the access point this, throwing away what comes
+ * before offset seq_offset of the uncompressed data, and puts the reads
+ * from there to out until nchunks reads, or all of them if it is -1, have
+ * been put
+ * @returns: 0 on success, < 0 if the reads couldn't be put
+ */
+static int extract(const struct idx_input *gz, struct idx_file *index, struct ib_stream *strm,
+        const struct idx_point * this,
+        off_t seq_offset, int nchunks, struct reads_out *out)
 {
-    int ret, skip, seq_num;
-    z_stream strm;
-    unsigned char input[CHUNKSIZE];
+    int ret, skip, seq_num, taken = 0;
     unsigned char discard[WINSIZE];
     unsigned char buf[WINSIZE];
-    off_t out_idx = 0;
+    unsigned char window[WINSIZE];
     off_t line_num = 1;
     off_t totout = seq_num = 0;
     skip = 1;
-    off_t buffsize = 2 * WINSIZE;
-    char * output = (char *) malloc(buffsize * sizeof(char));
-    FILE *in;
-
-    /* initialize file and inflate state to start there */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit2(&strm, -15);         /* raw inflate */
+    uint64_t pos;                       /* the next input byte */
+
+    /* set the thread's inflate state up to start there */
+    ret = ib_reset(strm);                   /* raw inflate */
     if (ret != Z_OK)
-        return NULL;
+        return -1;
 
     off_t seek_offset = this->in - (off_t) (this->bits ? 1 : 0);
 
-    //Open the gz file
-    in = fopen(filename, "rb");
-    if (NULL == in) {
-        fprintf(stderr, "Error opening %s for reading\n", filename);
-        exit(-1);
-    }
-
-    ret = fseeko(in, seek_offset, SEEK_SET);
-    if (ret == -1) {
-        perror("failed");
-        printf("Error seeking to offset: %s\n", strerror(errno));
-        exit(-1);
-    }
+    /* The input is inflated straight out of the mapped gz file */
+    pos = seek_offset;
     if (this->bits) {
-        ret = getc(in);
-        if (ret == -1) {
-            ret = ferror(in) ? Z_ERRNO : Z_DATA_ERROR;
+        if (pos >= gz->size) {
+            ret = Z_DATA_ERROR;
             goto deflate_index_extract_ret;
         }
-        (void)inflatePrime(&strm, this->bits, ret >> (8 - this->bits));
+        ret = gz->data[pos++];
+        (void)ib_prime(strm, this->bits, ret >> (8 - this->bits));
+    }
+    /* The window is only materialized here, in the worker that needs this
+     * point, and not at all if the data after the point doesn't use it */
+    int window_len = idx_load_window(index, this, window);
+    if (window_len < 0) {
+        logger(LOG_ERROR, "Corrupt window in the gzip index");
+        ret = Z_DATA_ERROR;
+        goto deflate_index_extract_ret;
     }
-    (void)inflateSetDictionary(&strm, this->window, WINSIZE);
+    if (window_len)
+        (void)ib_set_dictionary(strm, window, window_len);
 
 
     /* skip uncompressed bytes until offset reached, then satisfy request */
     seq_offset -= this->out;
-    strm.avail_in = 0;
+    strm->avail_in = 0;
     do {
         /* define where to put uncompressed data, and how much */
         if (seq_offset > WINSIZE) {             /* skip WINSIZE bytes */
-            strm.avail_out = WINSIZE;
-            strm.next_out = discard;
+            strm->avail_out = WINSIZE;
+            strm->next_out = discard;
             seq_offset -= WINSIZE;
 
         }
         else if (seq_offset > 0) {              /* last skip */
-            strm.avail_out = (unsigned)seq_offset;
-            strm.next_out = discard;
+            strm->avail_out = (unsigned)seq_offset;
+            strm->next_out = discard;
             seq_offset = 0;
         }
         else if (skip) {                    /* at offset now */
-            strm.avail_out = WINSIZE;
-            strm.next_out = buf;
+            strm->avail_out = WINSIZE;
+            strm->next_out = buf;
             skip = 0;                       /* only do this once */
         } else if (skip == 0) {
-            strm.avail_out = WINSIZE;
-            strm.next_out = buf;
+            strm->avail_out = WINSIZE;
+            strm->next_out = buf;
+            /* take the buffer filled last time round */
             if (totout) {
-                for (int i = 0; i < strm.avail_out; i++) {
-                    //Copy the character into the output buffer
-                    output[out_idx] = strm.next_out[i];
-                    out_idx++; //Move index to next pos
-
-                    //Check if it's a new line
-                    if (strm.next_out[i] == '\n') {
-                        // This is a new sequence
-                        if ((line_num % 4) == 0) {
-                            seq_num++;
-                            /* If we've seen the total number of sequences we need to,
-                             * return the buffer we've been building */
-                            if ((nchunks > 0) && (seq_num % nchunks) == 0) {
-                                /* This position is (totout - strm.avail_out) + i */
-                                goto deflate_index_extract_ret;
-                            }
-                        }
-                    line_num++;
-                    }
-
-                   //Check if we need to double the output buffer size
-                   if (out_idx == buffsize-1) {
-                       buffsize *= 2;
-                       output = (char*) realloc(output, buffsize * sizeof(char));
-                       output[buffsize] = '\0';
-                       if (NULL == output) {
-                           logger(LOG_ERROR, "Got NULL returned from realloc, failing");
-                           exit(1);
-                       }
-                   }
-                }
+                taken = take_reads(out, buf, WINSIZE, &line_num, &seq_num, nchunks);
+                if (taken)
+                    goto deflate_index_extract_ret;
             }
         }
 
         //skip = 0;                       /* only do this once */
         /* uncompress until avail_out filled, or end of stream */
         do {
-            if (strm.avail_in == 0) {
-                strm.avail_in = fread(input, 1, CHUNKSIZE, in);
-                if (ferror(in)) {
-                    ret = Z_ERRNO;
-                    goto deflate_index_extract_ret;
-                }
-                if (strm.avail_in == 0) {
+            if (strm->avail_in == 0) {
+                if (pos >= gz->size) {
                     ret = Z_DATA_ERROR;
                     goto deflate_index_extract_ret;
                 }
-                strm.next_in = input;
+                strm->next_in = (unsigned char *) gz->data + pos;
+                strm->avail_in = gz->size - pos < MAXFEED ? gz->size - pos : MAXFEED;
+                pos += strm->avail_in;
             }
-            totout += strm.avail_out;
-            ret = inflate(&strm, Z_SYNC_FLUSH);       /* normal inflate */
-            totout -= strm.avail_out;
+            totout += strm->avail_out;
+            ret = ib_inflate(strm);                  /* normal inflate */
+            totout -= strm->avail_out;
             if (ret == Z_NEED_DICT)
                 ret = Z_DATA_ERROR;
             if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
                 goto deflate_index_extract_ret;
             if (ret == Z_STREAM_END) {
                 /* the raw deflate stream has ended */
-                if (index->have == 0) {
+                if (!(index->hdr->flags & IDX_FLAG_GZIP)) {
                     /* this is a zlib stream that has ended -- done */
                     break;
                 }
@@ -389,97 +374,52 @@ char * extract(char * filename, struct access *index, struct point * this,
                 /* near the end of a gzip member, which might be followed by
                    another gzip member -- skip the gzip trailer and see if
                    there is more input after it */
-                if (strm.avail_in < 8) {
-                    fseeko(in, 8 - strm.avail_in, SEEK_CUR);
-                    strm.avail_in = 0;
+                if (strm->avail_in < 8) {
+                    pos += 8 - strm->avail_in;
+                    strm->avail_in = 0;
                 }
                 else {
-                    strm.avail_in -= 8;
-                    strm.next_in += 8;
+                    strm->avail_in -= 8;
+                    strm->next_in += 8;
                 }
-                if (strm.avail_in == 0 && ungetc(getc(in), in) == EOF) {
+                if (strm->avail_in == 0 && pos >= gz->size) {
                     /* the input ended after the gzip trailer -- done */
                     break;
                 }
 
                 /* there is more input, so another gzip member should follow --
                    validate and skip the gzip header */
-                ret = inflateReset2(&strm, 31);
-                if (ret != Z_OK)
-                    goto deflate_index_extract_ret;
                 do {
-                    if (strm.avail_in == 0) {
-                        strm.avail_in = fread(input, 1, CHUNKSIZE, in);
-                        if (ferror(in)) {
-                            ret = Z_ERRNO;
-                            goto deflate_index_extract_ret;
-                        }
-                        if (strm.avail_in == 0) {
+                    if (strm->avail_in == 0) {
+                        if (pos >= gz->size) {
                             ret = Z_DATA_ERROR;
                             goto deflate_index_extract_ret;
                         }
-                        strm.next_in = input;
+                        strm->next_in = (unsigned char *) gz->data + pos;
+                        strm->avail_in = gz->size - pos < MAXFEED ? gz->size - pos : MAXFEED;
+                        pos += strm->avail_in;
                     }
-
-                    totout += strm.avail_out;
-                    ret = inflate(&strm, Z_BLOCK);
-                    totout -= strm.avail_out;
-                    if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+                    ret = ib_header(strm);
+                    if (ret < 0)
                         goto deflate_index_extract_ret;
-                } while ((strm.data_type & 128) == 0);
+                } while (ret == 0);
 
-                /* set up to continue decompression of the raw deflate stream
-                   that follows the gzip header */
-                ret = inflateReset2(&strm, -15);
-                if (ret != Z_OK)
-                    goto deflate_index_extract_ret;
+                /* ib_header() has set up to continue decompression of the
+                   raw deflate stream that follows the gzip header */
+                ret = Z_OK;
             }
 
             /* continue to process the available input before reading more */
-        } while (strm.avail_out != 0);
+        } while (strm->avail_out != 0);
 
         if (ret == Z_STREAM_END) {
             /* reached the end of the compressed data -- return the data that
                was available, possibly less than requested */
-            //strm.avail_out = WINSIZE;
-            strm.next_out = buf;
+            //strm->avail_out = WINSIZE;
             //skip = 0;                       /* only do this once */
-            if (totout) {
-                for (int i = 0; i < WINSIZE - strm.avail_out; i++) {
-                    output[out_idx] = strm.next_out[i];
-                    out_idx++; //Move index to next pos
-
-                    //Check if it's a new line
-                    if (strm.next_out[i] == '\n') {
-                        // This is a new sequence
-                        if ((line_num % 4) == 0) {
-                            seq_num++;
-                            /* If we've seen the total number of sequences we need to,
-                             * return the buffer we've been building */
-                            if ((nchunks > 0) && (seq_num % nchunks) == 0) {
-/*
-                                output[out_idx] = '\0';
-                                return output;
-*/
-                                goto deflate_index_extract_ret;
-                                /* This position is (totout - strm.avail_out) + i */
-                            }
-                        }
-                        line_num++;
-                    }
-
-                    //Check if we need to double the output buffer size
-                    if (out_idx == buffsize-1) {
-                        buffsize *= 2;
-                        output = (char*) realloc(output, buffsize * sizeof(char));
-                        output[buffsize] = '\0';
-                        if (NULL == output) {
-                            logger(LOG_ERROR, "Got NULL returned from realloc, failing");
-                            exit(1);
-                        }
-                    }
-                }
-            }
+            if (totout)
+                taken = take_reads(out, buf, WINSIZE - strm->avail_out, &line_num,
+                                   &seq_num, nchunks);
             break;
         }
 
@@ -488,28 +428,36 @@ char * extract(char * filename, struct access *index, struct point * this,
 
     /* clean up and return the bytes read, or the negative error */
     deflate_index_extract_ret:
+    return taken < 0 ? -1 : 0;
+}
 
-    fclose(in);
-    (void)inflateEnd(&strm);
-
-    output[out_idx] = '\0';
-    return output;
-
+/* start_inflate() sets up the inflate state a thread uses for all of its
+ * chunks */
+static void start_inflate(struct ib_stream *strm) {
+    if (ib_init(strm) != Z_OK) {
+        logger(LOG_ERROR, "Couldn't set up inflating");
+        exit(1);
+    }
 }
 
-void * task(void *arg) {
+/* chunk_reads() extracts the reads of the sequence chunks of ta to out, which
+ * with a file starts where the first chunk is in the uncompressed data,
+ * inflating with strm */
+static void chunk_reads(struct task_args *arg, struct ib_stream *strm,
+                        struct reads_out *out) {
 
     off_t seq_offset, block_num;
-    struct task_args ta = *(struct task_args *) arg;
-    off_t out_size = WINSIZE;
-    off_t total_bytes = 0;
+    struct task_args ta = *arg;
 
     /* Get this sequence entry */
     //struct seq_entry * this_chunk = ta.list->seq_entry + (i * sizeof(struct seq_entry));
     struct seq_entry * this_chunk = ta.list->seq_entry + (ta.start * sizeof(struct seq_entry));
     int nchunks;
     if (ta.stop > 0) {
-        nchunks = (ta.stop - ta.start) * idx_chunk_size;
+        /* Chunks hold idx_chunk_size reads, unless the points were spaced by
+         * the data */
+        struct seq_entry * stop_chunk = ta.list->seq_entry + (ta.stop * sizeof(struct seq_entry));
+        nchunks = stop_chunk->seq_num - this_chunk->seq_num;
     } else {
         nchunks = -1;
     }
@@ -522,54 +470,689 @@ void * task(void *arg) {
     block_num = this_chunk->block;
 
     /* Get the block structure */
-    struct point * this_block = ta.index->list + block_num;
-    char * ret = extract(ta.filename, ta.index, this_block, seq_offset, nchunks);
+    const struct idx_point * this_block = idx_get_point(ta.index, block_num);
+    if (NULL == this_block) {
+        logger(LOG_ERROR, "Sequence index refers to a block missing from the gzip index");
+        exit(1);
+    }
+
+    /* Have the compressed data up to the access point after the last chunk
+     * read ahead */
+    const struct idx_point * end_block = ta.stop > 0 ?
+        idx_get_point(ta.index, ((struct seq_entry *) ta.list->seq_entry)[ta.stop].block + 1) : NULL;
+    idx_input_advise(ta.gz, this_block->in, end_block != NULL ? end_block->in : ta.gz->size);
+    out->at = seq_offset;
+    if ((out->fd < 0 && put_reads(out, (const unsigned char *) "", 0) < 0) ||
+        extract(ta.gz, ta.index, strm, this_block, seq_offset, nchunks, out) < 0) {
+        logger(LOG_ERROR, "Thread failed to put out its reads");
+        exit(-1);
+    }
+}
+
+void * task(void *arg) {
+    struct task_args *ta = arg, range = *ta;
+    struct ib_stream strm;
+
+    start_inflate(&strm);
+    while (take_chunks(ta->queue, &range.start, &range.stop)) {
+        struct reads_out out = { .fd = ta->fd };
+        chunk_reads(&range, &strm, &out);
+        if (out.at > ta->end)
+            ta->end = out.at;
+    }
+    ib_end(&strm);
+    return NULL;
+}
+
+/* read_end() returns where the read starting at p ends, or end if it runs
+ * on to there */
+static const char *read_end(const char *p, const char *end) {
+    for (int i = 0; i < 4 && p < end; i++) {
+        const char *nl = memchr(p, '\n', end - p);
+        p = nl != NULL ? nl + 1 : end;
+    }
+    return p;
+}
+
+/* interleave_reads() puts the reads in mates[0] and mates[1] to out, each
+ * read followed by its mate
+ * @returns: 0 on success, < 0 on failure
+ */
+static int interleave_reads(struct reads_out *out, const struct reads_out *mates) {
+    const char *p[2], *end[2];
+
+    for (int m = 0; m < 2; m++) {
+        p[m] = mates[m].str;
+        end[m] = mates[m].str + mates[m].len;
+    }
+    while (p[0] < end[0] || p[1] < end[1])
+        for (int m = 0; m < 2; m++) {
+            const char *next = read_end(p[m], end[m]);
+            if (put_reads(out, (const unsigned char *) p[m], next - p[m]) < 0)
+                return -1;
+            p[m] = next;
+        }
+    return 0;
+}
 
-    /* check that we got some data */
-    if (strlen(ret) < 0) {
-        logger(LOG_ERROR, "Thread returned < 0 length string");
+/* pair_chunks() extracts the sequence chunks of ta[0] and the same ones of
+ * its mate file ta[1] into bufs[0] and bufs[1], and puts them to out with
+ * each read followed by its mate. A file gets them where they go in it, after
+ * the reads of both files before the chunks; they are put together in
+ * bufs[2] first, to be written in one go
+ * @returns: 0 if the chunks hold as many reads as each other, 1 if not
+ */
+static int pair_chunks(struct task_args *ta, struct ib_stream *strm,
+                       struct reads_out *bufs, struct reads_out *out) {
+    struct reads_out *both = out;
+
+    for (int m = 0; m < 2; m++) {
+        bufs[m].len = 0;
+        bufs[m].reads = 0;
+        chunk_reads(&ta[m], strm, &bufs[m]);
+    }
+    if (out->fd >= 0) {
+        out->at = ((struct seq_entry *) ta[0].list->seq_entry)[ta[0].start].start +
+                  ((struct seq_entry *) ta[1].list->seq_entry)[ta[1].start].start;
+        both = &bufs[2];
+        both->len = 0;
+    }
+    if (interleave_reads(both, bufs) < 0 ||
+        (both != out && put_reads(out, (const unsigned char *) both->str, both->len) < 0)) {
+        logger(LOG_ERROR, "Thread failed to put out its reads");
         exit(-1);
     }
+    return bufs[0].reads != bufs[1].reads;
+}
+
+/* stream holds what the threads share when the reads are streamed to stdout.
+ * The threads take the sequence chunks in order, but finish them in any
+ * order, so each one is kept in a slot until the chunks before it have been
+ * written. There are only STREAM_SLOTS slots for every thread, and a thread
+ * waits for a slot to be written out before taking another chunk, so a slow
+ * reader of the output holds the threads back instead of the reads piling
+ * up in memory. With -p -I the chunks of both files of a read pair go
+ * through the slots together, interleaved */
+#define STREAM_SLOTS 2
+
+struct stream {
+    struct task_args ta[2];     /* what all the chunks are read from */
+    int paired;                 /* 1 to interleave them with ta[1]'s */
+    int mismatch;               /* 1 if the mates' chunks didn't match */
+    int nchunks;
+    int next;                   /* the next chunk for a thread to take */
+    int written;                /* chunks written out so far */
+    int nslots;
+    struct reads_out *slot;     /* chunk k is kept in slot k % nslots */
+    int *ready;                 /* 1 once the chunk in a slot is complete */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+void * stream_task(void *arg) {
+    struct stream *st = arg;
+    struct reads_out bufs[3] = {{ .fd = -1 }, { .fd = -1 }, { .fd = -1 }};
+    struct ib_stream strm;
+
+    start_inflate(&strm);
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        while (st->next < st->nchunks && st->next - st->written >= st->nslots)
+            pthread_cond_wait(&st->cond, &st->lock);
+        if (st->next >= st->nchunks)
+            break;
+        int k = st->next++;
+        pthread_mutex_unlock(&st->lock);
+
+        /* the slot is this thread's until it is marked ready */
+        struct task_args ta[2] = {st->ta[0], st->ta[1]};
+        struct reads_out *out = st->slot + k % st->nslots;
+        int mismatch = 0;
+        for (int m = 0; m < 2; m++) {
+            ta[m].start = k;
+            ta[m].stop = k + 1 < st->nchunks ? k + 1 : -1;
+        }
+        out->len = 0;
+        if (st->paired)
+            mismatch = pair_chunks(ta, &strm, bufs, out);
+        else
+            chunk_reads(ta, &strm, out);
+
+        pthread_mutex_lock(&st->lock);
+        st->mismatch |= mismatch;
+        st->ready[k % st->nslots] = 1;
+        pthread_cond_broadcast(&st->cond);
+    }
+    pthread_mutex_unlock(&st->lock);
+    ib_end(&strm);
+    for (int i = 0; i < 3; i++)
+        free(bufs[i].str);
+    return NULL;
+}
+
+/* stream_reads() writes the reads of ta[0], or with paired set those of both
+ * files of ta in turn, to stdout in order, each sequence chunk as soon as it
+ * and the ones before it have been inflated
+ * @returns: 0 on success, 1 on failure
+ */
+static int stream_reads(const struct task_args *ta, int paired) {
+    struct thread_pool pool;
+    struct stream st;
+    int ret = 0;
+
+    memset(&st, 0, sizeof(struct stream));
+    for (int m = 0; m < (paired ? 2 : 1); m++)
+        st.ta[m] = ta[m];
+    st.paired = paired;
+    st.nchunks = ta[0].list->have;
+    st.nslots = STREAM_SLOTS * num_threads;
+    st.slot = calloc(st.nslots, sizeof(struct reads_out));
+    st.ready = calloc(st.nslots, sizeof(int));
+    if (NULL == st.slot || NULL == st.ready) {
+        logger(LOG_ERROR, "Out of memory for the output buffers");
+        return 1;
+    }
+    for (int i = 0; i < st.nslots; i++)
+        st.slot[i].fd = -1;
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+    if (tp_start(&pool, num_threads, stream_task, &st, 0) < 0) {
+        logger(LOG_ERROR, "Couldn't start the threads");
+        exit(1);
+    }
+
+    for (int k = 0; k < st.nchunks; k++) {
+        struct reads_out *out = st.slot + k % st.nslots;
+
+        pthread_mutex_lock(&st.lock);
+        while (!st.ready[k % st.nslots])
+            pthread_cond_wait(&st.cond, &st.lock);
+        pthread_mutex_unlock(&st.lock);
+
+        if (!ret && (fwrite(out->str, 1, out->len, stdout) != (size_t) out->len ||
+                     fflush(stdout) != 0)) {
+            logger(LOG_ERROR, "Failed to write the reads to stdout");
+            ret = 1;
+        }
+
+        pthread_mutex_lock(&st.lock);
+        st.ready[k % st.nslots] = 0;
+        st.written++;
+        pthread_cond_broadcast(&st.cond);
+        pthread_mutex_unlock(&st.lock);
+    }
+
+    tp_join(&pool, NULL);
+    if (st.mismatch) {
+        logger(LOG_ERROR, "The mate files don't have the same number of reads");
+        ret = 1;
+    }
+    pthread_cond_destroy(&st.cond);
+    pthread_mutex_destroy(&st.lock);
+    for (int i = 0; i < st.nslots; i++)
+        free(st.slot[i].str);
+    free(st.slot);
+    free(st.ready);
+    return ret;
+}
+
+/* pair_args are what a thread reading a read pair's files needs: each of
+ * the two files' task_args, of which the first's queue hands out the chunks
+ * for both and, with -I, the first's fd and end are the output's */
+struct pair_args {
+    struct task_args mate[2];
+    int mismatch;           /* 1 if some chunks held different numbers of reads */
+};
+
+/* pair_task() extracts the same chunks of both files of a read pair, each to
+ * its own output file or with -I in turn to one */
+void * pair_task(void *arg) {
+    struct pair_args *pa = arg;
+    struct task_args range[2] = {pa->mate[0], pa->mate[1]};
+    struct reads_out bufs[3] = {{ .fd = -1 }, { .fd = -1 }, { .fd = -1 }};
+    struct ib_stream strm;
+
+    start_inflate(&strm);
+    while (take_chunks(pa->mate[0].queue, &range[0].start, &range[0].stop)) {
+        range[1].start = range[0].start;
+        range[1].stop = range[0].stop;
+        if (interleave) {
+            struct reads_out out = { .fd = pa->mate[0].fd };
+            pa->mismatch |= pair_chunks(range, &strm, bufs, &out);
+            if (out.at > pa->mate[0].end)
+                pa->mate[0].end = out.at;
+            continue;
+        }
+        int reads[2];
+        for (int m = 0; m < 2; m++) {
+            struct reads_out out = { .fd = pa->mate[m].fd };
+            chunk_reads(&range[m], &strm, &out);
+            reads[m] = out.reads;
+            if (out.at > pa->mate[m].end)
+                pa->mate[m].end = out.at;
+        }
+        pa->mismatch |= reads[0] != reads[1];
+    }
+    ib_end(&strm);
+    for (int i = 0; i < 3; i++)
+        free(bufs[i].str);
+    return NULL;
+}
+
+/* parse_range() reads READ[:COUNT] from range into *first and *count, which
+ * is 1 if it isn't given. COUNT has to be at least 1
+ * @returns: 0 on success, < 0 if range isn't two such numbers
+ */
+static int parse_range(const char *range, uint64_t *first, int *count) {
+    unsigned long long n;
+    char *end;
+
+    /* strtoull() would take a minus sign and wrap the number round */
+    if (strchr(range, '-') != NULL)
+        return -1;
+    errno = 0;
+    *first = strtoull(range, &end, 10);
+    if (errno != 0 || end == range)
+        return -1;
+    *count = 1;
+    if (*end == ':') {
+        range = end + 1;
+        n = strtoull(range, &end, 10);
+        if (errno != 0 || end == range || n < 1 || n > INT_MAX)
+            return -1;
+        *count = (int) n;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+/* extract_reads() writes count reads starting at read number first (counting
+ * from 0) to stdout. The dense read index gives the exact offset of the first
+ * read, so only the distance from the nearest access point is decompressed
+ * @returns: 0 on success, < 0 on failure
+ */
+static int extract_reads(const struct idx_input *gz, struct idx_file *index,
+                         struct ridx_file *ridx, uint64_t first, int count) {
+    uint64_t start, end;
+    char msg[MSGSIZE];
+    int ret;
+
+    if (memcmp(&ridx->hdr->source, &index->hdr->source, sizeof(struct idx_source)) != 0) {
+        logger(LOG_ERROR, "The read index wasn't built with the gzip index; rebuild both");
+        return -1;
+    }
+    if (ridx_lookup(ridx, first, &start, &end) < 0) {
+        snprintf(msg, MSGSIZE, "There is no read %lu (the file has %lu reads)", first,
+                 ridx->hdr->nreads);
+        logger(LOG_ERROR, msg);
+        return -1;
+    }
+    if ((uint64_t) count > ridx->hdr->nreads - first) {
+        snprintf(msg, MSGSIZE, "Reads %lu to %lu run past the last read, %lu",
+                 first, first + count - 1, ridx->hdr->nreads - 1);
+        logger(LOG_ERROR, msg);
+        return -1;
+    }
+
+    int64_t n = idx_find_point(index, start);
+    const struct idx_point *point = idx_get_point(index, n);
+    if (NULL == point) {
+        logger(LOG_ERROR, "No access point precedes the read in the gzip index");
+        return -1;
+    }
+    snprintf(msg, MSGSIZE, "Read %lu starts at %lu, %lu bytes after access point %ld",
+             first, start, start - point->out, n);
+    logger(LOG_DEBUG, msg);
+
+    struct reads_out out = { .fd = -1 };
+    struct ib_stream strm;
+    start_inflate(&strm);
+    ret = extract(gz, index, &strm, point, start, count, &out);
+    ib_end(&strm);
+    if (ret < 0)
+        return -1;
+    if (out.len)
+        fwrite(out.str, 1, out.len, stdout);
+    free(out.str);
+    return 0;
+}
+
+/* check_source() makes sure the gzip file at path is the one the index was
+ * built from. This reads the same small, fixed amount of the file whatever
+ * its size, so it is cheap enough to do on every run
+ * @returns: 0 on success, < 0 on failure
+ */
+static int check_source(const struct idx_file *index, char *path) {
+    char msg[MSGSIZE];
+    int ret = idx_check_source(&index->hdr->source, path, msg, MSGSIZE);
+
+    if (ret < 0) {
+        logger(LOG_ERROR, msg);
+        return -1;
+    }
+    if (ret > 0)
+        logger(LOG_WARNING, msg);
+    return 0;
+}
+
+/* seq_source_matches() checks a sequence index "#source:" line against the
+ * fingerprint in the gzip index, so that the two index files can't be mixed
+ * up between builds */
+static int seq_source_matches(const char *line, const struct idx_source *src) {
+    unsigned long size;
+    long mtime;
+    unsigned head_crc, tail_crc;
+
+    if (sscanf(line, "#source: %lu,%ld,%x,%x", &size, &mtime, &head_crc, &tail_crc) != 4)
+        return 0;
+    return size == src->size && mtime == src->mtime &&
+           head_crc == src->head_crc && tail_crc == src->tail_crc;
+}
+
+/* read_seqs() reads the sequence index at fp, which has to have been built
+ * along with the gzip index fingerprinting src
+ * @returns: the entries, or NULL on failure
+ */
+static struct seq_list *read_seqs(FILE *fp, const struct idx_source *src) {
+    struct seq_list *list = NULL;
+    struct seq_entry se;
+    char line[MAXLINE];
+    char *token;
+
+    // Read each line of the file
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        /* Ignore comments, but not a sequence index of another build */
+        if (line[0] == '#') {
+            if (strncmp(line, "#source:", 8) == 0 && !seq_source_matches(line, src)) {
+                logger(LOG_ERROR, "The sequence index wasn't built with the gzip index; rebuild both");
+                return NULL;
+            }
+            continue;
+        }
+
+        /* Start sequence number */
+        token = strtok(line, ",");
+        se.seq_num = atol(token);
+
+        token = strtok(NULL, ",");
+        se.block = atoi(token);
+
+        token = strtok(NULL, ",");
+        se.start = atol(token);
+
+        list = add_seq(list, se.seq_num, se.start, se.block);
+        if (NULL == list)
+            break;
+    }
+    if (NULL == list)
+        logger(LOG_ERROR, "The sequence index is empty or couldn't be read");
+    return list;
+}
+
+/* open_mate() opens the index files of one file of a read pair: idx_path and
+ * seq_path, or the ones embedded in gzip_file if idx_path is NULL
+ * @returns: the sequence index entries, or NULL on failure
+ */
+static struct seq_list *open_mate(char *idx_path, char *seq_path, char *gzip_file,
+                                  struct idx_file *index) {
+    unsigned char *sect[EMB_NSECT] = {0};
+    uint64_t sect_len[EMB_NSECT] = {0};
+    struct seq_list *list;
+    char msg[MSGSIZE];
+    FILE *fp;
+
+    if (NULL == idx_path) {
+        if (emb_read(gzip_file, sect, sect_len, msg, MSGSIZE) != 0 ||
+            idx_open_mem(index, sect[EMB_IDX], sect_len[EMB_IDX], gzip_file, msg, MSGSIZE) < 0) {
+            logger(LOG_ERROR, msg);
+            return NULL;
+        }
+    } else if (idx_open(index, idx_path, msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
+        return NULL;
+    }
+    if (check_source(index, gzip_file) < 0)
+        return NULL;
 
-    pthread_exit((void *) ret);
+    if (NULL == idx_path)
+        fp = sect_len[EMB_SEQ] ? fmemopen(sect[EMB_SEQ], sect_len[EMB_SEQ], "r") : NULL;
+    else
+        fp = fopen(seq_path, "r");
+    if (fp == NULL) {
+        logger(LOG_ERROR, "Error opening the sequence-index file");
+        return NULL;
+    }
+    list = read_seqs(fp, &index->hdr->source);
+    fclose(fp);
+    free(sect[EMB_SEQ]);
+    free(sect[EMB_RIDX]);
+    return list;
+}
+
+/* open_output() creates the file name for the reads, sized for length bytes
+ * of them up front, as every thread writes its reads where they go in it
+ * @returns: the file descriptor, or < 0 on failure
+ */
+static int open_output(const char *name, off_t length) {
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        perror("Failed to open file");
+        return -1;
+    }
+    if (length && posix_fallocate(fd, 0, length) != 0 && ftruncate(fd, length) != 0) {
+        perror("Failed to size the output file");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* close_output() cuts the file at fd down to the size its reads came to,
+ * since the data may end short of the length in the index, and closes it
+ * @returns: 0 on success, < 0 on failure
+ */
+static int close_output(int fd, off_t size) {
+    if (ftruncate(fd, size) != 0 || close(fd) != 0) {
+        perror("Failed to write file");
+        return -1;
+    }
+    return 0;
+}
+
+/* mate_name() returns the name of the file the mates go to when only the
+ * reads' output is named: it with "_2" before its extension, as output.txt
+ * gives output_2.txt */
+static char *mate_name(const char *output) {
+    const char *base = strrchr(output, '/'), *dot;
+    size_t len = strlen(output), stem = len;
+    char *name = malloc(len + 3);
+
+    base = base != NULL ? base + 1 : output;
+    dot = strrchr(base, '.');
+    if (dot != NULL && dot != base)
+        stem = dot - output;
+    if (name != NULL)
+        snprintf(name, len + 3, "%.*s_2%s", (int) stem, output, output + stem);
+    return name;
+}
+
+/* read_pairs() extracts the reads of the two files of paired-end reads, as
+ * indexed by index-builder -p, with every thread taking the same chunks of
+ * both. The reads go to output_name (output.txt) and their mates to
+ * mate_output (output_2.txt), or with -I in turn to output_name, which with -
+ * streams them to stdout
+ * @params:
+ * argc, argv: the index files and gzip file of the first reads and then of
+ * their mates, or just the two gzip files if the indexes are embedded
+ * @returns: 0 on success, 1 on failure
+ */
+static int read_pairs(int argc, char **argv) {
+    struct idx_file index[2];
+    struct idx_input gz[2];
+    struct seq_list *list[2];
+    struct thread_pool pool;
+    char msg[MSGSIZE];
+    int embedded = argc == 2, nfiles = interleave ? 1 : 2;
+
+    for (int m = 0; m < 2; m++) {
+        char **names = argv + (embedded ? m : 3 * m);
+        char *gzip_file = embedded ? names[0] : names[2];
+        list[m] = open_mate(embedded ? NULL : names[0], embedded ? NULL : names[1],
+                            gzip_file, &index[m]);
+        if (NULL == list[m])
+            return 1;
+        if (idx_input_open(&gz[m], gzip_file, msg, MSGSIZE) < 0) {
+            logger(LOG_ERROR, msg);
+            return 1;
+        }
+    }
+
+    /* Both have to be cut at the same reads */
+    struct seq_entry *e0 = list[0]->seq_entry, *e1 = list[1]->seq_entry;
+    int same = list[0]->have == list[1]->have;
+    for (int i = 0; same && i < list[0]->have; i++)
+        same = e0[i].seq_num == e1[i].seq_num;
+    if (!same) {
+        logger(LOG_ERROR, "The mate files' sequence indexes have different chunks; "
+                          "index them together with index-builder -p");
+        return 1;
+    }
+
+    if (num_threads > list[0]->have)
+        num_threads = list[0]->have;
+    snprintf(msg, MSGSIZE, "Running with %d threads", num_threads);
+    logger(LOG_INFO, msg);
+
+    /* A range is long enough for the file that throws the most away */
+    int grain[2] = {range_grain(&index[0], list[0]), range_grain(&index[1], list[1])};
+    struct work_queue queue = {0, list[0]->have, grain[0] > grain[1] ? grain[0] : grain[1]};
+    struct task_args mate[2] = {{0}};
+    for (int m = 0; m < 2; m++) {
+        mate[m].gz = &gz[m];
+        mate[m].index = &index[m];
+        mate[m].list = list[m];
+        mate[m].fd = -1;
+        mate[m].queue = &queue;
+    }
+
+    if (NULL == output_name)
+        output_name = "output.txt";
+    if (interleave && strcmp(output_name, "-") == 0)
+        return stream_reads(mate, 1);
+
+    /* With -I the reads and their mates share one file */
+    const char *names[2] = {output_name, mate_output};
+    if (!interleave && NULL == names[1] && NULL == (names[1] = mate_name(output_name))) {
+        logger(LOG_ERROR, "Out of memory naming the mates' file");
+        return 1;
+    }
+    for (int m = 0; m < nfiles; m++) {
+        off_t length = index[m].hdr->length + (interleave ? index[1].hdr->length : 0);
+        mate[m].fd = open_output(names[m], length);
+        if (mate[m].fd < 0)
+            return 1;
+    }
+
+    struct pair_args *args = calloc(num_threads, sizeof(struct pair_args));
+    if (NULL == args) {
+        logger(LOG_ERROR, "Out of memory for the threads");
+        return 1;
+    }
+    for (int i = 0; i < num_threads; i++)
+        for (int m = 0; m < 2; m++) {
+            args[i].mate[m] = mate[m];
+            args[i].mate[m].tid = i;
+        }
+    if (tp_start(&pool, num_threads, pair_task, args, sizeof(struct pair_args)) < 0) {
+        logger(LOG_ERROR, "Couldn't start the threads");
+        exit(1);
+    }
+    tp_join(&pool, NULL);
+
+    int mismatch = 0;
+    off_t size[2] = {0, 0};
+    for (int i = 0; i < num_threads; i++) {
+        mismatch |= args[i].mismatch;
+        for (int m = 0; m < nfiles; m++)
+            if (args[i].mate[m].end > size[m])
+                size[m] = args[i].mate[m].end;
+    }
+    for (int m = 0; m < nfiles; m++)
+        if (close_output(mate[m].fd, size[m]) < 0)
+            return 1;
+    if (mismatch) {
+        logger(LOG_ERROR, "The mate files don't have the same number of reads");
+        return 1;
+    }
+    return 0;
 }
 
 //Prints the usage information on error
 void print_usage(char *argv[]) {
-    fprintf(stderr, "Usage: %s [-n N_THREADS] GZIP-INDEX.IDX SEQUENCE-INDEX.SEQ-IDX GZIP_FILE \n", argv[0]);
+    fprintf(stderr, "Usage: %s [-n N_THREADS] [-o OUTPUT] GZIP-INDEX.IDX SEQUENCE-INDEX.SEQ-IDX GZIP_FILE \n", argv[0]);
+    fprintf(stderr, "       %s [-n N_THREADS] [-o OUTPUT] GZIP_FILE_WITH_EMBEDDED_INDEX \n", argv[0]);
+    fprintf(stderr, "       %s -d READ-INDEX -r READ[:COUNT] GZIP-INDEX.IDX GZIP_FILE \n", argv[0]);
+    fprintf(stderr, "       %s -r READ[:COUNT] GZIP_FILE_WITH_EMBEDDED_INDEX \n", argv[0]);
+    fprintf(stderr, "       %s -p [-I] [-n N_THREADS] [-o OUTPUT [-o MATE_OUTPUT]] R1.IDX R1.SEQ-IDX R1_FILE R2.IDX R2.SEQ-IDX R2_FILE \n", argv[0]);
+    fprintf(stderr, "       %s -p [-I] [-n N_THREADS] [-o OUTPUT [-o MATE_OUTPUT]] R1_FILE_WITH_EMBEDDED_INDEX R2_FILE_WITH_EMBEDDED_INDEX \n", argv[0]);
 }
 
 void print_help(char *argv[]) {
     fprintf(stderr, "index-reader reads prebuilt index files for a gzipped FASTQ ");
     fprintf(stderr, "file to allow for parallel processing\n\n");
-    fprintf(stderr, "Usage: %s [-n N_THREADS] GZIP-INDEX.IDX SEQUENCE-INDEX.SEQ-IDX GZIP_FILE \n", argv[0]);
-    fprintf(stderr, "-n N_THREADS\tthe number of thread (<=16) to use (default 4)");
+    fprintf(stderr, "Usage: %s [-n N_THREADS] [-o OUTPUT] GZIP-INDEX.IDX SEQUENCE-INDEX.SEQ-IDX GZIP_FILE \n", argv[0]);
+    fprintf(stderr, "       %s [-n N_THREADS] [-o OUTPUT] GZIP_FILE_WITH_EMBEDDED_INDEX \n", argv[0]);
+    fprintf(stderr, "       %s -d READ-INDEX -r READ[:COUNT] GZIP-INDEX.IDX GZIP_FILE \n", argv[0]);
+    fprintf(stderr, "       %s -r READ[:COUNT] GZIP_FILE_WITH_EMBEDDED_INDEX \n", argv[0]);
+    fprintf(stderr, "       %s -p [-I] [-n N_THREADS] [-o OUTPUT [-o MATE_OUTPUT]] R1.IDX R1.SEQ-IDX R1_FILE R2.IDX R2.SEQ-IDX R2_FILE \n", argv[0]);
+    fprintf(stderr, "       %s -p [-I] [-n N_THREADS] [-o OUTPUT [-o MATE_OUTPUT]] R1_FILE_WITH_EMBEDDED_INDEX R2_FILE_WITH_EMBEDDED_INDEX \n", argv[0]);
+    fprintf(stderr, "-n N_THREADS\tthe number of threads to use (default one per CPU)\n");
+    fprintf(stderr, "-d READ-INDEX\tthe dense read index written by index-builder -d\n");
+    fprintf(stderr, "-o OUTPUT\twrite the reads to OUTPUT (default output.txt), or with - ");
+    fprintf(stderr, "to stdout in order as they are inflated\n");
+    fprintf(stderr, "-r READ[:COUNT]\twrite COUNT (default 1) reads starting at READ ");
+    fprintf(stderr, "(counting from 0) to stdout\n");
+    fprintf(stderr, "-p\t\tread the two files of paired-end reads indexed ");
+    fprintf(stderr, "with index-builder -p, to OUTPUT and MATE_OUTPUT (default ");
+    fprintf(stderr, "OUTPUT with _2 before its extension)\n");
+    fprintf(stderr, "-I\t\twith -p, write each read and its mate in turn ");
+    fprintf(stderr, "to OUTPUT, which can be -\n");
     fprintf(stderr, "-v\t\tenable verbose logging\n");
-    fprintf(stderr, "GZIP-INDEX.IDX\t<index file> is a CSV index file for the GZIP FASTQ file's blocks\n");
+    fprintf(stderr, "GZIP-INDEX.IDX\t<index file> is a binary index file for the GZIP FASTQ file's blocks\n");
     fprintf(stderr, "SEQUENCE-INDEX.IDX\t<index file> is a CSV index file for the GZIP FASTQ file's sequences\n");
     fprintf(stderr, "GZIP_FILE\t<gzip file> is a gzipped FASTQ file to index\n");
+    fprintf(stderr, "Given just GZIP_FILE, the index files embedded in it by ");
+    fprintf(stderr, "index-builder -e are used\n");
 }
 
 int main(int argc, char *argv[]) {
 
     FILE* fp;
-    char line[MAXLINE];
-    char* token;
-    struct access * index = NULL;
-    struct seq_list * list;
-    struct point pt = {0};
-    struct seq_entry se;
+    struct idx_file index;
+    struct seq_list * list = NULL;
     unsigned char buf[CHUNKSIZE];
     char msg[MSGSIZE];
-    pthread_t threads[MAXTHREADS];
+    struct thread_pool pool;
 
 
-    int opt;
-    while ((opt = getopt(argc, argv, "c:ho:vn:")) != -1) {
+    int opt, ret;
+    while ((opt = getopt(argc, argv, "c:d:hIo:pr:vn:")) != -1) {
         switch (opt) {
             case 'c': //chunk size
                 idx_chunk_size = atoi(optarg);
                 break;
+            case 'd': //dense read index
+                read_index_file = optarg;
+                break;
+            case 'r': //reads to extract
+                read_range = optarg;
+                break;
+            case 'p': //paired-end reads
+                paired = 1;
+                break;
+            case 'I': //interleave the mates
+                interleave = 1;
+                break;
             case 'v':
                 GLOBAL_LEVEL = LOG_DEBUG;
                 logger(LOG_DEBUG, "Debug logging enabled");
@@ -577,6 +1160,16 @@ int main(int argc, char *argv[]) {
             case 'n':
                 num_threads = atoi(optarg);
                 break;
+            case 'o': //where the reads go, and with -p their mates
+                if (output_name != NULL && mate_output != NULL) {
+                    print_usage(argv);
+                    return 1;
+                }
+                if (output_name == NULL)
+                    output_name = optarg;
+                else
+                    mate_output = optarg;
+                break;
             default:
                 print_usage(argv);
                 return 1;
@@ -587,217 +1180,192 @@ int main(int argc, char *argv[]) {
         print_usage(argv);
         return -1;
     }
-
-    snprintf(msg, MSGSIZE, "Running with %d threads", num_threads);
-    logger(LOG_INFO, msg);
-
-    /* Open and read the GZIP index CSV file.
-   * Add each struct point to the index access point list as we read it
-   */
-    fp = fopen(argv[optind], "r");
-    if (fp == NULL) {
-        printf("Error opening the file.\n");
-        exit(1);
+    if (num_threads < 1)
+        num_threads = tp_cpus();
+
+    if (paired || interleave) {
+        if (!paired || read_range != NULL || (interleave && mate_output != NULL) ||
+            (argc - optind != 2 && argc - optind != 6)) {
+            print_usage(argv);
+            return -1;
+        }
+        if (!interleave && output_name != NULL &&
+            (strcmp(output_name, "-") == 0 || (mate_output != NULL && strcmp(mate_output, "-") == 0))) {
+            logger(LOG_ERROR, "Both files of a read pair can only be streamed to stdout "
+                              "interleaved, with -I");
+            return -1;
+        }
+        if (ib_use(getenv("INFLATE_ENGINE")) < 0) {
+            snprintf(msg, MSGSIZE, "Inflate engine %s isn't built in", getenv("INFLATE_ENGINE"));
+            logger(LOG_ERROR, msg);
+            exit(1);
+        }
+        return read_pairs(argc - optind, argv + optind);
     }
 
-    // Read each line of the file
-    while (fgets(line, MAXLINE, fp) != NULL) {
-
-        int decoded_len;
-        char * decoded_string = NULL;
-
-        /* Ignore comments, except the one with the sequence number hint */
-        if (line[0] == '#') {
-
-            char * substr = strstr(line, "#sequence_skip:");
-
-            /* Didn't find the sequence */
-            if (substr == NULL) {
-                continue;
-            }
-
-            // Extract the number using strtok()
-            char * token = strtok(substr, " ");
+    /* With just the gzip file, use the index files embedded in it */
+    int embedded = (argc - optind == 1);
+    unsigned char *sect[EMB_NSECT] = {0};
+    uint64_t sect_len[EMB_NSECT] = {0};
+    char *gzip_file = argv[argc - 1];
 
-            if (token == NULL) {
-                logger(LOG_ERROR, "Error: no token found after #sequence:");
-                return 1;
-            }
-
-            token = strtok(NULL, " ");
+    if (read_range != NULL && read_index_file == NULL && !embedded) {
+        logger(LOG_ERROR, "-r needs a dense read index (-d)");
+        print_usage(argv);
+        return -1;
+    }
+    if (argc - optind != (embedded ? 1 : read_range != NULL ? 2 : 3) ||
+        (read_range != NULL && output_name != NULL) || mate_output != NULL) {
+        print_usage(argv);
+        return -1;
+    }
 
-            if (token == NULL) {
-                logger(LOG_ERROR, "Error: no number found after #sequence:");
-                return 1;
-            }
-            // Convert the number to an integer
-            idx_chunk_size = atoi(token);
+    snprintf(msg, MSGSIZE, "Running with %d threads", num_threads);
+    if (read_range == NULL)
+        logger(LOG_INFO, msg);
 
-            snprintf(msg, MSGSIZE, "Read sequence number %d", idx_chunk_size);
-            logger(LOG_DEBUG, msg);
-            continue;
+    /* Map the binary GZIP index file, or read the embedded one, which only
+     * takes reading the tail of the gzip file. The header, access point table
+     * and windows are all used in place, so there is nothing to parse */
+    if (embedded) {
+        if (emb_read(gzip_file, sect, sect_len, msg, MSGSIZE) != 0 ||
+            idx_open_mem(&index, sect[EMB_IDX], sect_len[EMB_IDX], gzip_file, msg, MSGSIZE) < 0) {
+            logger(LOG_ERROR, msg);
+            exit(1);
         }
+    } else if (idx_open(&index, argv[optind], msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
+        exit(1);
+    }
+    idx_chunk_size = index.hdr->sequence_skip;
+    snprintf(msg, MSGSIZE, "Read sequence number %d", idx_chunk_size);
+    logger(LOG_DEBUG, msg);
 
-        /* Block number */
-        token = strtok(line, ",");
-
-        /* out_offset */
-        token = strtok(NULL, ",");
-        pt.out = atol(token);
-
-        /* in_offset */
-        token = strtok(NULL, ",");
-        pt.in = atol(token);
-
-        /* bits offset */
-        token = strtok(NULL, ",");
-        pt.bits = atoi(token);
+    snprintf(msg, MSGSIZE, "Read %lu points from %s", index.have, argv[optind]);
+    logger(LOG_DEBUG, msg);
+    optind++;
 
-        /* window */
-        token = strtok(NULL, ",");
+    if (check_source(&index, gzip_file) < 0)
+        exit(1);
 
-        size_t encoded_len = strlen(token); //remove the \n
+    /* All the threads read the gzip file through one mapping of it */
+    struct idx_input gz;
+    if (idx_input_open(&gz, gzip_file, msg, MSGSIZE) < 0) {
+        logger(LOG_ERROR, msg);
+        exit(1);
+    }
+    if (ib_use(getenv("INFLATE_ENGINE")) < 0) {
+        snprintf(msg, MSGSIZE, "Inflate engine %s isn't built in", getenv("INFLATE_ENGINE"));
+        logger(LOG_ERROR, msg);
+        exit(1);
+    }
+    snprintf(msg, MSGSIZE, "Inflating with %s", ib_name());
+    logger(LOG_DEBUG, msg);
 
-        // Calculate the maximum length of the decoded string
-        size_t max_decoded_len = (encoded_len * 3);
-        decoded_string = (char*)malloc(max_decoded_len + 1);
+    /* Random access to a few reads doesn't need the sequence index */
+    if (read_range != NULL) {
+        struct ridx_file ridx;
+        uint64_t first;
+        int count;
 
-        if (decoded_string == NULL) {
-            logger(LOG_ERROR, "Error: Memory allocation failed");
+        if (parse_range(read_range, &first, &count) < 0) {
+            snprintf(msg, MSGSIZE, "Bad read range %s; it is READ or READ:COUNT, with COUNT >= 1",
+                     read_range);
+            logger(LOG_ERROR, msg);
             return 1;
         }
-
-        decoded_len = base64_decode(token, encoded_len, decoded_string, max_decoded_len);
-        if ((decoded_len) < 0) {
-            logger(LOG_ERROR, "Error: Decoded length < 0");
-            exit(129);
+        if (read_index_file != NULL)
+            ret = ridx_open(&ridx, read_index_file, msg, MSGSIZE);
+        else
+            ret = ridx_open_mem(&ridx, sect[EMB_RIDX], sect_len[EMB_RIDX], gzip_file,
+                                msg, MSGSIZE);
+        if (ret < 0) {
+            logger(LOG_ERROR, msg);
+            return 1;
         }
-
-        decoded_string[WINSIZE] = '\0';
-        strcpy(pt.window, decoded_string);
-
-        index = add_read_point(index, pt.bits, pt.in, pt.out, decoded_string);
+        ret = extract_reads(&gz, &index, &ridx, first, count);
+        ridx_close(&ridx);
+        idx_close(&index);
+        return ret < 0 ? 1 : 0;
     }
-    // Close the file
-    fclose(fp);
-
-    snprintf(msg, MSGSIZE, "Read %d points from %s", index->have, argv[optind]);
-    logger(LOG_DEBUG, msg);
-    optind++;
 
     /* Open and read the sequence index CSV file.
  * Add each sequence to the sequence list as we read it */
-    fp = fopen(argv[optind], "r");
+    if (embedded)
+        fp = sect_len[EMB_SEQ] ? fmemopen(sect[EMB_SEQ], sect_len[EMB_SEQ], "r") : NULL;
+    else
+        fp = fopen(argv[optind], "r");
     if (fp == NULL) {
         logger(LOG_ERROR, "Error opening the sequence-index file");
         exit(1);
     }
 
-    // Read each line of the file
-    while (fgets(line, MAXLINE, fp) != NULL) {
-        /* Ignore comments */
-        if (line[0] == '#') {
-            continue;
-        }
-
-        /* Start sequence number */
-        token = strtok(line, ",");
-        se.seq_num = atol(token);
-
-        token = strtok(NULL, ",");
-        se.block = atoi(token);
-
-        token = strtok(NULL, ",");
-        se.start = atol(token);
-
-        list = add_seq(list, se.seq_num, se.start, se.block);
-    }
+    list = read_seqs(fp, &index.hdr->source);
+    if (NULL == list)
+        exit(1);
     // Close the file
     fclose(fp);
-    snprintf(msg, MSGSIZE, "Read %d points from %s", list->have, argv[optind]);
+    free(sect[EMB_SEQ]);
+    free(sect[EMB_RIDX]);
+    snprintf(msg, MSGSIZE, "Read %d points from %s", list->have,
+             embedded ? gzip_file : argv[optind]);
     logger(LOG_DEBUG, msg);
-    optind++;
 
     /* If we have more threads than sequence chunks, reduce the number of threads */
     if (num_threads > list->have) {
         snprintf(msg, MSGSIZE, "Setting num_threads to %d from %d", list->have, num_threads);
         logger(LOG_INFO, msg);
         num_threads = list->have;
-    } else if (num_threads > MAXTHREADS) {
-        snprintf(msg, MSGSIZE, "Max number of threads is %d", MAXTHREADS);
-        logger(LOG_INFO, msg);
-        num_threads = MAXTHREADS;
     }
 
 
-    struct task_args args[MAXTHREADS] = {0};
-    // create threads
-    for (int i = 0; i < num_threads; i++) {
-        snprintf(msg, MSGSIZE, "Starting thread %d", i);
-        logger(LOG_DEBUG, msg);
-
-        double float_stride = (double)  list->have / num_threads;
-        int stride = (int) floor(float_stride);
-        int thread_start = stride * i;
-        int thread_end;
-
-        if ((stride * (i + 1)) < list->have) {
-            thread_end = stride * (i + 1);
-        } else {
-            thread_end = list->have;
-        }
+    if (NULL == output_name) {
+        output_name = "output.txt";
+    } else if (strcmp(output_name, "-") == 0) {
+        struct task_args ta = {0};
+        ta.gz = &gz;
+        ta.index = &index;
+        ta.list = list;
+        ta.fd = -1;
+        return stream_reads(&ta, 0);
+    }
 
-        /* Set up the args struct for this thread */
-        args[i].tid = i;
-        args[i].filename = strndup(argv[optind], strlen(argv[optind]));
-        args[i].index = index;
-        args[i].list = list;
-        args[i].start = thread_start;
+    int out_fd = open_output(output_name, index.hdr->length);
+    if (out_fd < 0)
+        return 1;
 
-        //last thread, read until end
-        if (i == (num_threads - 1))
-            args[i].stop = -1;
-        else
-            args[i].stop = thread_end;
+    struct work_queue queue = {0, list->have, range_grain(&index, list)};
+    snprintf(msg, MSGSIZE, "Taking %d chunks at a time", queue.grain);
+    logger(LOG_DEBUG, msg);
 
-        pthread_create(&threads[i], NULL, task, &args[i]);
+    struct task_args *args = calloc(num_threads, sizeof(struct task_args));
+    if (NULL == args) {
+        logger(LOG_ERROR, "Out of memory for the threads");
+        return 1;
     }
-
-    char * thread_results[MAXTHREADS];
-    // wait for threads to finish
     for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], (void **) &thread_results[i]);
-        //pthread_join(threads[i], (void *) thread_results[i]);
-        //thread_results[i] = malloc(strlen(res));
-        //strncpy(thread_results[i], res, strlen(res));
-
-        //printf("Thread: %d\n", i);
-        //printf("i: %d: %s\n", i, res);
+        /* Set up the args struct for this thread */
+        args[i].tid = i;
+        args[i].gz = &gz;
+        args[i].index = &index;
+        args[i].list = list;
+        args[i].fd = out_fd;
+        args[i].queue = &queue;
     }
-
-    off_t size = 0;
-    for (int i = 0; i < num_threads; i++) {
-/*
-        printf("%s", thread_results[i]);
-        fflush(stdout);
-*/
-        size += strlen(thread_results[i]);
+    if (tp_start(&pool, num_threads, task, args, sizeof(struct task_args)) < 0) {
+        logger(LOG_ERROR, "Couldn't start the threads");
+        exit(1);
     }
+    // wait for threads to finish
+    tp_join(&pool, NULL);
 
+    off_t size = 0;
+    for (int i = 0; i < num_threads; i++)
+        if (args[i].end > size)
+            size = args[i].end;
     printf("total len: %ld\n", size);
-
-    FILE* file = fopen("output.txt", "w");
-    if (file == NULL) {
-        perror("Failed to open file");
+    if (close_output(out_fd, size) < 0)
         return 1;
-    }
-
-    for (int i = 0; i < num_threads; i++) {
-        fputs(thread_results[i], file);
-        //fputc('\n', file); // add newline character after each string
-    }
-
-    fclose(file);
 
     return 0;
 }
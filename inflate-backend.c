@@ -0,0 +1,97 @@
+#include <string.h>
+#include "inflate-backend.h"
+
+#define IB_DEFAULT IB_ZLIB
+
+static const char *names[] = { "zlib" };
+static int engine = IB_DEFAULT;
+
+int ib_use(const char *name) {
+    if (NULL == name || '\0' == *name) {
+        engine = IB_DEFAULT;
+        return 0;
+    }
+    if (strcmp(name, names[IB_ZLIB]) == 0) {
+        engine = IB_ZLIB;
+        return 0;
+    }
+    return -1;
+}
+
+const char *ib_name(void) {
+    return names[engine];
+}
+
+int ib_init(struct ib_stream *s) {
+    s->next_in = Z_NULL;
+    s->avail_in = 0;
+    s->next_out = Z_NULL;
+    s->avail_out = 0;
+    s->engine = engine;
+    s->header = 0;
+    s->z.zalloc = Z_NULL;
+    s->z.zfree = Z_NULL;
+    s->z.opaque = Z_NULL;
+    s->z.avail_in = 0;
+    s->z.next_in = Z_NULL;
+    return inflateInit2(&s->z, -15);
+}
+
+int ib_reset(struct ib_stream *s) {
+    s->header = 0;
+    return inflateReset2(&s->z, -15);
+}
+
+int ib_prime(struct ib_stream *s, int bits, int value) {
+    return inflatePrime(&s->z, bits, value);
+}
+
+int ib_set_dictionary(struct ib_stream *s, const unsigned char *dict, unsigned len) {
+    return inflateSetDictionary(&s->z, dict, len);
+}
+
+
+int ib_inflate(struct ib_stream *s) {
+    int ret;
+
+    s->z.next_in = s->next_in;
+    s->z.avail_in = s->avail_in;
+    s->z.next_out = s->next_out;
+    s->z.avail_out = s->avail_out;
+    ret = inflate(&s->z, Z_SYNC_FLUSH);
+    s->next_in = s->z.next_in;
+    s->avail_in = s->z.avail_in;
+    s->next_out = s->z.next_out;
+    s->avail_out = s->z.avail_out;
+    return ret;
+}
+
+int ib_header(struct ib_stream *s) {
+    unsigned char none;
+    int ret;
+
+    /* zlib reads the header for every engine: with Z_BLOCK it returns as soon
+     * as the header is done, before taking any of the deflate data */
+    if (!s->header) {
+        if (inflateReset2(&s->z, 31) != Z_OK)
+            return Z_STREAM_ERROR;
+        s->header = 1;
+    }
+    s->z.next_in = s->next_in;
+    s->z.avail_in = s->avail_in;
+    s->z.next_out = &none;
+    s->z.avail_out = 0;
+    ret = inflate(&s->z, Z_BLOCK);
+    s->next_in = s->z.next_in;
+    s->avail_in = s->z.avail_in;
+    if (ret != Z_OK && ret != Z_BUF_ERROR)
+        return ret < 0 ? ret : Z_DATA_ERROR;
+    if (!(s->z.data_type & 128))
+        return 0;
+    ret = ib_reset(s);
+    return ret == Z_OK ? 1 : ret;
+}
+
+void ib_end(struct ib_stream *s) {
+    (void) inflateEnd(&s->z);
+}
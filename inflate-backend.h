@@ -0,0 +1,60 @@
+#ifndef INFLATE_BACKEND_H
+#define INFLATE_BACKEND_H
+
+#include <zlib.h>
+
+/* inflate-backend puts the raw deflate decoders the readers can use behind
+ * one small interface, so that a faster one can be added without touching
+ * them. Only zlib is there for now. The engine is picked at run time with
+ * the INFLATE_ENGINE environment variable ("zlib"), and is zlib otherwise.
+ * Return codes are zlib's, whatever the engine. The builder needs to stop at
+ * the end of every deflate block for its access points, so it keeps using
+ * zlib directly. */
+
+enum ib_engine {
+    IB_ZLIB
+};
+
+/* ib_stream is a raw inflate stream, used like a z_stream through next_in,
+ * avail_in, next_out and avail_out */
+struct ib_stream {
+    unsigned char *next_in;
+    unsigned avail_in;
+    unsigned char *next_out;
+    unsigned avail_out;
+    int engine;             /* enum ib_engine */
+    int header;             /* 1 while in a gzip header */
+    z_stream z;             /* the zlib engine, and gzip headers for all */
+};
+
+/* ib_use() makes the engine called name the one ib_init() sets up, or the
+ * default if name is NULL. Returns < 0 if there is no such engine built in */
+int ib_use(const char *name);
+
+/* ib_name() returns the name of the engine ib_init() sets up */
+const char *ib_name(void);
+
+/* ib_init() sets up s for raw inflate. Returns Z_OK or a zlib error */
+int ib_init(struct ib_stream *s);
+
+/* ib_reset() sets up s for a new raw deflate stream */
+int ib_reset(struct ib_stream *s);
+
+/* ib_prime() and ib_set_dictionary() are inflatePrime() and
+ * inflateSetDictionary(), to be used before the first ib_inflate() */
+int ib_prime(struct ib_stream *s, int bits, int value);
+int ib_set_dictionary(struct ib_stream *s, const unsigned char *dict, unsigned len);
+
+/* ib_inflate() decompresses like inflate() with Z_SYNC_FLUSH, returning
+ * Z_STREAM_END at the end of the deflate stream with next_in just past it */
+int ib_inflate(struct ib_stream *s);
+
+/* ib_header() skips the gzip member header at next_in and sets s up for the
+ * deflate data after it. Returns 1 once the header is skipped, 0 if it
+ * needs more input, or < 0 if it isn't a gzip header */
+int ib_header(struct ib_stream *s);
+
+/* ib_end() frees what s holds */
+void ib_end(struct ib_stream *s);
+
+#endif
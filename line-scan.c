@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include "line-scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LS_X86
+#endif
+
+typedef size_t (*find_fn)(const unsigned char *, size_t, size_t *);
+
+/* find_scalar() is ls_find() a byte at a time, also used for the tails the
+ * vector kernels leave */
+static size_t find_scalar(const unsigned char *buf, size_t len, size_t *n) {
+    size_t seen = 0;
+
+    for (size_t i = 0; i < len; i++)
+        if (buf[i] == '\n' && ++seen == *n)
+            return i;
+    *n -= seen;
+    return len;
+}
+
+/* select_bit() is the position of the k-th (0-based) set bit of mask */
+static unsigned select_bit(uint32_t mask, size_t k) {
+    while (k--)
+        mask &= mask - 1;
+    return __builtin_ctz(mask);
+}
+
+#ifdef LS_X86
+__attribute__((target("sse2,popcnt")))
+static size_t find_sse2(const unsigned char *buf, size_t len, size_t *n) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0, left = *n;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        size_t count = __builtin_popcount(mask);
+
+        if (count >= left)
+            return i + select_bit(mask, left - 1);
+        left -= count;
+    }
+    size_t at = find_scalar(buf + i, len - i, &left);
+    if (at == len - i)
+        *n = left;
+    return i + at;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t find_avx2(const unsigned char *buf, size_t len, size_t *n) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0, left = *n;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        size_t count = __builtin_popcount(mask);
+
+        if (count >= left)
+            return i + select_bit(mask, left - 1);
+        left -= count;
+    }
+    size_t at = find_scalar(buf + i, len - i, &left);
+    if (at == len - i)
+        *n = left;
+    return i + at;
+}
+#endif
+
+/* pick_find() chooses the widest kernel this CPU can run */
+static find_fn pick_find(void) {
+#ifdef LS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        return find_avx2;
+    if (__builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt"))
+        return find_sse2;
+#endif
+    return find_scalar;
+}
+
+/* Every thread picks the same kernel, so a race to set this is harmless */
+static find_fn find_impl;
+
+size_t ls_find(const unsigned char *buf, size_t len, size_t *n) {
+    if (find_impl == NULL)
+        find_impl = pick_find();
+    return find_impl(buf, len, n);
+}
+
+size_t ls_count(const unsigned char *buf, size_t len) {
+    size_t n = SIZE_MAX;
+
+    ls_find(buf, len, &n);
+    return SIZE_MAX - n;
+}
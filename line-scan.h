@@ -0,0 +1,21 @@
+#ifndef LINE_SCAN_H
+#define LINE_SCAN_H
+
+#include <stddef.h>
+
+/* Newline scanning for decompressed FASTQ. Counting lines is the one thing
+ * done to every byte the builder inflates, so it is done 16 or 32 bytes at a
+ * time: compare against '\n', take the mask of matches and popcount it. Only
+ * a block holding the newline being looked for is searched bit by bit. The
+ * widest kernel the CPU supports is picked on first use, with a plain loop
+ * for everything else. */
+
+/* ls_find() returns the offset of the *n-th (counting from 1) newline in the
+ * len bytes at buf. If there are fewer than *n it returns len and takes the
+ * number there are off *n */
+size_t ls_find(const unsigned char *buf, size_t len, size_t *n);
+
+/* ls_count() returns the number of newlines in the len bytes at buf */
+size_t ls_count(const unsigned char *buf, size_t len);
+
+#endif
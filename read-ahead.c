@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include "read-ahead.h"
+
+#define RA_ALIGN 4096
+
+/* reader() fills the buffers that aren't in use until the data runs out */
+static void *reader(void *arg) {
+    struct read_ahead *ra = arg;
+
+    pthread_mutex_lock(&ra->lock);
+    for (;;) {
+        while (!ra->quit && ra->filled - (ra->taken - ra->held) == RA_BUFS)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        if (ra->quit)
+            break;
+        int slot = ra->filled % RA_BUFS;
+        size_t want = ra->left < RA_SIZE ? ra->left : RA_SIZE;
+        pthread_mutex_unlock(&ra->lock);
+
+        /* the slot isn't the consumer's until filled goes past it */
+        size_t got = want ? fread(ra->buf[slot], 1, want, ra->fp) : 0;
+        int err = got < want && ferror(ra->fp);
+
+        pthread_mutex_lock(&ra->lock);
+        if (got == 0 || err) {
+            ra->err = err;
+            break;
+        }
+        ra->len[slot] = got;
+        ra->left -= got;
+        ra->filled++;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    ra->end = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+int ra_start(struct read_ahead *ra, FILE *fp, uint64_t limit) {
+    int i;
+
+    memset(ra, 0, sizeof(struct read_ahead));
+    ra->fp = fp;
+    ra->left = limit;
+    for (i = 0; i < RA_BUFS; i++)
+        if (posix_memalign((void **) &ra->buf[i], RA_ALIGN, RA_SIZE) != 0) {
+            ra->buf[i] = NULL;
+            goto ra_start_error;
+        }
+
+    /* only a hint: it fails harmlessly on a pipe */
+    (void) posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    if (pthread_create(&ra->thread, NULL, reader, ra) != 0) {
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        goto ra_start_error;
+    }
+    return 0;
+
+    ra_start_error:
+    for (i = 0; i < RA_BUFS; i++)
+        free(ra->buf[i]);
+    return -1;
+}
+
+int ra_next(struct read_ahead *ra, unsigned char **buf, size_t *len) {
+    int ret = 0;
+
+    pthread_mutex_lock(&ra->lock);
+    if (ra->held) {
+        ra->held = 0;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    while (ra->filled == ra->taken && !ra->end)
+        pthread_cond_wait(&ra->cond, &ra->lock);
+    if (ra->filled > ra->taken) {
+        int slot = ra->taken % RA_BUFS;
+        *buf = ra->buf[slot];
+        *len = ra->len[slot];
+        ra->taken++;
+        ra->held = 1;
+    } else {
+        *buf = NULL;
+        *len = 0;
+        ret = ra->err ? -1 : 0;
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return ret;
+}
+
+void ra_stop(struct read_ahead *ra) {
+    int i;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->quit = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    for (i = 0; i < RA_BUFS; i++)
+        free(ra->buf[i]);
+    memset(ra->buf, 0, sizeof(ra->buf));
+}
@@ -0,0 +1,47 @@
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* read-ahead reads a file on a thread of its own, so that waiting for a slow
+ * disk or a network filesystem overlaps with decompressing what was read
+ * before. The thread fills RA_BUFS buffers of RA_SIZE bytes, aligned to a
+ * page, in turn, and tells the kernel the file is read sequentially so it
+ * reads further ahead too. The consumer takes the buffers in order with
+ * ra_next(), holding one at a time; the other ones are being filled. */
+
+#define RA_BUFS 3
+#define RA_SIZE (1U << 20)
+
+struct read_ahead {
+    FILE *fp;
+    uint64_t left;                  /* bytes still to read */
+    unsigned char *buf[RA_BUFS];
+    size_t len[RA_BUFS];
+    uint64_t filled;                /* buffers filled so far */
+    uint64_t taken;                 /* buffers handed out so far */
+    int held;                       /* 1 while the consumer has one */
+    int end;                        /* 1 once the thread has stopped */
+    int err;                        /* 1 if reading failed */
+    int quit;                       /* 1 to make the thread stop */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* ra_start() starts reading at most limit bytes from fp, from where it is.
+ * Returns < 0 if the buffers or the thread can't be had */
+int ra_start(struct read_ahead *ra, FILE *fp, uint64_t limit);
+
+/* ra_next() gives back the buffer handed out last and points *buf at the
+ * next one, setting *len to its length, which is 0 at the end of the file
+ * or the limit. Returns < 0 on a read error */
+int ra_next(struct read_ahead *ra, unsigned char **buf, size_t *len);
+
+/* ra_stop() stops the thread and frees the buffers. What it had read but not
+ * handed out is lost, and fp is left wherever the thread got to */
+void ra_stop(struct read_ahead *ra);
+
+#endif
@@ -1,15 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 #include <zlib.h>
 #include <getopt.h>
 #include <time.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../inflate-backend.h"
+#include "../thread-pool.h"
 
 #define BUFSIZE 16384
-#define MAXTHREADS 16
 
 struct index_entry {
     char is_last_entry;
@@ -70,7 +72,7 @@ char* extract_reads(const char* fastq_gz_filename, fastq_gz_index* index, uint64
     FILE* fp;
     struct index_entry* start_entry;
     struct index_entry* curr_entry = index->index;
-    z_stream stream;
+    struct ib_stream stream;
     uint64_t compressed_data_len, reads_len;
     char* compressed_data_buffer;
     char* reads_buffer;
@@ -111,19 +113,21 @@ char* extract_reads(const char* fastq_gz_filename, fastq_gz_index* index, uint64
     }
 
 	fseek(fp, start_entry->byte_offset, SEEK_SET);
+    if (ib_init(&stream) != Z_OK) {
+        printf("Error initializing stream state for decompression\n");
+        exit(-1);
+    }
     stream.avail_in = fread(compressed_data_buffer, 1, compressed_data_len, fp);
     stream.avail_out = reads_len;
     stream.next_in = (Bytef *) compressed_data_buffer;
     stream.next_out = (Bytef *) reads_buffer;
-    stream.zalloc = Z_NULL;
-    stream.zfree = Z_NULL;
-    stream.opaque = Z_NULL;
-    if (inflateInit2(&stream, (start_entry->byte_offset) ? -15 : 47) != Z_OK) {
-        printf("Error initializing stream state for decompression\n");
+    if (!start_entry->byte_offset && ib_header(&stream) != 1) {
+        printf("Error reading the gzip header\n");
         exit(-1);
     }
 
-	inflate(&stream, Z_FINISH);
+	ib_inflate(&stream);
+    ib_end(&stream);
 
     uint64_t start_read_start_pos;
     uint64_t end_read_end_pos;
@@ -150,12 +154,12 @@ char* extract_reads(const char* fastq_gz_filename, fastq_gz_index* index, uint64
     return reads_buffer;
 }
 
-// chunks are 1-indexed
-char* extract_chunks(const char* fastq_gz_filename, fastq_gz_index* index, uint64_t start_chunk, uint64_t n) {
+// chunks are 1-indexed; *len is set to the length of the reads returned
+char* extract_chunks(const char* fastq_gz_filename, fastq_gz_index* index, uint64_t start_chunk, uint64_t n, uint64_t* len) {
     FILE* fp;
     struct index_entry* start_entry;
     struct index_entry* end_entry;
-    z_stream stream;
+    struct ib_stream stream;
     uint64_t compressed_data_len, reads_len;
     char* compressed_data_buffer;
     char* reads_buffer;
@@ -184,37 +188,82 @@ char* extract_chunks(const char* fastq_gz_filename, fastq_gz_index* index, uint6
     }
 
 	fseek(fp, start_entry->byte_offset, SEEK_SET);
+    if (ib_init(&stream) != Z_OK) {
+        printf("Error initializing stream state for decompression\n");
+        exit(-1);
+    }
     stream.avail_in = fread(compressed_data_buffer, 1, compressed_data_len, fp);
+    fclose(fp);
     stream.avail_out = reads_len;
     stream.next_in = (Bytef *) compressed_data_buffer;
     stream.next_out = (Bytef *) reads_buffer;
-    stream.zalloc = Z_NULL;
-    stream.zfree = Z_NULL;
-    stream.opaque = Z_NULL;
-    if (inflateInit2(&stream, (start_entry->byte_offset) ? -15 : 47) != Z_OK) {
-        printf("Error initializing stream state for decompression\n");
+    if (!start_entry->byte_offset && ib_header(&stream) != 1) {
+        printf("Error reading the gzip header\n");
         exit(-1);
     }
 
-	inflate(&stream, Z_FINISH);
-    reads_buffer[reads_len - stream.avail_out] = 0;
+	ib_inflate(&stream);
+    ib_end(&stream);
+    free(compressed_data_buffer);
+    *len = reads_len - stream.avail_out;
+    reads_buffer[*len] = 0;
 
     //fwrite(reads_buffer, 1, reads_len - stream.avail_out, stdout);
 
     return reads_buffer;
 }
 
+// The threads don't split the chunks between them up front: each takes the
+// next one when it is done with the last, so a part of the file that is slow
+// to read or inflate doesn't leave the other threads idle
+struct work_queue {
+    uint64_t next;          // the next chunk to hand out
+    uint64_t stop;          // one past the last chunk
+};
+
+// take_chunk() sets *chunk to the next chunk, returning 0 once there are none
+int take_chunk(struct work_queue* queue, uint64_t* chunk) {
+    *chunk = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+    return *chunk < queue->stop;
+}
+
 struct task_args {
-    uint64_t start;
-    uint64_t nchunks;
+    struct work_queue* queue;
     const char* fastq_gz_filename; 
     fastq_gz_index* index;
+    int fd;                 // the output file
+    uint64_t base;          // where the first chunk starts in the FASTQ
 };
 
+// write_at() writes len bytes of buf to fd at offset, returning < 0 on failure
+int write_at(int fd, const char* buf, uint64_t len, uint64_t offset) {
+    while (len) {
+        ssize_t w = pwrite(fd, buf, len, offset);
+        if (w < 0)
+            return -1;
+        buf += w;
+        len -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+// Every chunk is written straight to where it goes in the output file, which
+// the index gives, so the reads are never all held in memory
 void* task(void* args) {
     struct task_args* task_args = (struct task_args*) args;
-    char* reads = extract_chunks(task_args->fastq_gz_filename, task_args->index, task_args->start, task_args->nchunks);
-    pthread_exit(reads);
+    uint64_t chunk, len;
+
+    while (take_chunk(task_args->queue, &chunk)) {
+        char* reads = extract_chunks(task_args->fastq_gz_filename, task_args->index, chunk, 1, &len);
+        uint64_t offset = task_args->index->index[chunk - 1].uncompressed_len - task_args->base;
+        if (write_at(task_args->fd, reads, len, offset) < 0) {
+            printf("Failed to write the reads\n");
+            exit(1);
+        }
+        free(reads);
+    }
+    return NULL;
 }
 
 void parallel_read(const char* fastq_gz_filename, fastq_gz_index* index, const char* out_filename, uint64_t start, uint64_t nchunks, int nthreads) {
@@ -224,43 +273,27 @@ void parallel_read(const char* fastq_gz_filename, fastq_gz_index* index, const c
     else if (nthreads >= index->size) {
         printf("Setting num_threads to %llu from %d", index->size - 1, nthreads);
         nthreads = index->size - 1;
-    } 
-    else if (nthreads > MAXTHREADS) {
-        printf("Max number of threads is %d", MAXTHREADS);
-        nthreads = MAXTHREADS;
-    }
-
-    uint64_t n_per_thread = (int) floor((double) nchunks / nthreads);
-    
-    pthread_t threads[MAXTHREADS];
-    struct task_args args[MAXTHREADS];
-    for (uint64_t i = 0; i < nthreads; i++) {
-        args[i].start = start + (n_per_thread * i);
-        args[i].nchunks = (i == nthreads - 1) ? start + nchunks - args[i].start : n_per_thread;
-        args[i].fastq_gz_filename = fastq_gz_filename;
-        args[i].index = index;
-        pthread_create(&threads[i], NULL, task, &args[i]);
     }
 
-    char* thread_results[MAXTHREADS];
-    for (uint64_t i = 0; i < nthreads; i++) {
-        pthread_join(threads[i], (void **) &thread_results[i]);
-    }
-
-    FILE* fp = fopen(out_filename, "w");
-    if (!fp) {
+    int fd = open(out_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
         printf("Failed to open %s for writing\n", out_filename);
         exit(1);
     }
 
-    for (uint64_t i = 0; i < nthreads; i++) {
-        fprintf(fp, "%s", thread_results[i]);
-        free(thread_results[i]);
+    struct thread_pool pool;
+    struct work_queue queue = {start, start + nchunks};
+    struct task_args args = {&queue, fastq_gz_filename, index, fd, index->index[start - 1].uncompressed_len};
+    if (tp_start(&pool, nthreads, task, &args, 0) < 0) {
+        printf("Failed to start the threads\n");
+        exit(1);
     }
+    tp_join(&pool, NULL);
+    close(fd);
 }
 
 int main(int argc, char* argv[]) {
-    int nthreads = 1;
+    int nthreads = 0;
 
     if (!(argc == 4 || argc == 5)) {
         printf("Usage: %s <gz> <index> <output> [nthreads]\n", argv[0]);
@@ -269,6 +302,13 @@ int main(int argc, char* argv[]) {
     if (argc == 5) {
         nthreads = atoi(argv[4]);
     }
+    if (nthreads < 1) {
+        nthreads = tp_cpus();
+    }
+    if (ib_use(getenv("INFLATE_ENGINE")) < 0) {
+        printf("Inflate engine %s isn't built in\n", getenv("INFLATE_ENGINE"));
+        exit(1);
+    }
 
 	fastq_gz_index* index = read_index_file(argv[2]);
 
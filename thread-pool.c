@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "thread-pool.h"
+
+#define CG_ROOT "/sys/fs/cgroup"
+
+/* dir_quota() returns the CPU quota set in the cgroup directory dir, v1's
+ * cpu.cfs_quota_us or else v2's cpu.max, in whole CPUs rounded up, or 0 if
+ * it sets none */
+static int dir_quota(const char *dir, int v1) {
+    char name[PATH_MAX + 32];
+    long long quota = -1, period = 0;
+    FILE *fp;
+
+    if (v1) {
+        snprintf(name, sizeof(name), "%s/cpu.cfs_quota_us", dir);
+        fp = fopen(name, "r");
+        if (fp != NULL) {
+            if (fscanf(fp, "%lld", &quota) != 1)
+                quota = -1;
+            fclose(fp);
+        }
+        snprintf(name, sizeof(name), "%s/cpu.cfs_period_us", dir);
+        fp = fopen(name, "r");
+        if (fp != NULL) {
+            if (fscanf(fp, "%lld", &period) != 1)
+                period = 0;
+            fclose(fp);
+        }
+    } else {
+        snprintf(name, sizeof(name), "%s/cpu.max", dir);
+        fp = fopen(name, "r");
+        if (fp != NULL) {
+            /* "max 100000" when there's no limit */
+            if (fscanf(fp, "%lld %lld", &quota, &period) != 2)
+                quota = -1;
+            fclose(fp);
+        }
+    }
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return (int) ((quota + period - 1) / period);
+}
+
+/* own_cgroup() puts the path of the process's cgroup from /proc/self/cgroup
+ * in path: the one of the v1 cpu controller if it has one, and *v1 = 1, or
+ * else the v2 one, and *v1 = 0
+ * Returns < 0 if it has neither */
+static int own_cgroup(char *path, size_t size, int *v1) {
+    char line[PATH_MAX + 64];
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    int found = 0;
+
+    if (NULL == fp)
+        return -1;
+    while (!(found && *v1) && fgets(line, sizeof(line), fp) != NULL) {
+        /* "ID:CONTROLLERS:PATH", with no controllers for v2 */
+        char *ctl = strchr(line, ':'), *cg, *tok, *save;
+        int cpu = 0;
+
+        if (NULL == ctl || NULL == (cg = strchr(++ctl, ':')))
+            continue;
+        *cg++ = '\0';
+        cg[strcspn(cg, "\n")] = '\0';
+        if ('\0' == *ctl) {
+            if (found)
+                continue;
+            *v1 = 0;
+        } else {
+            for (tok = strtok_r(ctl, ",", &save); tok != NULL && !cpu;
+                 tok = strtok_r(NULL, ",", &save))
+                cpu = strcmp(tok, "cpu") == 0;
+            if (!cpu)
+                continue;
+            *v1 = 1;
+        }
+        snprintf(path, size, "%s", cg);
+        found = 1;
+    }
+    fclose(fp);
+    return found ? 0 : -1;
+}
+
+/* cgroup_quota() returns the CPU quota of the process's cgroup in whole CPUs,
+ * rounded up, or 0 if there is none. The cgroups it is in count too, as a
+ * quota is usually set on a slice rather than the service itself, and the
+ * tightest one applies. In a cgroup namespace the process's cgroup is "/",
+ * the container's own */
+static int cgroup_quota(void) {
+    char cg[PATH_MAX], dir[PATH_MAX];
+    int v1, root, quota = 0;
+
+    if (own_cgroup(cg, sizeof(cg), &v1) < 0) {
+        strcpy(cg, "/");
+        v1 = access(CG_ROOT "/cpu.max", F_OK) != 0;
+    }
+    root = snprintf(dir, sizeof(dir), "%s", v1 ? CG_ROOT "/cpu" : CG_ROOT);
+    if (strcmp(cg, "/") != 0 &&
+        snprintf(dir + root, sizeof(dir) - root, "%s", cg) >= (int) sizeof(dir) - root)
+        dir[root] = '\0';
+    for (;;) {
+        int q = dir_quota(dir, v1);
+        char *up = strrchr(dir + root, '/');
+
+        if (q > 0 && (0 == quota || q < quota))
+            quota = q;
+        if (NULL == up)
+            break;
+        *up = '\0';
+    }
+    return quota;
+}
+
+int tp_cpus(void) {
+    cpu_set_t set;
+    int cpus = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        cpus = CPU_COUNT(&set);
+    if (cpus < 1)
+        cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+
+    int quota = cgroup_quota();
+    if (quota > 0 && quota < cpus)
+        cpus = quota;
+    return cpus;
+}
+
+int tp_start(struct thread_pool *tp, int n, void *(*fn)(void *), void *args,
+             size_t size) {
+    tp->n = 0;
+    tp->threads = NULL;
+    if (n < 1)
+        return -1;
+    tp->threads = malloc(n * sizeof(pthread_t));
+    if (NULL == tp->threads)
+        return -1;
+    while (tp->n < n &&
+           pthread_create(&tp->threads[tp->n], NULL, fn, (char *) args + tp->n * size) == 0)
+        tp->n++;
+    return tp->n == n ? 0 : -1;
+}
+
+void tp_join(struct thread_pool *tp, void **results) {
+    for (int i = 0; i < tp->n; i++)
+        pthread_join(tp->threads[i], results != NULL ? &results[i] : NULL);
+    free(tp->threads);
+    tp->threads = NULL;
+    tp->n = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* The tools run their work on a pool of threads of any size, with no limit
+ * built in. By default it has a thread for every CPU the process may run on,
+ * but no more than the CPU quota of its cgroup (cgroup v2 cpu.max or v1
+ * cpu.cfs_quota_us), or of a cgroup it is in, rounded up. The cgroup is
+ * the one /proc/self/cgroup names, so that a container or a systemd slice
+ * limited to a few CPUs of a large machine doesn't start a thread for
+ * every one of them. */
+
+/* tp_cpus() returns that default, which is at least 1 */
+int tp_cpus(void);
+
+/* thread_pool is the threads started by one tp_start() */
+struct thread_pool {
+    pthread_t *threads;
+    int n;
+};
+
+/* tp_start() starts n threads running fn, giving the i-th element i of the
+ * array args of size-byte elements, or all of them args if size is 0.
+ * Returns < 0 if n < 1 or not all of them could be started; tp_join() then
+ * still waits for the ones that were */
+int tp_start(struct thread_pool *tp, int n, void *(*fn)(void *), void *args,
+             size_t size);
+
+/* tp_join() waits for the threads of tp to finish, putting what each one
+ * returned in results unless it is NULL, and frees tp */
+void tp_join(struct thread_pool *tp, void **results);
+
+#endif